@@ -0,0 +1,68 @@
+//usr/bin/env gcc -O2 -Wall -rdynamic "$0" -o /tmp/bench-backends -ldl -pthread && exec /tmp/bench-backends "$@"
+
+// Compares the cold start time (compile and load every installer) of the
+// available backends. Has to be run from the repository root:
+//   $ ./bench/backends.c [RUNS]
+
+#define main sys_setup_main
+#include "../sys-setup.c"
+#undef main
+
+#include <time.h>
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void bench(const char *label, Backend backend, char *cache, size_t runs)
+{
+    state.backend = backend;
+    state.cache_dir = cache;
+    double min = 0, total = 0;
+    size_t loaded = 0;
+    for (size_t r = 0; r < runs; r += 1) {
+        const double start = now_ms();
+        state.available = discover_installers();
+        Sizes all = zero(Sizes);
+        for (size_t i = 0; i < state.available.len; i += 1)
+            da_append(&all, i);
+        loaded = all.len - materialize_installers(all);
+        const double took = now_ms() - start;
+
+        for (size_t i = 0; i < state.available.len; i += 1)
+            unload_installer(&state.available.items[i]);
+        free(all.items);
+        free(state.available.items);
+
+        total += took;
+        if (0 == r || took < min)
+            min = took;
+    }
+    printf("%-12s %9zu %9.2f %9.2f\n", label, loaded, min, total / runs);
+}
+
+int main(int argc, char **argv)
+{
+    size_t runs = argc > 1 ? strtoul(argv[1], NULL, 10) : 5;
+    if (0 == runs)
+        runs = 1;
+
+    log_min_level = LL_Error;
+    state.cc = "gcc";
+    state.cflags = strs("-ggdb");
+    state.jobs = 1;
+    char *cache = cache_dir();
+
+    printf("%-12s %9s %9s %9s\n", "backend", "installers", "min [ms]", "avg [ms]");
+    bench("gcc", BE_Gcc, NULL, runs);
+    if (cache)
+        bench("gcc (cache)", BE_Gcc, cache, runs);
+    if (load_libtcc())
+        bench("tcc", BE_Tcc, NULL, runs);
+    else
+        printf("%-12s libtcc is not available\n", "tcc");
+    return 0;
+}
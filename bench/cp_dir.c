@@ -0,0 +1,98 @@
+//usr/bin/env gcc -O2 -Wall -rdynamic "$0" -o /tmp/bench-cp-dir -ldl -pthread && exec /tmp/bench-cp-dir "$@"
+
+// Compares the throughput of cp_dir with and without io_uring on a synthetic
+// tree shaped like `test/test_dirs` (nested d1, d2, d3 directories):
+//   $ ./bench/cp_dir.c [FILES] [MAX_FILE_SIZE]
+// By default: 100000 files of up to 4096 bytes.
+
+#define main sys_setup_main
+#include "../sys-setup.c"
+#undef main
+
+#include <time.h>
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of bytes written
+static size_t generate(char *root, size_t files, size_t max_size)
+{
+    static const size_t fan_out = 3, depth = 6;
+    char content[1 << 16];
+    for (size_t i = 0; i < sizeof(content); i += 1)
+        content[i] = 'a' + i % 26;
+    if (max_size > sizeof(content))
+        max_size = sizeof(content);
+
+    size_t bytes = 0;
+    char path[PATH_MAX];
+    for (size_t i = 0; i < files; i += 1) {
+        // Every file gets a directory derived from its index
+        int len = snprintf(path, sizeof(path), "%s", root);
+        size_t n = i;
+        for (size_t d = 0; d < depth; d += 1, n /= fan_out) {
+            len += snprintf(path + len, sizeof(path) - len, "/d%zu", n % fan_out + 1);
+            mkdir(path, 0755);
+        }
+        snprintf(path + len, sizeof(path) - len, "/%zu.txt", i);
+        Fd fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (INVALID_FILE_DES == fd)
+            die("Failed to create %s:", path);
+        size_t size = max_size ? (i * 7919) % (max_size + 1) : 0;
+        if (size != (size_t) write(fd, content, size))
+            die("Failed to write %s:", path);
+        bytes += size;
+        close(fd);
+    }
+    return bytes;
+}
+
+static void bench(const char *label, bool io_uring, Tree_Node *src, char *dst,
+                  size_t files, size_t bytes)
+{
+    cmd_exec(strs("rm", "-rf", dst));
+    state.io_uring = io_uring;
+    const double start = now_s();
+    bool ok = cp_dir(src, dst, NULL);
+    const double took = now_s() - start;
+    bool same = 0 == cmd_exec(strs("diff", "-r", "-q", src->name, dst));
+    printf("%-10s %10.3f %12.0f %10.1f %s\n", label, took, files / took,
+           bytes / (1024.0 * 1024.0) / took, ok && same ? "ok" : "FAILED");
+}
+
+int main(int argc, char **argv)
+{
+    size_t files = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t max_size = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+
+    log_min_level = LL_Error;
+    char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *root = concat(tmp, "/sys-setup-bench-cp-dir");
+    char *src = concat(root, "/src");
+    char *dst = concat(root, "/dst");
+    cmd_exec(strs("rm", "-rf", root));
+    if (!_mkdirs(src, 0755))
+        return 1;
+
+    printf("Generating %zu files...\n", files);
+    size_t bytes = generate(src, files, max_size);
+
+    Tree_Node tre;
+    double start = now_s();
+    if (!tree(src, FF_Any, 100, &tre))
+        return 1;
+    printf("tree: %.3fs\n\n", now_s() - start);
+
+    printf("%-10s %10s %12s %10s\n", "path", "time [s]", "files/s", "MiB/s");
+    bench("sync", false, &tre, dst, files, bytes);
+    bench("io_uring", true, &tre, dst, files, bytes);
+    if (!state.io_uring)
+        printf("io_uring is not available, the sync path was used\n");
+
+    cmd_exec(strs("rm", "-rf", root));
+    return 0;
+}
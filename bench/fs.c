@@ -0,0 +1,431 @@
+//usr/bin/env gcc -O2 -Wall -rdynamic "$0" -o /tmp/bench-fs -ldl -pthread && exec /tmp/bench-fs "$@"
+
+// Times the file system primitives ls, tree, cp, cp_dir and rm on a synthetic
+// tree, each one cold (caches dropped before every run) and warm:
+//   $ ./bench/fs.c [--runs=N] [--baseline=FILE] [--tolerance=PERCENT]
+//                  [FILES [FAN_OUT [DEPTH [MAX_FILE_SIZE]]]]
+// By default: 3 runs on 10000 files in a tree with a fan out of 4 and a depth
+// of 4. File sizes are log-uniform up to 65536 bytes, so most files are small.
+// E.g. `./bench/fs.c 19 3 3 16` resembles `test/test_dirs`, while
+// `./bench/fs.c 1000000 16 4` stresses large trees.
+//
+// Results of the fastest run are written as JSON to stdout, progress goes to
+// stderr. Besides the time every result holds the deltas of /proc/self/io
+// (syscr and syscw count read and write like system calls) and getrusage, and
+// the peak RSS during the run. With --baseline the results are compared with a
+// previous output, the exit code is 1 if anything got slower than PERCENT
+// (default 10).
+// Dropping the page cache needs root, otherwise cold runs only evict the file
+// contents using posix_fadvise.
+
+#define main sys_setup_main
+#include "../sys-setup.c"
+#undef main
+
+#include <sys/resource.h>
+#include <time.h>
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    size_t files, fan_out, depth, max_size;
+    char *src, *dst;
+    // Absolute paths, directories in pre-order
+    Strings src_dirs, src_files, dst_dirs, dst_files;
+    size_t bytes;
+    Tree_Node tree;
+} Fixture;
+
+static const char *io_keys[] = { "rchar", "wchar", "syscr", "syscw", "read_bytes", "write_bytes" };
+#define IO_KEYS (sizeof(io_keys) / sizeof(*io_keys))
+
+typedef struct {
+    const char *name;
+    const char *mode;
+    double seconds;
+    unsigned long long io[IO_KEYS];
+    struct rusage ru;
+    long peak_rss_kib;
+    bool ok;
+} Sample;
+
+static void read_io(unsigned long long *io)
+{
+    FILE *f = fopen("/proc/self/io", "r");
+    char key[32];
+    unsigned long long value;
+    memset(io, 0, IO_KEYS * sizeof(*io));
+    while (f && 2 == fscanf(f, "%31[^:]: %llu\n", key, &value)) {
+        for (size_t i = 0; i < IO_KEYS; i += 1) {
+            if (0 == strcmp(key, io_keys[i]))
+                io[i] = value;
+        }
+    }
+    if (f)
+        fclose(f);
+}
+
+// Resets the peak RSS, so it is the peak of the following run only
+static void reset_peak_rss()
+{
+    Fd fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (INVALID_FILE_DES == fd)
+        return;
+    if (1 != write(fd, "5", 1))
+        msg(LL_Warn, "Failed to reset the peak RSS:");
+    close(fd);
+}
+
+static long peak_rss_kib()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kib = -1;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (1 == sscanf(line, "VmHWM: %ld kB", &kib))
+            break;
+    }
+    if (f)
+        fclose(f);
+    return kib;
+}
+
+// Returns how caches are dropped
+static const char *drop_caches(const Fixture *fx)
+{
+    sync();
+    Fd fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (INVALID_FILE_DES != fd) {
+        const bool ok = 1 == write(fd, "3", 1);
+        close(fd);
+        if (ok)
+            return "drop_caches";
+    }
+    const Strings *all[] = { &fx->src_files, &fx->dst_files };
+    for (size_t i = 0; i < 2; i += 1) {
+        for (size_t j = 0; j < all[i]->len; j += 1) {
+            Fd f = open(all[i]->items[j], O_RDONLY);
+            if (INVALID_FILE_DES == f)
+                continue;
+            posix_fadvise(f, 0, 0, POSIX_FADV_DONTNEED);
+            close(f);
+        }
+    }
+    return "fadvise";
+}
+
+// Log-uniform sizes up to max_size, deterministic for the same index
+static size_t file_size(size_t i, size_t max_size)
+{
+    if (0 == max_size)
+        return 0;
+    uint64_t r = _hash(FNV_OFFSET, &i, sizeof(i));
+    size_t bits = 0;
+    while (((size_t) 1 << bits) <= max_size)
+        bits += 1;
+    size_t size = (size_t) 1 << (r % bits);
+    size += (r >> 8) % size;
+    return size > max_size ? max_size : size;
+}
+
+static void collect_dirs(Fixture *fx, char *rel, size_t depth)
+{
+    da_append(&fx->src_dirs, concat(fx->src, rel));
+    da_append(&fx->dst_dirs, concat(fx->dst, rel));
+    for (size_t i = 0; depth < fx->depth && i < fx->fan_out; i += 1) {
+        char name[32];
+        snprintf(name, sizeof(name), "/d%zu", i);
+        collect_dirs(fx, concat(rel, name), depth + 1);
+    }
+}
+
+static void generate(Fixture *fx)
+{
+    collect_dirs(fx, "", 0);
+    for (size_t i = 0; i < fx->src_dirs.len; i += 1) {
+        if (-1 == mkdir(fx->src_dirs.items[i], 0755) && EEXIST != errno)
+            die("Failed to create %s:", fx->src_dirs.items[i]);
+    }
+
+    char content[1 << 16];
+    for (size_t i = 0; i < sizeof(content); i += 1)
+        content[i] = 'a' + i % 26;
+    for (size_t i = 0; i < fx->files; i += 1) {
+        // Files are spread over all directories
+        const size_t dir = i % fx->src_dirs.len;
+        char name[32];
+        snprintf(name, sizeof(name), "/f%zu", i);
+        char *path = concat(fx->src_dirs.items[dir], name);
+        da_append(&fx->src_files, path);
+        da_append(&fx->dst_files, concat(fx->dst_dirs.items[dir], name));
+
+        Fd fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (INVALID_FILE_DES == fd)
+            die("Failed to create %s:", path);
+        for (size_t left = file_size(i, fx->max_size); left > 0;) {
+            const size_t n = left < sizeof(content) ? left : sizeof(content);
+            if ((ssize_t) n != write(fd, content, n))
+                die("Failed to write %s:", path);
+            fx->bytes += n;
+            left -= n;
+        }
+        close(fd);
+    }
+}
+
+// Untimed preparation of a run: the destination either does not exist, only
+// has its directories or is a full copy of the source.
+typedef enum { DST_None, DST_Dirs, DST_Copy } Dst;
+
+static void prepare(Fixture *fx, Dst dst)
+{
+    cmd_exec(strs("rm", "-rf", fx->dst));
+    if (DST_Dirs == dst) {
+        for (size_t i = 0; i < fx->dst_dirs.len; i += 1)
+            mkdir(fx->dst_dirs.items[i], 0755);
+    } else if (DST_Copy == dst && !cp_dir(&fx->tree, fx->dst, NULL)) {
+        die("Failed to copy %s", fx->src);
+    }
+}
+
+static bool run_ls(Fixture *fx)
+{
+    bool ok = true;
+    for (size_t i = 0; i < fx->src_dirs.len; i += 1) {
+        Ls_Files files;
+        ok = ls(fx->src_dirs.items[i], FF_Any ^ (FF_Current | FF_Parent), &files) && ok;
+    }
+    return ok;
+}
+
+static bool run_tree(Fixture *fx)
+{
+    Tree_Node tre;
+    return tree(fx->src, FF_Any, fx->depth + 1, &tre);
+}
+
+static bool run_cp(Fixture *fx)
+{
+    bool ok = true;
+    for (size_t i = 0; i < fx->src_files.len; i += 1)
+        ok = cp(fx->src_files.items[i], fx->dst_files.items[i]) && ok;
+    return ok;
+}
+
+static bool run_cp_dir(Fixture *fx)
+{
+    return cp_dir(&fx->tree, fx->dst, NULL);
+}
+
+static bool run_rm(Fixture *fx)
+{
+    // Directories are removed after their content, children before parents
+    Strings dirs = zero(Strings);
+    for (size_t i = fx->dst_dirs.len; i > 0; i -= 1)
+        da_append(&dirs, fx->dst_dirs.items[i - 1]);
+    const bool ok = 0 == rm(fx->dst_files) && 0 == rm(dirs);
+    _free(dirs.items);
+    return ok;
+}
+
+typedef struct {
+    const char *name;
+    bool (*run)(Fixture *fx);
+    Dst dst;
+    // Whether throughput is reported in bytes too
+    bool bytes;
+} Primitive;
+
+static const Primitive primitives[] = {
+    { "ls",     run_ls,     DST_None, false },
+    { "tree",   run_tree,   DST_None, false },
+    { "cp",     run_cp,     DST_Dirs, true  },
+    { "cp_dir", run_cp_dir, DST_None, true  },
+    { "rm",     run_rm,     DST_Copy, false },
+};
+
+static Sample measure(Fixture *fx, const Primitive *p, bool cold, size_t runs,
+                      const char **cold_method)
+{
+    Sample best = { .name = p->name, .mode = cold ? "cold" : "warm", .seconds = -1 };
+    if (!cold) {
+        // Warms up the caches
+        prepare(fx, p->dst);
+        const size_t scope = scope_push();
+        p->run(fx);
+        scope_pop(scope);
+    }
+    for (size_t r = 0; r < runs; r += 1) {
+        prepare(fx, p->dst);
+        if (cold)
+            *cold_method = drop_caches(fx);
+
+        Sample s = best;
+        unsigned long long io[IO_KEYS];
+        struct rusage ru;
+        reset_peak_rss();
+        read_io(io);
+        getrusage(RUSAGE_SELF, &ru);
+        const size_t scope = scope_push();
+        const double start = now_s();
+        s.ok = p->run(fx);
+        s.seconds = now_s() - start;
+        scope_pop(scope);
+        getrusage(RUSAGE_SELF, &s.ru);
+        read_io(s.io);
+        s.peak_rss_kib = peak_rss_kib();
+
+        for (size_t i = 0; i < IO_KEYS; i += 1)
+            s.io[i] -= io[i];
+        s.ru.ru_minflt -= ru.ru_minflt;
+        s.ru.ru_majflt -= ru.ru_majflt;
+        s.ru.ru_inblock -= ru.ru_inblock;
+        s.ru.ru_oublock -= ru.ru_oublock;
+        s.ru.ru_nvcsw -= ru.ru_nvcsw;
+        s.ru.ru_nivcsw -= ru.ru_nivcsw;
+        if (best.seconds < 0 || s.seconds < best.seconds || !s.ok)
+            best = s;
+        if (!s.ok)
+            break;
+    }
+    fprintf(stderr, "%-8s %s %10.4fs %s\n", best.name, best.mode, best.seconds,
+            best.ok ? "ok" : "FAILED");
+    return best;
+}
+
+// Prints the result as one line, the baseline is read back line by line
+static void print_sample(const Fixture *fx, const Sample *s, bool bytes, bool last)
+{
+    const size_t entries = fx->src_dirs.len + fx->src_files.len;
+    printf("    {\"name\": \"%s\", \"mode\": \"%s\", \"seconds\": %.6f, \"ok\": %s, "
+           "\"entries_per_s\": %.0f, \"mib_per_s\": %.2f",
+           s->name, s->mode, s->seconds, s->ok ? "true" : "false", entries / s->seconds,
+           bytes ? fx->bytes / (1024.0 * 1024.0) / s->seconds : 0.0);
+    for (size_t i = 0; i < IO_KEYS; i += 1)
+        printf(", \"%s\": %llu", io_keys[i], s->io[i]);
+    printf(", \"minflt\": %ld, \"majflt\": %ld, \"inblock\": %ld, \"oublock\": %ld, "
+           "\"nvcsw\": %ld, \"nivcsw\": %ld, \"peak_rss_kib\": %ld}%s\n",
+           s->ru.ru_minflt, s->ru.ru_majflt, s->ru.ru_inblock, s->ru.ru_oublock,
+           s->ru.ru_nvcsw, s->ru.ru_nivcsw, s->peak_rss_kib, last ? "" : ",");
+}
+
+// The part of the config, that has to match the baseline
+static void shape(const Fixture *fx, char *buf, size_t len)
+{
+    snprintf(buf, len, "\"files\": %zu, \"fan_out\": %zu, \"depth\": %zu, \"max_size\": %zu",
+             fx->files, fx->fan_out, fx->depth, fx->max_size);
+}
+
+// Returns the number of regressions
+static size_t compare(const Fixture *fx, const char *path, const Sample *samples, size_t n,
+                      double tolerance)
+{
+    Fd fd = open(path, O_RDONLY);
+    if (INVALID_FILE_DES == fd)
+        die("Failed to open baseline %s:", path);
+    Buffer text = read_all(fd);
+    close(fd);
+    if (!text.items)
+        die("Failed to read baseline %s", path);
+    da_append(&text, '\0');
+
+    char config[256];
+    shape(fx, config, sizeof(config));
+    if (!strstr(text.items, config))
+        fprintf(stderr, "\nThe baseline was measured on a different tree\n");
+
+    size_t regressions = 0;
+    fprintf(stderr, "\n%-8s %-4s %12s %12s %8s\n", "name", "mode", "baseline [s]", "now [s]", "change");
+    for (size_t i = 0; i < n; i += 1) {
+        char key[64];
+        snprintf(key, sizeof(key), "{\"name\": \"%s\", \"mode\": \"%s\",",
+                 samples[i].name, samples[i].mode);
+        char *line = strstr(text.items, key);
+        char *seconds = line ? strstr(line, "\"seconds\": ") : NULL;
+        if (!seconds) {
+            fprintf(stderr, "%-8s %-4s %12s %12.4f\n", samples[i].name, samples[i].mode,
+                    "-", samples[i].seconds);
+            continue;
+        }
+        const double base = strtod(seconds + strlen("\"seconds\": "), NULL);
+        const double change = base > 0 ? (samples[i].seconds / base - 1) * 100 : 0;
+        const bool regression = change > tolerance;
+        regressions += regression;
+        fprintf(stderr, "%-8s %-4s %12.4f %12.4f %+7.1f%%%s\n", samples[i].name,
+                samples[i].mode, base, samples[i].seconds, change,
+                regression ? " REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    size_t runs = 3;
+    const char *baseline = NULL;
+    double tolerance = 10;
+    int pos = 0;
+    Fixture fx = { .files = 10000, .fan_out = 4, .depth = 4, .max_size = 65536 };
+    size_t *positional[] = { &fx.files, &fx.fan_out, &fx.depth, &fx.max_size };
+    for (int i = 1; i < argc; i += 1) {
+        if (0 == strncmp(argv[i], "--runs=", 7))
+            runs = strtoul(argv[i] + 7, NULL, 10);
+        else if (0 == strncmp(argv[i], "--baseline=", 11))
+            baseline = argv[i] + 11;
+        else if (0 == strncmp(argv[i], "--tolerance=", 12))
+            tolerance = strtod(argv[i] + 12, NULL);
+        else if (pos < 4)
+            *positional[pos++] = strtoul(argv[i], NULL, 10);
+        else
+            die("Unexpected argument: %s", argv[i]);
+    }
+    if (0 == runs || 0 == fx.fan_out)
+        die("RUNS and FAN_OUT have to be positive");
+
+    log_min_level = LL_Error;
+    state.io_uring = true;
+    char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *root = concat(tmp, "/sys-setup-bench-fs");
+    fx.src = concat(root, "/src");
+    fx.dst = concat(root, "/dst");
+    cmd_exec(strs("rm", "-rf", root));
+    if (!_mkdirs(root, 0755))
+        return 1;
+
+    fprintf(stderr, "Generating %zu files...\n", fx.files);
+    generate(&fx);
+    if (!tree(fx.src, FF_Any, fx.depth + 1, &fx.tree))
+        die("Failed to collect %s", fx.src);
+
+    const size_t n = 2 * sizeof(primitives) / sizeof(*primitives);
+    Sample samples[n];
+    bool bytes[n];
+    const char *cold_method = "none";
+    for (size_t i = 0; i < n; i += 1) {
+        samples[i] = measure(&fx, &primitives[i / 2], 0 == i % 2, runs, &cold_method);
+        bytes[i] = primitives[i / 2].bytes;
+    }
+
+    char config[256];
+    shape(&fx, config, sizeof(config));
+    printf("{\n");
+    printf("  \"config\": {%s, \"dirs\": %zu, \"bytes\": %zu, \"runs\": %zu, \"cold\": \"%s\", "
+           "\"io_uring\": %s},\n", config, fx.src_dirs.len, fx.bytes, runs, cold_method,
+           state.io_uring ? "true" : "false");
+    printf("  \"results\": [\n");
+    for (size_t i = 0; i < n; i += 1)
+        print_sample(&fx, &samples[i], bytes[i], i + 1 == n);
+    printf("  ]\n}\n");
+
+    size_t regressions = baseline ? compare(&fx, baseline, samples, n, tolerance) : 0;
+    cmd_exec(strs("rm", "-rf", root));
+
+    bool ok = true;
+    for (size_t i = 0; i < n; i += 1)
+        ok = ok && samples[i].ok;
+    return ok && 0 == regressions ? 0 : 1;
+}
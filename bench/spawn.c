@@ -0,0 +1,87 @@
+//usr/bin/env gcc -O2 -Wall -rdynamic "$0" -o /tmp/bench-spawn -ldl -pthread && exec /tmp/bench-spawn "$@"
+
+// Compares the latency of spawning `true` through cmd_execw (posix_spawn)
+// with the previous fork + execvp implementation, once with a small and once
+// with a large resident heap:
+//   $ ./bench/spawn.c [ITERATIONS] [HEAP_MIB]
+// By default: 1000 spawns each, with 0 and 512 MiB of touched heap.
+
+#define main sys_setup_main
+#include "../sys-setup.c"
+#undef main
+
+#include <time.h>
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The spawn path of cmd_execa before it used posix_spawn
+static int fork_exec(Cmd cmd)
+{
+    int out[2];
+    if (-1 == pipe2(out, O_CLOEXEC))
+        die("Failed to create pipe:");
+    Pid id = fork();
+    if (id < 0)
+        die("Failed to fork:");
+    if (id == 0) {
+        dup2(out[PIPE_WRITE], STDOUT_FILENO);
+        close(out[PIPE_READ]);
+        da_append(&cmd, NULL);
+        execvp(cmd.items[0], (char*const*)cmd.items);
+        _exit(127);
+    }
+    close(out[PIPE_WRITE]);
+    char buf[64];
+    while (read(out[PIPE_READ], buf, sizeof(buf)) > 0);
+    close(out[PIPE_READ]);
+    int status;
+    waitpid(id, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void bench(const char *label, bool spawn, Cmd cmd, size_t iterations, size_t heap_mib)
+{
+    const double start = now_s();
+    size_t failures = 0;
+    for (size_t i = 0; i < iterations; i += 1) {
+        Buffer out = zero(Buffer);
+        const size_t scope = scope_push();
+        failures += 0 != (spawn ? cmd_execw(cmd, NULL, &out, NULL) : fork_exec(cmd));
+        scope_pop(scope);
+    }
+    const double took = now_s() - start;
+    printf("%-12s %10zu %12.1f %12.0f %s\n", label, heap_mib, took / iterations * 1e6,
+           iterations / took, failures ? "FAILED" : "ok");
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    size_t heap_mib = argc > 2 ? strtoul(argv[2], NULL, 10) : 512;
+
+    log_min_level = LL_Error;
+    Cmd cmd = strs("true");
+
+    printf("%-12s %10s %12s %12s\n", "path", "heap [MiB]", "spawn [us]", "spawns/s");
+    bench("fork", false, cmd, iterations, 0);
+    bench("posix_spawn", true, cmd, iterations, 0);
+
+    if (heap_mib) {
+        // Every 4 KiB page is touched, so fork has to copy its page table
+        char *heap = mmap(NULL, heap_mib << 20, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == heap)
+            die("Failed to allocate %zu MiB:", heap_mib);
+        madvise(heap, heap_mib << 20, MADV_NOHUGEPAGE);
+        memset(heap, 1, heap_mib << 20);
+        bench("fork", false, cmd, iterations, heap_mib);
+        bench("posix_spawn", true, cmd, iterations, heap_mib);
+        munmap(heap, heap_mib << 20);
+    }
+    return 0;
+}
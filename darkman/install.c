@@ -9,13 +9,13 @@ bool run_install()
 
     Tree_Node cfg;
     fail_if(!tree("darkman/config/", FF_Any, 10, &cfg), "failed to collect config files");
-    char *cfg_target = concat(getenv("XDG_CONFIG_HOME"), "darkman");
-    fail_if(!cp_dir(&cfg, cfg_target, NULL), "failed to copy config files");
+    char *cfg_target = concat(getenv("XDG_CONFIG_HOME"), "/darkman");
+    fail_if(!link_dir(&cfg, cfg_target, NULL), "failed to link config files");
 
     Tree_Node lcl;
     fail_if(!tree("darkman/local-share/", FF_Any, 1, &lcl), "failed to collect scripts");
-    char *lcl_target = concat(getenv("XDG_DATA_HOME"), "darkman");
-    fail_if(!cp_dir(&lcl, lcl_target, NULL), "failed to copy scripts");
+    char *lcl_target = concat(getenv("XDG_DATA_HOME"), "/darkman");
+    fail_if(!cp_dir_sync(&lcl, lcl_target, NULL, CP_Sync | CP_Prune, NULL), "failed to copy scripts");
 
     return true;
 }
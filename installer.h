@@ -19,6 +19,10 @@
 #define DA_INIT_CAP (8)
 #define DA_STRUCT(item_ty) struct { item_ty *items; size_t len, cap; }
 
+// Like realloc, but items allocated in an allocation scope stay inside of it.
+// @see scope_push
+API void *_da_realloc(void *items, size_t old_size, size_t new_size);
+
 #define zero(ty) ((ty) { 0 })
 #define shift(arr, len) (assert((len) > 0 && "Can't shift the array any more"), (len) -= 1, *(arr)++)
 #define ignore_param (void)
@@ -27,11 +31,13 @@
 #define da_reserve(da, space) do {                                              \
     if ((da)->cap >= (da)->len + (space))                                       \
         break;                                                                  \
+    const size_t _old_cap_ = (da)->cap;                                         \
     if ((da)->cap == 0)                                                         \
         (da)->cap = DA_INIT_CAP;                                                \
     while ((da)->cap < (da)->len + (space))                                     \
         (da)->cap *= 2;                                                         \
-    (da)->items = realloc((da)->items, (da)->cap * sizeof(*(da)->items));       \
+    (da)->items = _da_realloc((da)->items, _old_cap_ * sizeof(*(da)->items),    \
+                              (da)->cap * sizeof(*(da)->items));                \
     if (!(da)->items)                                                           \
         die("Reallocation failed:");                                            \
 } while (0);
@@ -162,12 +168,19 @@ typedef struct {
     // called again.
     bool request_reload;
     void *reload_data;
-    // TODO: support dependencies?
+    // NOTE: Dependencies have to be known before `setup` is called, they are
+    //       therefore declared using `dependencies`.
 } Setup_Result;
 
 #define setup_ok() ((Setup_Result) { .ok = true })
 #define setup_reload(data) ((Setup_Result) { .reload = true, .reload_data = (data) })
 
+// `NULL` terminated list of installer names, that have to finish successfully
+// before this installer is run. Installers without (transitive) dependencies on
+// each other may run concurrently.
+// e.g.: `const char *dependencies[] = { "dwm", NULL };`
+INSTALLER_OPTIONAL  extern const char *dependencies[];
+
 INSTALLER_OPTIONAL  Setup_Result setup(Context ctx);
 
 INSTALLER_NECESSARY bool run_install(void);
@@ -221,10 +234,27 @@ struct tree_node {
         Tree_Nodes children;
         File_Filter file_type;
     };
+    // Set for directories deeper than max_depth, their children are unknown
+    bool truncated;
 };
 
 typedef bool (*Tree_Node_Filter_fn)(const Tree_Node *node);
 
+typedef enum {
+    CP_None  = 0,
+    CP_Sync  = 1 << 0,    // Skip files with equal size and modification time
+    CP_Hash  = 1 << 1,    // Skip files with equal size and content
+    CP_Prune = 1 << 2,    // Delete destination entries missing in the source
+} Cp_Flags;
+
+typedef struct {
+    size_t copied;
+    size_t skipped;
+    size_t deleted;
+    // Number of bytes copied
+    size_t bytes;
+} Cp_Stats;
+
 typedef Strings Cmd;
 
 typedef enum {
@@ -232,6 +262,9 @@ typedef enum {
     IOR_stdout = 1 << 0,
     IOR_stderr = 1 << 1,
     IOR_stdin  = 1 << 2,
+    // Forward stdout and stderr line by line to the log, prefixed with the
+    // name of the running installer. Implies IOR_stdout and IOR_stderr.
+    IOR_forward = 1 << 3,
 } IO_Redirect;
 
 typedef pid_t Pid;
@@ -245,10 +278,19 @@ typedef struct {
     Fd stderr_;
     // Use macros as documented in `wait(2)`
     int status;
+    // @see IO_Redirect
+    int redirects;
 } Process;
 
 typedef DA_STRUCT(Process) Processes;
 
+typedef struct {
+    // Exit code or -1, like the return value of cmd_execw
+    int code;
+    Buffer out;
+    Buffer err;
+} Cmd_Result;
+
 // :utility
 
 // If fmt ends with ':' errno will also be printed using perror
@@ -259,24 +301,50 @@ API void die_loc(Source_Loc loc, char *fmt, ...);
     die_loc(src_loc(), (fmt), ##__VA_ARGS__)
 
 // If fmt ends with ':' errno will also be printed using perror
+// Messages are written asynchronously, errors are flushed right away.
 __attribute__((format(printf, 3, 4)))
 API void msg_loc(Source_Loc loc, Log_Level ll, char *fmt, ...);
 
-#define msg(ll, fmt, ...) \
-    msg_loc(src_loc(), (ll), (fmt), ##__VA_ARGS__)
-
-// Registered pointers are automatically freed at execution stop. Do not free
-// them, otherwise a double free will happen. Multiple registrations of the same
-// pointer won't be problematic.
-// You may assume, that every pointer you receive through any function marked as
-// API is already registered.
+// Set by `--verbose`, msg compares against it without a function call.
+API extern Log_Level log_min_level;
+
+// Messages below LOG_MIN_LEVEL are removed at compile time, e.g. with
+// -DLOG_MIN_LEVEL=LL_Info. Arguments are only evaluated if the message is
+// logged.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LL_Trace
+#endif
+
+#define msg(ll, fmt, ...) do {                                                  \
+    if ((ll) >= LOG_MIN_LEVEL && (ll) >= log_min_level)                         \
+        msg_loc(src_loc(), (ll), (fmt), ##__VA_ARGS__);                         \
+} while (0)
+
+// :memory
+// Everything returned by functions marked as API is allocated inside the
+// current allocation scope. Each installer runs inside its own scope, which is
+// released once `cleanup` returned. Do not free such memory.
+// Dynamic arrays (da_*) allocated inside a scope also grow inside of it.
+
+// Returns memory aligned for any type, valid until the current scope is popped.
+API void *arena_alloc(size_t size);
+
+// Opens a new scope and returns a handle for `scope_pop`, e.g. to release
+// temporary allocations of each loop iteration.
+API size_t scope_push(void);
+
+// Releases everything allocated and registered since the matching
+// `scope_push`, including all scopes opened after it.
+API void scope_pop(size_t scope);
+
+// Registered pointers are freed once the current scope is popped, at the latest
+// at execution stop. Do not free them, otherwise a double free will happen.
+// Multiple registrations of the same pointer inside the same scope won't be
+// problematic. Registered pointers must not be reallocated.
 __attribute__((nonnull))
 API void _register_ptr(void *ptr);
 
-#define register_ptr(ptr) do {                                                  \
-    msg(LL_Trace, "Registered pointer %p", (ptr));                              \
-    _register_ptr(ptr);                                                         \
-} while(0);
+#define register_ptr(ptr) _register_ptr(ptr)
 
 #define register_ptrs(ptrs, n) for (size_t _i_ = 0; _i_ < (n); _i_ += 1) { \
     register_ptr((ptrs)[_i_]); \
@@ -317,8 +385,11 @@ __attribute__((nonnull))
 API bool ls(char *dir, int ff, Ls_Files *result);
 
 // @see File_Filter
-// As long as max_depth > 0: FF_Directory is implied.
+// As long as max_depth > 0: FF_Directory is implied. Directories deeper than
+// max_depth are included without children if FF_Directory is passed.
 // FF_Current and FF_Parent are always ignored.
+// Children are sorted: files before directories, then by name. They must not
+// be modified, as all nodes share one allocation.
 API bool tree(char *dir, int ff, size_t max_depth, Tree_Node *result);
 
 // Returns the number of errors. If 0 nothing went wrong.
@@ -330,6 +401,22 @@ API bool cp(char *from, char *to);
 __attribute__((nonnull(1, 2)))
 API bool cp_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter);
 
+// @see Cp_Flags
+// Like `cp_dir` but may skip unchanged files and remove stale ones. Entries
+// excluded by `filter` are never removed. `stats` may be NULL.
+__attribute__((nonnull(1, 2)))
+API bool cp_dir_sync(Tree_Node *from, char *to, Tree_Node_Filter_fn filter, int flags,
+                     Cp_Stats *stats);
+
+// Like `cp_dir` but creates symlinks into `from` instead of copies, so later
+// changes show up without running the installer again. Directories, that do
+// not exist in `to` yet, are linked as a whole unless `filter` excludes
+// something inside them. Files with the same content as their source are
+// replaced. Anything else in the way, that is not a symlink into `from`, is
+// reported and nothing is changed in that case.
+__attribute__((nonnull(1, 2)))
+API bool link_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter);
+
 API bool write_all(Fd fd, Buffer bytes);
 
 // On failure are `Buffer.items == NULL` and `Buffer.cap == 0`
@@ -337,6 +424,7 @@ API Buffer read_all(Fd fd);
 
 // :command :process
 
+// Returns INVALID_PROCESS if the command could not be executed.
 // @see IO_Redirect
 API ASYNC Process cmd_execa(Cmd cmd, int redirects);
 
@@ -345,18 +433,52 @@ API bool prcs_write(Process p, char *in);
 
 // Return value of true just means, that the process is not running anymore.
 // For information about how it stopped use p->status.
-// NOTE: .item pointers for out and err will already be registered for later freeing.
+// Closes stdin, then drains stdout and stderr concurrently while the process
+// runs. Output without a Buffer is discarded (or only forwarded), so a chatty
+// child can never block on a full pipe. The child is reaped after both reached
+// EOF.
+// NOTE: .item pointers for out and err are allocated in the current scope.
 __attribute__((nonnull(1)))
 API bool prcs_await(Process *p, Buffer *out, Buffer *err);
 
 // Returns the exit code or -1 if anything went wrong and/or the process exited
 // abnormally.
-// NOTE: .item pointers for out and err will already be registered for later freeing.
+// NOTE: .item pointers for out and err are allocated in the current scope.
 API int cmd_execw(Cmd cmd, char *in, Buffer *out, Buffer *err);
 
 #define cmd_exec(cmd) \
     cmd_execw(cmd, NULL, NULL, NULL)
 
+// Runs all `n` commands with at most `max_parallel` (0 means one per CPU) at
+// the same time and returns how many of them did not exit with 0.
+// If `results` is not NULL it must hold `n` elements, which receive the exit
+// code and captured output of the command with the same index. Otherwise the
+// output is forwarded to the log.
+// NOTE: .item pointers of the results are allocated in the current scope.
+API size_t cmd_exec_many(Cmd *cmds, size_t n, size_t max_parallel, Cmd_Result *results);
+
+// :journal
+// Steps are fingerprinted by their keys, the content of their inputs (files or
+// directories), the working directory and parts of the environment. A step
+// that succeeded with the same fingerprint is skipped, as long as its outputs
+// were not changed since. Succeeded steps are appended to the journal of the
+// installer under $XDG_STATE_HOME/sys-setup/journal, `--force` ignores it.
+
+typedef struct {
+    unsigned long long fingerprint;
+    Strings outputs;
+    // The step succeeded before and must not be run
+    bool skip;
+} Step;
+
+API Step step_begin(Strings keys, Strings inputs, Strings outputs);
+
+// Records a step that succeeded.
+API void step_end(Step step);
+
+// Like cmd_exec, but journaled with the command as keys. Returns 0 if skipped.
+API int cmd_execj(Cmd cmd, Strings inputs, Strings outputs);
+
 API Cmd sudo(Cmd cmd);
 
 API Cmd make(Strings rules, char *in_dir);
@@ -372,17 +494,43 @@ API Cmd git_clean(char *repo_dir);
 
 // :package :installation
 
+// Executables in PATH are looked up in an index, which is rebuilt when PATH
+// changes or, on a miss, when one of its directories changed.
+__attribute__((nonnull))
 API bool exe_exists(char *name);
 
-// TODO: Not really sure how to integrate the pkg managers
+// Logs all missing executables at once and returns false if there are any.
+API bool exes_exist(Strings names);
+
+// Installed packages are read once from the local pacman database into an
+// index, which is rebuilt whenever the database changes.
+// Sets the root of the database (`--pkg-db`) and returns the previous one.
+// `root` is copied, the result is allocated in the current scope.
+__attribute__((nonnull))
+API char *pkg_db(char *root);
+
+// Returns the installed version of `pkg` or NULL, if it is not installed.
+// The result is valid until the database changes.
+__attribute__((nonnull))
+API char *pkg_version(char *pkg);
+
+__attribute__((nonnull))
 API bool is_installed(char *pkg);
 
 // Should be called in `setup`
 API bool ensure_uptodate(Strings pkgs);
 
+// Packages that are already installed are skipped.
 __attribute__((nonnull))
 API bool install_pkg(char *name);
 
+// Installs all packages that are not installed yet in one transaction.
+API bool install_pkgs(Strings pkgs);
+
+// Queued packages are installed in one transaction after the current `setup`
+// or `run_install` returned. A failed transaction fails the installer.
+API void queue_pkgs(Strings pkgs);
+
 // :compilation
 
 // The last entry in both cflags and lflags must be NULL. Use strs for convenience
@@ -394,11 +542,32 @@ __attribute__((nonnull(2)))
 API bool compile_so(Strings cfiles, char *so, Strings cflags, Strings lflags);
 
 // :net :http
+// http:// is handled natively (HTTP/1.1), https:// and redirects to it are
+// passed to curl, if it is installed.
 
+// Returns the body of the response, on failure or a non 2xx status are
+// `Buffer.items == NULL` and `Buffer.cap == 0`.
 __attribute__((nonnull))
 API Buffer http_get(char *url);
 
+// Streams the body of the response to `fd` without buffering it.
+__attribute__((nonnull))
+API bool http_get_fd(char *url, Fd fd);
+
+// @see http_get
 __attribute__((nonnull))
 API Buffer http_post(char *url, Buffer data);
 
+// Downloads all urls concurrently, urls[i] is stored at paths[i]. Returns the
+// number of failed downloads.
+// Data is streamed into `<path>.part`, interrupted transfers are resumed with
+// a Range request, also in later runs. Downloads are cached by the hash of
+// their content, a url that was downloaded before is requested with the ETag
+// or Last-Modified of its cached copy, which is used if it was not modified or
+// the download failed.
+API size_t dwnld_many(char **urls, char **paths, size_t n);
+
+__attribute__((nonnull))
+API bool dwnld(char *url, char *path);
+
 #endif // _INSTALLER_H_
@@ -7,7 +7,7 @@ bool run_install()
     Tree_Node cfg;
     fail_if(!tree("neovim/config/", FF_Any, 10, &cfg), "failed to collect config files");
     char *target = concat(getenv("XDG_CONFIG_HOME"), "/nvim");
-    fail_if(!cp_dir(&cfg, target, NULL), "failed to copy config files");
+    fail_if(!link_dir(&cfg, target, NULL), "failed to link config files");
     // TODO: start neovim so plugins etc can be setup.
     return true;
 }
@@ -1,4 +1,6 @@
-//usr/bin/env gcc -ggdb -DSHEBANG -Wall -rdynamic "$0" -o sys-setup -ldl && exec ./sys-setup "$@"
+//usr/bin/env gcc -ggdb -DSHEBANG -Wall -rdynamic "$0" -o sys-setup -ldl -pthread && exec ./sys-setup "$@"
+
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <ctype.h>
@@ -6,19 +8,44 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <linux/limits.h>
+#include <netdb.h>
 #include <getopt.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
+#include <ftw.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "installer.h"
 
 #define BUFFER_SIZE 1024
+// Chunk size used when copying files
+#define COPY_CHUNK_SIZE (64 * BUFFER_SIZE)
 
 // :state
 
@@ -28,10 +55,42 @@ enum programs {
     NUM_PROGRAMS,
 };
 
+// Subset of libtcc.h, libtcc is an optional dependency loaded at runtime.
+typedef struct TCCState TCCState;
+#define TCC_OUTPUT_MEMORY (1)
+#define TCC_RELOCATE_AUTO ((void*) 1)
+
+typedef struct {
+    void *handle;
+    TCCState *(*new)(void);
+    void (*delete)(TCCState *s);
+    void (*set_error_func)(TCCState *s, void *opaque, void (*fn)(void *opaque, const char *msg));
+    // Returns int in newer versions, which is ignored
+    void (*set_options)(TCCState *s, const char *str);
+    int (*set_output_type)(TCCState *s, int output_type);
+    int (*add_file)(TCCState *s, const char *filename);
+    // Versions before 0.9.28 take a second argument, newer ones ignore it.
+    int (*relocate)(TCCState *s, void *ptr);
+    void *(*get_symbol)(TCCState *s, const char *name);
+} Libtcc;
+
+typedef enum {
+    BE_Auto,    // libtcc if available, otherwise gcc
+    BE_Gcc,
+    BE_Tcc,
+} Backend;
+
 typedef struct {
     char *name;
+    // Path of the `install.c`
+    char *source;
+    // Path of the loaded installer, equal to `source` if compiled in memory
     char *path;
+    // Only one of `handle` and `jit` is set
     void *handle;
+    TCCState *jit;
+    // `NULL` terminated, may be `NULL` itself
+    const char **dependencies;
     typeof(&setup) setup;
     typeof(&run_install) run_install;
     typeof(&cleanup) cleanup;
@@ -43,20 +102,189 @@ typedef struct {
     size_t cap;
 } Installers;
 
+// A chunk of the scoped arena, blocks are chained from newest to oldest.
+typedef struct _Arena_Block {
+    struct _Arena_Block *prev;
+    size_t cap, len;
+    max_align_t data[];
+} _Arena_Block;
+
+typedef struct {
+    _Arena_Block *block;
+    size_t len;
+    // Length of state.ptrs when the scope was opened
+    size_t ptrs;
+} _Scope;
+
+// Entry of an _Index, key is an offset into the pool of the index.
+typedef struct {
+    // 0 marks an empty slot
+    uint64_t hash;
+    size_t key;
+    size_t value;
+} _Index_Entry;
+
+// Open addressing hash map from strings to values, all keys live in pool.
+typedef struct {
+    _Index_Entry *items;
+    // Always a power of two
+    size_t cap;
+    size_t len;
+    Buffer pool;
+} _Index;
+
+// Installed packages, values are offsets of their version into the pool
+typedef struct {
+    _Index index;
+    // mtime of `<pkg_db>/local` when the index was built
+    struct timespec mtime;
+    bool loaded;
+} _Pkg_Index;
+
+// Journaled steps of the installer, values are fingerprints of the outputs
+typedef struct {
+    char *installer;
+    _Index index;
+} _Journal;
+
+typedef enum {
+    PO_Mkdir,
+    PO_Copy,
+    PO_Remove,
+    PO_Link,
+    PO_Exec,
+} _Plan_Op_Kind;
+
+// Operation recorded in dry mode. Paths are absolute, args holds
+// - PO_Mkdir:  path
+// - PO_Copy:   from, to
+// - PO_Remove: path and "-r" if the whole tree is removed
+// - PO_Link:   target, path of the symlink replacing a symlink at path
+// - PO_Exec:   the command, run in cwd
+typedef struct {
+    _Plan_Op_Kind kind;
+    char *installer;
+    char *cwd;
+    Strings args;
+} _Plan_Op;
+
+typedef DA_STRUCT(_Plan_Op) _Plan_Ops;
+
+// Executables in PATH, values index into dirs
+typedef struct {
+    _Index index;
+    // PATH when the index was built
+    char *path;
+    DA_STRUCT(struct _Exe_Dir { char *name; struct timespec mtime; }) dirs;
+    bool loaded;
+    // A miss already checked the directories, reset whenever a command is
+    // spawned, a file is written or an installer starts, as only those add
+    // executables.
+    bool checked;
+} _Exe_Index;
+
+// Ring buffer of the logger, see :log
+typedef struct {
+    char *data;
+    // Only written by the producer
+    size_t head;
+    // Only written by the writer
+    size_t tail;
+    // Futex the writer waits on, bumped for every record
+    uint32_t seq;
+    uint32_t waiting;
+    bool stop;
+    // No writer is started anymore once stopped
+    bool stopped;
+    pthread_t writer;
+    // Process the writer runs in, 0 if there is none
+    Pid pid;
+    // stderr is a terminal, checked once
+    bool tty;
+    // JSON lines log of the installer `json_name`, empty if none is open
+    char json_name[NAME_MAX + 1];
+    Fd json_fd;
+    Pid json_pid;
+} _Log;
+
 typedef struct {
-    Log_Level min_level;
     bool log_loc;
+    _Log log;
+    // Directory of the JSON lines logs, NULL if disabled
+    char *log_dir;
     DA_STRUCT(void*) ptrs;
+    // Pointers that outlive every scope, freed at execution stop
+    DA_STRUCT(void*) kept;
+    _Arena_Block *arena;
+    // The newest block freed by scope_pop, reused by the next allocation
+    _Arena_Block *spare;
+    DA_STRUCT(_Scope) scopes;
     char *cc;
     Strings cflags;
     Installers available;
+    // Maximum number of concurrent compile jobs
+    size_t jobs;
+    // Maximum number of installers running concurrently
+    size_t parallel;
+    // `NULL` if no cache directory is available
+    char *cache_dir;
+    // Never BE_Auto after initialization
+    Backend backend;
+    Libtcc tcc;
+    // Use io_uring for cp_dir if available
+    bool io_uring;
+
+    // Root of the pacman database, `local` is read from it
+    char *pkg_db;
+    _Pkg_Index pkgs;
+    _Exe_Index exes;
+    // $XDG_STATE_HOME/sys-setup, NULL if not available
+    char *state_dir;
+    _Journal journal;
+    // Ignore the journal, steps are still recorded
+    bool force;
+    // Packages installed in one transaction at the end of the current phase
+    Strings queued_pkgs;
+    // Packages are synced at most once per run and not again within sync_ttl
+    // seconds, unless refresh is set.
+    bool synced;
+    bool refresh;
+    size_t sync_ttl;
+    // Start of the run, forked installers see syncs of each other after it
+    struct timespec started;
+
+    // Name of the running installer, prefixes forwarded process output
+    const char *installer;
 
     bool dry;
     // When set to true cmd_exec* will still execute the commands.
     bool dry_allow_commands;
+    // Operations are recorded here in dry mode, one line each. Opened with
+    // O_APPEND, so forked workers can share it.
+    Fd plan_fd;
+    // Chrome trace events are appended here, INVALID_FILE_DES if disabled
+    Fd trace_fd;
+    // Spawned commands, that are not reaped yet. `cmd` is JSON escaped, `name`
+    // is the raw executable.
+    DA_STRUCT(struct _Traced { Pid id; uint64_t start; char *cmd; char *name; }) traced;
+    // Trees scanned by the daemon, every root is a single allocation
+    DA_STRUCT(struct _Cached_Tree { int ff; size_t max_depth; Tree_Node *root; }) trees;
+    // Directories scanned by tree() without the cache are reported here, so
+    // the daemon can cache them. INVALID_FILE_DES outside of daemon requests.
+    Fd tree_report;
+    // Set while watching, so the changes an installer makes to its own
+    // directory do not run it again.
+    bool track_writes;
+    // Destinations of cp, cp_dir, link_dir, rm and dwnld, see _path_normalize
+    _Index written;
+    // Periods in which commands were running, measured with the clock of file
+    // timestamps
+    DA_STRUCT(struct _Period { struct timespec start; struct timespec end; }) cmd_periods;
+    size_t cmds_running;
 } State;
 
 static State state = zero(State);
+Log_Level log_min_level = LL_Trace;
 
 // :helper
 
@@ -65,6 +293,25 @@ static State state = zero(State);
     free(ptr); \
 } while (0);
 
+// Writes `src` escaped for a JSON string to `dst`, which must be able to hold
+// 6 * len bytes. Returns the number of bytes written.
+static size_t _json_escape(char *dst, const char *src, size_t len)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += 1) {
+        const unsigned char c = src[i];
+        if ('"' == c || '\\' == c) {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20) {
+            n += sprintf(dst + n, "\\u%04x", c);
+        } else {
+            dst[n++] = c;
+        }
+    }
+    return n;
+}
+
 static int _sizecmp(const void *a, const void *b)
 {
     return *(ssize_t*)a - *(ssize_t*)b;
@@ -80,12 +327,351 @@ static int _ptrcmp(const void *a, const void *b)
     return a - b;
 }
 
-static int _treenodecmp(const void *a, const void *b)
+#define FNV_OFFSET (0xcbf29ce484222325ULL)
+#define FNV_PRIME  (0x100000001b3ULL)
+#define HASH_FMT "%016llx"
+#define HASH_ARG(h) ((unsigned long long) (h))
+
+static uint64_t _hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i += 1) {
+        h ^= bytes[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Includes the terminating '\0' so consecutive strings can not collide.
+static uint64_t _hash_str(uint64_t h, const char *str)
+{
+    return _hash(h, str, strlen(str) + 1);
+}
+
+static bool _hash_file(uint64_t *h, const char *path)
+{
+    Fd fd = open(path, O_RDONLY);
+    if (INVALID_FILE_DES == fd)
+        return false;
+
+    char buf[16 * BUFFER_SIZE];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        *h = _hash(*h, buf, r);
+    close(fd);
+    return 0 == r;
+}
+
+static void _index_free(_Index *idx)
+{
+    if (idx->items)
+        _free(idx->items);
+    if (idx->pool.items)
+        _free(idx->pool.items);
+    *idx = zero(_Index);
+}
+
+static _Index_Entry *_index_slot(_Index *idx, const char *key, uint64_t hash)
+{
+    for (size_t i = hash & (idx->cap - 1);; i = (i + 1) & (idx->cap - 1)) {
+        _Index_Entry *e = &idx->items[i];
+        if (0 == e->hash)
+            return e;
+        if (e->hash == hash && 0 == strcmp(idx->pool.items + e->key, key))
+            return e;
+    }
+}
+
+// Appends `key` to the pool of idx and maps it to `value`, an existing entry
+// is kept.
+static void _index_add(_Index *idx, const char *key, size_t value)
+{
+    if (2 * (idx->len + 1) > idx->cap) {
+        _Index grown = *idx;
+        grown.cap = idx->cap ? 2 * idx->cap : 1024;
+        grown.items = calloc(grown.cap, sizeof(*grown.items));
+        if (!grown.items)
+            die("Allocation failed:");
+        for (size_t i = 0; i < idx->cap; i += 1) {
+            if (idx->items[i].hash)
+                *_index_slot(&grown, idx->pool.items + idx->items[i].key,
+                             idx->items[i].hash) = idx->items[i];
+        }
+        if (idx->items)
+            _free(idx->items);
+        *idx = grown;
+    }
+    const uint64_t hash = _hash_str(FNV_OFFSET, key) | 1;
+    _Index_Entry *e = _index_slot(idx, key, hash);
+    if (0 != e->hash)
+        return;
+    *e = (_Index_Entry) { hash, idx->pool.len, value };
+    da_append_many(&idx->pool, key, strlen(key) + 1);
+    idx->len += 1;
+}
+
+static _Index_Entry *_index_get(_Index *idx, const char *key)
+{
+    if (0 == idx->len)
+        return NULL;
+    _Index_Entry *e = _index_slot(idx, key, _hash_str(FNV_OFFSET, key) | 1);
+    return e->hash ? e : NULL;
+}
+
+// Creates `path` and all its missing parents.
+static bool _mkdirs(const char *path, mode_t mode)
+{
+    char buf[PATH_MAX];
+    const size_t len = strlen(path);
+    fail_if(len >= sizeof(buf), "Path too long: %s", path);
+    memcpy(buf, path, len + 1);
+
+    for (size_t i = 1; i <= len; i += 1) {
+        if (buf[i] != '/' && buf[i] != '\0')
+            continue;
+        buf[i] = '\0';
+        if (-1 == mkdir(buf, mode) && EEXIST != errno) {
+            msg(LL_Error, "Failed to create directory '%s':", buf);
+            return false;
+        }
+        buf[i] = path[i];
+    }
+    return true;
+}
+
+// :log
+// Messages are formatted by the thread logging them and appended to a ring
+// buffer, a writer thread drains it with few large writes. Every process logs
+// from a single thread, so the ring has exactly one producer and one consumer
+// and needs no locks. Forked children start their own writer with their first
+// message, the ring is drained before every fork.
+
+#define LOG_RING_SIZE (256 * 1024)
+// Longer records are written directly
+#define LOG_RECORD_MAX (LOG_RING_SIZE / 8)
+#define LOG_LINE_SIZE 1024
+
+typedef struct {
+    // INVALID_FILE_DES marks the padding at the end of the ring
+    Fd fd;
+    uint32_t len;
+} _Log_Record;
+
+#define _log_aligned(len) (((len) + sizeof(_Log_Record) - 1) & ~(sizeof(_Log_Record) - 1))
+
+static void _log_write(Fd fd, const struct iovec *iov, int n)
+{
+    struct iovec rest[64];
+    memcpy(rest, iov, n * sizeof(*iov));
+    for (int i = 0; i < n;) {
+        ssize_t w = writev(fd, rest + i, n - i);
+        if (-1 == w && EINTR == errno)
+            continue;
+        if (-1 == w)
+            return; // Nowhere left to report this
+        for (; i < n && (size_t) w >= rest[i].iov_len; i += 1)
+            w -= rest[i].iov_len;
+        if (i < n) {
+            rest[i].iov_base = (char*) rest[i].iov_base + w;
+            rest[i].iov_len -= w;
+        }
+    }
+}
+
+static void _log_futex(uint32_t *addr, int op, uint32_t val)
+{
+    const struct timespec timeout = { 0, 100 * 1000 * 1000 };
+    syscall(SYS_futex, addr, op, val, FUTEX_WAIT == op ? &timeout : NULL, NULL, 0);
+}
+
+// Writes all records between tail and head, grouped by their file descriptor
+static void _log_drain(size_t tail, size_t head)
+{
+    struct { Fd fd; int n; struct iovec iov[64]; } groups[4];
+    size_t used = 0;
+    while (tail != head) {
+        const _Log_Record *r = (_Log_Record*) (state.log.data + tail % LOG_RING_SIZE);
+        size_t g = 0;
+        while (g < used && groups[g].fd != r->fd)
+            g += 1;
+        if (INVALID_FILE_DES != r->fd && (g == 4 || (g < used && groups[g].n == 64)))
+            break;
+        if (INVALID_FILE_DES != r->fd) {
+            if (g == used)
+                groups[used++] = (typeof(*groups)) { .fd = r->fd };
+            groups[g].iov[groups[g].n++] = (struct iovec) { (void*) (r + 1), r->len };
+        }
+        tail += sizeof(*r) + _log_aligned(r->len);
+    }
+    for (size_t g = 0; g < used; g += 1)
+        _log_write(groups[g].fd, groups[g].iov, groups[g].n);
+    __atomic_store_n(&state.log.tail, tail, __ATOMIC_SEQ_CST);
+}
+
+static void *_log_writer(void *arg)
+{
+    ignore_param(arg);
+    _Log *l = &state.log;
+    while (true) {
+        const size_t head = __atomic_load_n(&l->head, __ATOMIC_SEQ_CST);
+        if (head != l->tail) {
+            _log_drain(l->tail, head);
+            continue;
+        }
+        if (__atomic_load_n(&l->stop, __ATOMIC_SEQ_CST))
+            return NULL;
+        // Only the producer changes seq, it wakes the writer if it is waiting
+        const uint32_t seq = __atomic_load_n(&l->seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&l->waiting, 1, __ATOMIC_SEQ_CST);
+        if (head == __atomic_load_n(&l->head, __ATOMIC_SEQ_CST)
+                && !__atomic_load_n(&l->stop, __ATOMIC_SEQ_CST))
+            _log_futex(&l->seq, FUTEX_WAIT, seq);
+        __atomic_store_n(&l->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void _log_wake()
+{
+    __atomic_add_fetch(&state.log.seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state.log.waiting, __ATOMIC_SEQ_CST))
+        _log_futex(&state.log.seq, FUTEX_WAKE, 1);
+}
+
+// Waits until everything logged so far is written
+static void _log_flush()
+{
+    if (state.log.pid != getpid())
+        return;
+    while (__atomic_load_n(&state.log.tail, __ATOMIC_SEQ_CST) != state.log.head) {
+        _log_wake();
+        sched_yield();
+    }
+}
+
+static void _log_stop()
+{
+    if (state.log.pid != getpid())
+        return;
+    _log_flush();
+    __atomic_store_n(&state.log.stop, true, __ATOMIC_SEQ_CST);
+    _log_wake();
+    pthread_join(state.log.writer, NULL);
+    state.log.pid = 0;
+    state.log.stopped = true;
+    if (state.log.json_name[0])
+        close(state.log.json_fd);
+    state.log.json_name[0] = '\0';
+}
+
+// Starts the writer of this process, returns false if messages have to be
+// written directly.
+static bool _log_start()
+{
+    _Log *l = &state.log;
+    if (l->pid == getpid())
+        return true;
+    if (l->stopped)
+        return false;
+    if (!l->data) {
+        l->tty = isatty(STDERR_FILENO);
+        l->data = malloc(LOG_RING_SIZE);
+        if (!l->data)
+            return false;
+        pthread_atfork(_log_flush, NULL, NULL);
+        atexit(_log_stop);
+    }
+    // Inherited from the parent, which drained the ring before forking
+    l->tail = l->head;
+    l->stop = false;
+    l->waiting = 0;
+    if (0 != pthread_create(&l->writer, NULL, _log_writer, NULL))
+        return false;
+    l->pid = getpid();
+    return true;
+}
+
+static void _log_push(Fd fd, const char *data, size_t len)
+{
+    _Log *l = &state.log;
+    if (len > LOG_RECORD_MAX || !_log_start()) {
+        _log_flush();
+        _log_write(fd, &(struct iovec) { (void*) data, len }, 1);
+        return;
+    }
+
+    size_t need = sizeof(_Log_Record) + _log_aligned(len);
+    const size_t offset = l->head % LOG_RING_SIZE;
+    // Records never wrap, the rest of the ring is skipped instead
+    const size_t padding = offset + need > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+    while (LOG_RING_SIZE - (l->head - __atomic_load_n(&l->tail, __ATOMIC_SEQ_CST)) < padding + need) {
+        _log_wake();
+        sched_yield();
+    }
+    if (padding) {
+        *(_Log_Record*) (l->data + offset) = (_Log_Record) {
+            INVALID_FILE_DES, padding - sizeof(_Log_Record)
+        };
+        __atomic_store_n(&l->head, l->head + padding, __ATOMIC_SEQ_CST);
+    }
+    _Log_Record *r = (_Log_Record*) (l->data + l->head % LOG_RING_SIZE);
+    *r = (_Log_Record) { fd, len };
+    memcpy(r + 1, data, len);
+    __atomic_store_n(&l->head, l->head + need, __ATOMIC_SEQ_CST);
+    _log_wake();
+}
+
+// The JSON lines log of the running installer
+static Fd _log_json_fd()
+{
+    _Log *l = &state.log;
+    const char *name = state.installer ? state.installer : "sys-setup";
+    if (l->json_name[0] && l->json_pid == getpid() && 0 == strcmp(name, l->json_name))
+        return l->json_fd;
+    // Pending records may still refer to the previous file
+    _log_flush();
+    if (l->json_name[0])
+        close(l->json_fd);
+    l->json_name[0] = '\0';
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.jsonl", state.log_dir, name);
+    l->json_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (INVALID_FILE_DES == l->json_fd)
+        return INVALID_FILE_DES;
+    snprintf(l->json_name, sizeof(l->json_name), "%s", name);
+    l->json_pid = getpid();
+    return l->json_fd;
+}
+
+static void _log_json(Source_Loc loc, Log_Level ll, const char *text, size_t len)
 {
-    const Tree_Node *ta = a, *tb = b;
-    if (ta->kind == tb->kind)
-        return strcmp(ta->name, tb->name);
-    return (int)ta->kind - (int)tb->kind;
+    static const char *levels[_LL_NUM] = {
+        [LL_Trace] = "trace",
+        [LL_Debug] = "debug",
+        [LL_Info]  = "info",
+        [LL_Warn]  = "warn",
+        [LL_Error] = "error",
+    };
+    const Fd fd = _log_json_fd();
+    if (INVALID_FILE_DES == fd)
+        return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char stack[4 * LOG_LINE_SIZE];
+    const size_t cap = 256 + strlen(loc.file) + strlen(loc.function) + 6 * len;
+    char *json = cap <= sizeof(stack) ? stack : malloc(cap);
+    if (!json)
+        return;
+    size_t n = snprintf(json, cap, "{\"ts\": %lld.%06ld, \"level\": \"%s\", \"pid\": %d, "
+                        "\"file\": \"%s\", \"function\": \"%s\", \"line\": %zu, \"msg\": \"",
+                        (long long) ts.tv_sec, ts.tv_nsec / 1000, levels[ll], getpid(),
+                        loc.file, loc.function, loc.line);
+    n += _json_escape(json + n, text, len);
+    memcpy(json + n, "\"}\n", 3);
+    _log_push(fd, json, n + 3);
+    if (json != stack)
+        free(json);
 }
 
 // :installer.h :implementation
@@ -94,6 +680,9 @@ static int _treenodecmp(const void *a, const void *b)
 void die_loc(Source_Loc loc, char* fmt, ...)
 {
     static const char *fatal[] = { "FATAL", "\033[31mFATAL\033[0m" };
+    // isatty and stdio may clobber errno before it is printed
+    const int error = errno;
+    _log_flush();
     fprintf(stderr, "[%s] "SRCLOC_FMT": ",
             fatal[isatty(STDERR_FILENO)], SRCLOC_ARG(&loc));
     va_list args;
@@ -102,6 +691,7 @@ void die_loc(Source_Loc loc, char* fmt, ...)
     va_end(args);
     if (fmt[0] && ':' == fmt[strlen(fmt) - 1]) {
         fputc(' ', stderr);
+        errno = error;
         perror(NULL);
     } else {
         fprintf(stderr, "\n");
@@ -125,55 +715,198 @@ void msg_loc(Source_Loc loc, Log_Level ll, char* fmt, ...)
             [LL_Error] = "\033[31mERROR\033[0m" },
     };
 
-    if (ll < state.min_level)
+    if (ll < log_min_level)
         return;
-
-    if (state.log_loc)
-        fprintf(stderr, "[%s] "SRCLOC_FMT": ",
-                PREFIXES[isatty(STDERR_FILENO)][ll], SRCLOC_ARG(&loc));
-    else
-        fprintf(stderr, "[%s] ",
-                PREFIXES[isatty(STDERR_FILENO)][ll]);
+    const int error = errno;
+    const bool tty = _log_start() && state.log.tty;
+
+    // The line is assembled on the stack unless it is too long
+    char stack[LOG_LINE_SIZE];
+    int prefix = state.log_loc
+        ? snprintf(stack, sizeof(stack), "[%s] "SRCLOC_FMT": ", PREFIXES[tty][ll], SRCLOC_ARG(&loc))
+        : snprintf(stack, sizeof(stack), "[%s] ", PREFIXES[tty][ll]);
+    const char *err = fmt[0] && ':' == fmt[strlen(fmt) - 1] ? strerror(error) : NULL;
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
+    int len = vsnprintf(stack + prefix, sizeof(stack) - prefix, fmt, args);
     va_end(args);
-    if (fmt[0] && ':' == fmt[strlen(fmt) - 1]) {
-        fputc(' ', stderr);
-        perror(NULL);
-    } else {
-        putc('\n', stderr);
+    const size_t size = prefix + len + (err ? 1 + strlen(err) : 0) + 1;
+
+    char *line = stack;
+    if (size > sizeof(stack)) {
+        line = malloc(size + 1);
+        if (!line)
+            die("Allocation failed:");
+        memcpy(line, stack, prefix);
+        va_start(args, fmt);
+        vsnprintf(line + prefix, len + 1, fmt, args);
+        va_end(args);
     }
-    fflush(stderr);
+    if (err)
+        sprintf(line + prefix + len, " %s", err);
+    line[size - 1] = '\n';
+
+    _log_push(STDERR_FILENO, line, size);
+    if (state.log_dir)
+        _log_json(loc, ll, line + prefix, size - prefix - 1);
+    // Errors are visible right away, even if the process crashes afterwards
+    if (ll >= LL_Error)
+        _log_flush();
+    if (line != stack)
+        free(line);
+    errno = error;
+}
+
+// :memory
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+static bool _arena_owns(const void *ptr)
+{
+    for (const _Arena_Block *b = state.arena; b; b = b->prev) {
+        const char *data = (const char*) b->data;
+        if ((const char*) ptr >= data && (const char*) ptr < data + b->len)
+            return true;
+    }
+    return false;
+}
+
+void *arena_alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    _Arena_Block *b = state.arena;
+    if (!b || b->cap - b->len < size) {
+        size_t cap = b ? b->cap * 2 : ARENA_BLOCK_SIZE;
+        while (cap < size)
+            cap *= 2;
+        if (state.spare && state.spare->cap >= size) {
+            b = state.spare;
+            state.spare = NULL;
+        } else {
+            b = malloc(sizeof(*b) + cap);
+            if (!b)
+                die("Allocation failed:");
+            b->cap = cap;
+        }
+        b->prev = state.arena;
+        b->len = 0;
+        state.arena = b;
+    }
+    void *ptr = (char*) b->data + b->len;
+    b->len += size;
+    return ptr;
+}
+
+void *_da_realloc(void *items, size_t old_size, size_t new_size)
+{
+    if (!items || !_arena_owns(items))
+        return realloc(items, new_size);
+
+    // Grow in place if this is the latest allocation
+    _Arena_Block *b = state.arena;
+    const size_t old_aligned = (old_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    const size_t new_aligned = (new_size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if ((char*) items + old_aligned == (char*) b->data + b->len
+            && b->cap - b->len + old_aligned >= new_aligned) {
+        b->len += new_aligned - old_aligned;
+        return items;
+    }
+    void *ptr = arena_alloc(new_size);
+    memcpy(ptr, items, old_size < new_size ? old_size : new_size);
+    return ptr;
+}
+
+size_t scope_push(void)
+{
+    _Scope s = { state.arena, state.arena ? state.arena->len : 0, state.ptrs.len };
+    da_append(&state.scopes, s);
+    return state.scopes.len - 1;
+}
+
+void scope_pop(size_t scope)
+{
+    if (scope >= state.scopes.len)
+        die("Invalid scope: %zu", scope);
+    const _Scope s = state.scopes.items[scope];
+    state.scopes.len = scope;
+
+    while (state.arena != s.block) {
+        _Arena_Block *b = state.arena;
+        state.arena = b->prev;
+        if (state.spare)
+            free(state.spare);
+        state.spare = b;
+    }
+    if (state.arena)
+        state.arena->len = s.len;
+
+    void **ptrs = state.ptrs.items + s.ptrs;
+    const size_t n = state.ptrs.len - s.ptrs;
+    qsort(ptrs, n, sizeof(void*), _ptrcmp);
+    for (size_t i = 0; i < n; i += 1) {
+        if (ptrs[i] && (i == 0 || ptrs[i - 1] != ptrs[i]))
+            _free(ptrs[i]);
+    }
+    state.ptrs.len = s.ptrs;
 }
 
 void _register_ptr(void *ptr)
 {
-    // TODO: check if ptr is somewhere in the state OR if it already is registered
     da_append(&state.ptrs, ptr);
 }
 
+// Registers `ptr` unless it already lives inside the arena.
+static void _adopt(void *ptr)
+{
+    if (ptr && !_arena_owns(ptr))
+        register_ptr(ptr);
+}
+
+// Copies `str` outside of any scope, it is freed at execution stop.
+static char *_keep(const char *str)
+{
+    char *res = strdup(str);
+    if (!res)
+        die("Allocation failed:");
+    da_append(&state.kept, res);
+    return res;
+}
+
+static char *_arena_strdup(const char *str)
+{
+    const size_t len = strlen(str) + 1;
+    return memcpy(arena_alloc(len), str, len);
+}
+
+// Lets the first allocation of an empty dynamic array happen in the arena.
+#define _da_scoped(da) do {                                                     \
+    if (!(da)->items) {                                                         \
+        (da)->items = arena_alloc(DA_INIT_CAP * sizeof(*(da)->items));          \
+        (da)->cap = DA_INIT_CAP;                                                \
+    }                                                                           \
+} while (0)
+
 Strings _strs(const char *first, ...)
 {
     Strings res = zero(Strings);
+    _da_scoped(&res);
 
     va_list args;
     va_start(args, first);
     char *cur = (char*)first;
     do {
-        cur = strdup(cur);
-        da_append(&res, cur);
+        da_append(&res, _arena_strdup(cur));
     } while ((cur = va_arg(args, char*)));
     va_end(args);
 
-    register_ptrs((void**) res.items, res.len);
-    register_ptr(res.items);
     return res;
 }
 
 char *_concat(const char *first, ...)
 {
     Buffer buf = zero(Buffer);
+    _da_scoped(&buf);
 
     va_list args;
     va_start(args, first);
@@ -184,13 +917,12 @@ char *_concat(const char *first, ...)
     va_end(args);
     da_append(&buf, '\0');
 
-    if (buf.items)
-        register_ptr(buf.items);
     return buf.items;
 }
 
 void prompt(char *p, Buffer *buf)
 {
+    _log_flush();
     printf("%s", p);
     fflush(stdout);
     char c;
@@ -209,8 +941,238 @@ void to_lower(char *str)
     }
 }
 
+// :trace
+// With `--trace=FILE` spans are appended to FILE as Chrome trace events, which
+// can be opened in Perfetto or chrome://tracing. Every event is written with a
+// single O_APPEND write, so forked workers share the file.
+
+typedef struct {
+    // NULL if tracing is disabled
+    const char *cat;
+    char *name;
+    uint64_t start;
+} _Span;
+
+static uint64_t _trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void _trace_escape(Buffer *buf, const char *str)
+{
+    const size_t len = strlen(str);
+    da_reserve(buf, 6 * len);
+    buf->len += _json_escape(buf->items + buf->len, str, len);
+}
+
+// `args` are JSON members without the surrounding braces, may be NULL.
+static void _trace_event(const char *ph, const char *cat, const char *name, uint64_t ts,
+                         uint64_t dur, const char *args)
+{
+    Buffer ev = zero(Buffer);
+    char head[256];
+    da_append_many(&ev, "{\"name\": \"", 10);
+    _trace_escape(&ev, name);
+    int len = snprintf(head, sizeof(head), "\", \"cat\": \"%s\", \"ph\": \"%s\", \"ts\": %llu, "
+                       "\"dur\": %llu, \"pid\": %d, \"tid\": %d, \"args\": {",
+                       cat, ph, (unsigned long long) ts, (unsigned long long) dur, getpid(), gettid());
+    da_append_many(&ev, head, len);
+    if (args)
+        da_append_many(&ev, args, strlen(args));
+    da_append_many(&ev, "}},\n", 4);
+    if ((ssize_t) ev.len != write(state.trace_fd, ev.items, ev.len))
+        msg(LL_Warn, "Failed to write trace event:");
+    _free(ev.items);
+}
+
+// Names the current process in the trace
+static void _trace_process(const char *name)
+{
+    if (INVALID_FILE_DES == state.trace_fd)
+        return;
+    Buffer args = zero(Buffer);
+    da_append_many(&args, "\"name\": \"", 9);
+    _trace_escape(&args, name);
+    da_append(&args, '"');
+    da_append(&args, '\0');
+    _trace_event("M", "__metadata", "process_name", 0, 0, args.items);
+    _free(args.items);
+}
+
+// The name is only formatted if tracing is enabled. Every span has to be
+// passed to _span_end.
+__attribute__((format(printf, 2, 3)))
+static _Span _span_begin(const char *cat, const char *fmt, ...)
+{
+    if (INVALID_FILE_DES == state.trace_fd)
+        return (_Span) { 0 };
+    _Span s = { cat, NULL, 0 };
+    va_list ap;
+    va_start(ap, fmt);
+    if (-1 == vasprintf(&s.name, fmt, ap))
+        die("Allocation failed:");
+    va_end(ap);
+    s.start = _trace_now();
+    return s;
+}
+
+// `args` like for _trace_event
+static void _span_end(_Span s, const char *args)
+{
+    if (!s.cat)
+        return;
+    _trace_event("X", s.cat, s.name, s.start, _trace_now() - s.start, args);
+    free(s.name);
+}
+
+// Commands are traced from their spawn until they are reaped
+static void _trace_spawned(Pid id, Cmd cmd)
+{
+    if (INVALID_FILE_DES == state.trace_fd)
+        return;
+    Buffer line = zero(Buffer);
+    for (size_t i = 0; i < cmd.len; i += 1) {
+        if (i)
+            da_append(&line, ' ');
+        _trace_escape(&line, cmd.items[i]);
+    }
+    da_append(&line, '\0');
+    char *name = strdup(cmd.items[0]);
+    if (!name)
+        die("Allocation failed:");
+    da_append(&state.traced, ((struct _Traced) { id, _trace_now(), line.items, name }));
+}
+
+static void _trace_reaped(Pid id, int status, const struct rusage *ru)
+{
+    for (size_t i = 0; i < state.traced.len; i += 1) {
+        struct _Traced t = state.traced.items[i];
+        if (t.id != id)
+            continue;
+        state.traced.items[i] = state.traced.items[--state.traced.len];
+
+        char *args;
+        if (-1 == asprintf(&args, "\"cmd\": \"%s\", \"pid\": %d, \"status\": %d, "
+                           "\"utime_ms\": %.3f, \"stime_ms\": %.3f, \"maxrss_kib\": %ld, "
+                           "\"minflt\": %ld, \"majflt\": %ld, \"inblock\": %ld, \"oublock\": %ld, "
+                           "\"nvcsw\": %ld, \"nivcsw\": %ld",
+                           t.cmd, id, WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                           ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+                           ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+                           ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_inblock,
+                           ru->ru_oublock, ru->ru_nvcsw, ru->ru_nivcsw))
+            die("Allocation failed:");
+        // The name is the executable, the whole command is in the args
+        _trace_event("X", "cmd", t.name, t.start, _trace_now() - t.start, args);
+        free(args);
+        _free(t.cmd);
+        _free(t.name);
+        return;
+    }
+}
+
 // :file :path :fs
 
+// Makes `path` absolute and removes empty, '.' and '..' components without
+// resolving symlinks, so paths that do not exist anymore are handled as well.
+static void _path_normalize(const char *path, char out[PATH_MAX])
+{
+    char cwd[PATH_MAX] = "";
+    if ('/' != *path && !getcwd(cwd, sizeof(cwd)))
+        die("Failed to get the working directory:");
+    char joined[2 * PATH_MAX];
+    snprintf(joined, sizeof(joined), "%s/%s", cwd, path);
+
+    size_t len = 0;
+    for (const char *seg = joined; *seg;) {
+        const size_t n = strcspn(seg, "/");
+        if (2 == n && 0 == strncmp(seg, "..", 2)) {
+            while (len > 0 && '/' != out[--len]);
+        } else if (n > 0 && !(1 == n && '.' == *seg) && len + n + 1 < PATH_MAX) {
+            out[len++] = '/';
+            memcpy(out + len, seg, n);
+            len += n;
+        }
+        seg += n + ('/' == seg[n]);
+    }
+    if (0 == len)
+        out[len++] = '/';
+    out[len] = '\0';
+}
+
+// Returns true if `path` is `dir` or below it, both normalized.
+static bool _path_within(const char *path, const char *dir)
+{
+    const size_t len = strlen(dir);
+    return 0 == strncmp(path, dir, len) && ('\0' == path[len] || '/' == path[len]);
+}
+
+// Records that the running installer writes `path` and everything below it.
+// Cached trees containing it or inside of it are dropped, their memory stays
+// valid until the current scope ends.
+static void _track_write(const char *path)
+{
+    state.exes.checked = false;
+    if (!state.track_writes && 0 == state.trees.len)
+        return;
+    char norm[PATH_MAX];
+    _path_normalize(path, norm);
+    for (size_t i = 0; i < state.trees.len;) {
+        char root[PATH_MAX];
+        _path_normalize(state.trees.items[i].root->name, root);
+        if (!_path_within(norm, root) && !_path_within(root, norm)) {
+            i += 1;
+            continue;
+        }
+        msg(LL_Debug, "Dropping the cached tree of %s, '%s' is written",
+            state.trees.items[i].root->name, path);
+        register_ptr(state.trees.items[i].root);
+        state.trees.items[i] = state.trees.items[state.trees.len - 1];
+        state.trees.len -= 1;
+    }
+    if (state.track_writes && !_index_get(&state.written, norm))
+        _index_add(&state.written, norm, 0);
+}
+
+// Returns true if `path` or one of its parents was recorded by _track_write.
+static bool _track_written(const char *path)
+{
+    char norm[PATH_MAX];
+    _path_normalize(path, norm);
+    for (size_t len = strlen(norm); len > 0;) {
+        if (_index_get(&state.written, norm))
+            return true;
+        while (len > 0 && '/' != norm[--len]);
+        norm[len] = '\0';
+    }
+    return false;
+}
+
+// Called once a command started or was reaped.
+static void _track_cmd(bool started)
+{
+    if (!state.track_writes)
+        return;
+    // File timestamps are taken from the coarse clock, or a finer one if
+    // they were queried in between
+    struct timespec now;
+    clock_gettime(started ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &now);
+    if (started && 0 == state.cmds_running++) {
+        da_append(&state.cmd_periods, ((struct _Period) { now, now }));
+    } else if (!started && state.cmds_running && 0 == --state.cmds_running) {
+        state.cmd_periods.items[state.cmd_periods.len - 1].end = now;
+    }
+}
+
+static void _track_reset()
+{
+    _index_free(&state.written);
+    state.cmd_periods.len = 0;
+    state.cmds_running = 0;
+}
+
 int exists(char *path, int ff)
 {
     fail_if(*path == '\0', "Empty path");
@@ -269,61 +1231,293 @@ bool ls(char *path, int ff, Ls_Files *result)
             kind |= FF_Symlink;
 
         if (kind != FF_None) {
-            struct ls_file f = { strdup(ent->d_name), kind };
-            register_ptr(f.name);
+            struct ls_file f = { _arena_strdup(ent->d_name), kind };
             da_append(result, f);
         }
     }
     closedir(dir);
-    register_ptr(result->items);
+    _adopt(result->items);
     qsort(result->items, result->len, sizeof(*result->items), _strcmp);
 
     return true;
 }
 
-bool tree(char *dir, int ff, size_t max_depth, Tree_Node *result)
+// Flat representation of a tree while it is being walked. The children of a
+// directory are stored next to each other.
+typedef struct {
+    // Offsets into the path pool
+    size_t path;
+    size_t name;
+    size_t parent;
+    File_Filter kind;
+    bool dir;
+    // Directory, that was not descended because of max_depth
+    bool truncated;
+    size_t first_child;
+    size_t children;
+} _Walk_Entry;
+
+typedef struct {
+    DA_STRUCT(_Walk_Entry) entries;
+    // Every full path, '\0' separated
+    Buffer pool;
+    int ff;
+    size_t max_depth;
+} _Walk;
+
+static int _walkcmp(const void *a, const void *b, void *pool)
 {
-    // TODO: This could theoretically be allowed, it would simply yield the
-    //       directory structure without any files. In this case put an early
-    //       `return true` here.
-    fail_if(FF_None == ff, "Empty filter");
-    ff &= FF_Any ^ (FF_Current | FF_Parent);
+    const _Walk_Entry *wa = a, *wb = b;
+    if (wa->dir == wb->dir)
+        return strcmp((char*) pool + wa->path, (char*) pool + wb->path);
+    return (int) wa->dir - (int) wb->dir;
+}
 
-    Ls_Files entries = zero(Ls_Files);
-    if (!ls(dir, ff | (max_depth ? FF_Directory : FF_None), &entries))
-        return false; // Error is printed by ls
-    result->name = dir;
-    result->parent = NULL;
-    result->kind = TN_Node;
-    result->children = zero(Tree_Nodes);
-    const char *slash = (dir[strlen(dir) - 1] == '/') ? "" : "/";
+// Reads the directory `fd` (closed when done) which belongs to `w->entries.items[idx]`.
+static bool _walk(_Walk *w, Fd fd, size_t idx, size_t depth)
+{
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        msg(LL_Error, "Failed to open dir '%s':", w->pool.items + w->entries.items[idx].path);
+        close(fd);
+        return false;
+    }
 
-    for (size_t i = 0; i < entries.len; i += 1) {
-        char *path;
-        asprintf(&path, "%s%s%s", dir, slash, entries.items[i].name);
-        register_ptr(path);
-
-        Tree_Node new_node;
-        if (entries.items[i].kind & FF_Directory) {
-            if (!tree(path, ff, max_depth - 1, &new_node))
-                // TODO: Maybe just continue and accept, that the tree is only partial
-                return false;
-            // NOTE: new_node.name is set inside the tree call
+    // Files with FF_Directory are only descended while the depth allows it
+    const int ff = w->ff | (depth < w->max_depth ? FF_Directory : FF_None);
+    const size_t first = w->entries.len;
+    const size_t parent_len = strlen(w->pool.items + w->entries.items[idx].path);
+    const bool slash = '/' != w->pool.items[w->entries.items[idx].path + parent_len - 1];
+
+    for (struct dirent *ent = readdir(dir); ent != NULL; ent = readdir(dir)) {
+        File_Filter kind = FF_None;
+        if ('.' == ent->d_name[0]) {
+            if ('\0' == ent->d_name[1] || ('.' == ent->d_name[1] && '\0' == ent->d_name[2]))
+                continue; // FF_Current and FF_Parent are never part of a tree
+            if (!(ff & FF_Hidden))
+                continue;
+            kind |= FF_Hidden;
+        }
+
+        unsigned char type = ent->d_type;
+        if (DT_UNKNOWN == type) {
+            // Not every file system supports d_type
+            struct stat s;
+            if (0 == fstatat(dirfd(dir), ent->d_name, &s, AT_SYMLINK_NOFOLLOW))
+                type = S_ISREG(s.st_mode) ? DT_REG : S_ISDIR(s.st_mode) ? DT_DIR
+                     : S_ISLNK(s.st_mode) ? DT_LNK : DT_UNKNOWN;
+        }
+        if (DT_REG == type && (ff & FF_File))
+            kind |= FF_File;
+        else if (DT_DIR == type && (ff & FF_Directory))
+            kind |= FF_Directory;
+        else if (DT_LNK == type && (ff & FF_Symlink))
+            kind |= FF_Symlink;
+        if (FF_None == kind)
+            continue;
+
+        // NOTE: The pool might be reallocated, so only offsets are used
+        const size_t name_len = strlen(ent->d_name);
+        const size_t path = w->pool.len;
+        const size_t parent = w->entries.items[idx].path;
+        da_reserve(&w->pool, parent_len + slash + name_len + 1);
+        memcpy(w->pool.items + path, w->pool.items + parent, parent_len);
+        w->pool.len += parent_len;
+        if (slash)
+            w->pool.items[w->pool.len++] = '/';
+        da_append_many(&w->pool, ent->d_name, name_len + 1);
+
+        da_append(&w->entries, ((_Walk_Entry) {
+            .path = path,
+            .name = path + parent_len + slash,
+            .parent = idx,
+            .kind = kind,
+            .dir = (kind & FF_Directory) != 0,
+        }));
+    }
+
+    const size_t len = w->entries.len - first;
+    w->entries.items[idx].first_child = first;
+    w->entries.items[idx].children = len;
+    qsort_r(w->entries.items + first, len, sizeof(*w->entries.items), _walkcmp, w->pool.items);
+
+    bool ok = true;
+    for (size_t i = first; ok && i < first + len; i += 1) {
+        if (!w->entries.items[i].dir)
+            continue;
+        if (depth >= w->max_depth) {
+            w->entries.items[i].truncated = true;
+            continue;
+        }
+        Fd child = openat(dirfd(dir), w->pool.items + w->entries.items[i].name,
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (INVALID_FILE_DES == child) {
+            // TODO: Maybe just continue and accept, that the tree is only partial
+            msg(LL_Error, "Failed to open dir '%s':", w->pool.items + w->entries.items[i].path);
+            ok = false;
+            break;
+        }
+        ok = _walk(w, child, i, depth + 1);
+    }
+    closedir(dir);
+    return ok;
+}
+
+static bool _tree(char *dir, int ff, size_t max_depth, Tree_Node *result)
+{
+    // TODO: This could theoretically be allowed, it would simply yield the
+    //       directory structure without any files. In this case put an early
+    //       `return true` here.
+    fail_if(FF_None == ff, "Empty filter");
+    fail_if(*dir == '\0', "Empty path");
+    ff &= FF_Any ^ (FF_Current | FF_Parent);
+
+    Fd fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    fail_if(INVALID_FILE_DES == fd, "Failed to open dir '%s':", dir);
+
+    _Walk w = { .ff = ff, .max_depth = max_depth };
+    _da_scoped(&w.pool);
+    da_append_many(&w.pool, dir, strlen(dir) + 1);
+    da_append(&w.entries, ((_Walk_Entry) { .path = 0, .dir = true }));
+    if (!_walk(&w, fd, 0, 0)) {
+        if (w.entries.items)
+            _free(w.entries.items);
+        return false;
+    }
+
+    // All nodes (except the root) are allocated as one block. The children of
+    // every node are a slice of it and must therefore not be modified.
+    const size_t len = w.entries.len - 1;
+    Tree_Node *nodes = len ? arena_alloc(len * sizeof(*nodes)) : NULL;
+#define _walk_node(i) ((i) == 0 ? result : &nodes[(i) - 1])
+    for (size_t i = 0; i < w.entries.len; i += 1) {
+        const _Walk_Entry *e = &w.entries.items[i];
+        Tree_Node *node = _walk_node(i);
+        node->name = i == 0 ? dir : w.pool.items + e->path;
+        node->parent = i == 0 ? NULL : _walk_node(e->parent);
+        node->truncated = e->truncated;
+        if (e->dir) {
+            node->kind = TN_Node;
+            node->children = (Tree_Nodes) {
+                e->children ? _walk_node(e->first_child) : NULL, e->children, e->children,
+            };
         } else {
-            new_node.kind = TN_Leaf;
-            new_node.name = path;
-            new_node.file_type = entries.items[i].kind;
+            node->kind = TN_Leaf;
+            node->file_type = e->kind;
         }
-        new_node.parent = result;
-        da_append(&result->children, new_node);
     }
-    qsort(result->children.items, result->children.len,
-          sizeof(*result->children.items), _treenodecmp);
-    register_ptr(result->children.items);
+#undef _walk_node
 
+    _free(w.entries.items);
     return true;
 }
 
+// :tree-cache
+// The daemon keeps the trees scanned by earlier requests, they are dropped as
+// soon as inotify reports a change inside of them, see :daemon.
+
+static void _tree_size(const Tree_Node *node, size_t *nodes, size_t *names)
+{
+    *nodes += 1;
+    *names += strlen(node->name) + 1;
+    if (TN_Node != node->kind)
+        return;
+    for (size_t i = 0; i < node->children.len; i += 1)
+        _tree_size(&node->children.items[i], nodes, names);
+}
+
+static void _tree_copy(const Tree_Node *src, Tree_Node *dst, Tree_Node *parent,
+                       Tree_Node **nodes, char **names)
+{
+    *dst = *src;
+    dst->parent = parent;
+    const size_t len = strlen(src->name) + 1;
+    dst->name = memcpy(*names, src->name, len);
+    *names += len;
+    if (TN_Node != src->kind)
+        return;
+    // Children stay one slice, just like _tree lays them out
+    Tree_Node *children = *nodes;
+    *nodes += src->children.len;
+    dst->children = (Tree_Nodes) { children, src->children.len, src->children.len };
+    for (size_t i = 0; i < src->children.len; i += 1)
+        _tree_copy(&src->children.items[i], &children[i], dst, nodes, names);
+}
+
+// Copies `tree` into a single allocation, which is freed with _free.
+static Tree_Node *_tree_clone(const Tree_Node *tree)
+{
+    size_t nodes = 0, names = 0;
+    _tree_size(tree, &nodes, &names);
+    Tree_Node *res = malloc(nodes * sizeof(*res) + names);
+    if (!res)
+        die("Allocation failed:");
+    Tree_Node *next = res + 1;
+    char *name = (char*) (res + nodes);
+    _tree_copy(tree, res, NULL, &next, &name);
+    return res;
+}
+
+static bool _tree_cached(const char *dir, int ff, size_t max_depth, Tree_Node *result)
+{
+    for (size_t i = 0; i < state.trees.len; i += 1) {
+        const struct _Cached_Tree *t = &state.trees.items[i];
+        if (t->ff == ff && t->max_depth == max_depth && 0 == strcmp(t->root->name, dir)) {
+            msg(LL_Trace, "Using the cached tree of %s", dir);
+            *result = *t->root;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Scans `dir` and keeps the tree for later calls of tree() with equal arguments.
+static bool _tree_cache_add(char *dir, int ff, size_t max_depth)
+{
+    Tree_Node node;
+    if (_tree_cached(dir, ff, max_depth, &node))
+        return true;
+    const size_t scope = scope_push();
+    bool ok = _tree(dir, ff, max_depth, &node);
+    if (ok) {
+        da_append(&state.trees, ((struct _Cached_Tree) {
+            .ff = ff, .max_depth = max_depth, .root = _tree_clone(&node),
+        }));
+    }
+    scope_pop(scope);
+    return ok;
+}
+
+// Drops every cached tree containing `dir`, all of them if `dir` is NULL.
+static void _tree_cache_invalidate(const char *dir)
+{
+    for (size_t i = 0; i < state.trees.len;) {
+        const char *root = state.trees.items[i].root->name;
+        const size_t len = strlen(root);
+        if (dir && (0 != strncmp(root, dir, len)
+                    || ('\0' != dir[len] && '/' != dir[len] && '/' != root[len - 1]))) {
+            i += 1;
+            continue;
+        }
+        msg(LL_Debug, "Dropping the cached tree of %s", root);
+        _free(state.trees.items[i].root);
+        state.trees.items[i] = state.trees.items[state.trees.len - 1];
+        state.trees.len -= 1;
+    }
+}
+
+bool tree(char *dir, int ff, size_t max_depth, Tree_Node *result)
+{
+    if (_tree_cached(dir, ff, max_depth, result))
+        return true;
+    _Span span = _span_begin("fs", "tree %s", dir);
+    bool ok = _tree(dir, ff, max_depth, result);
+    _span_end(span, NULL);
+    if (ok && INVALID_FILE_DES != state.tree_report)
+        dprintf(state.tree_report, "%d\t%zu\t%s\n", ff, max_depth, dir);
+    return ok;
+}
+
 void _debug_tree(Tree_Node *tre)
 {
     printf("%s\n", tre->name);
@@ -334,16 +1528,66 @@ void _debug_tree(Tree_Node *tre)
     }
 }
 
+static const char *_plan_kinds[] = {
+    [PO_Mkdir] = "mkdir",
+    [PO_Copy] = "copy",
+    [PO_Remove] = "remove",
+    [PO_Link] = "link",
+    [PO_Exec] = "exec",
+};
+
+// Fields of a plan line are separated by tabs, which are escaped like
+// backslashes and newlines.
+static void _plan_escape(Buffer *line, const char *field)
+{
+    da_append(line, '\t');
+    for (; *field; field += 1) {
+        switch (*field) {
+        case '\\': da_append_many(line, "\\\\", 2); break;
+        case '\t': da_append_many(line, "\\t", 2); break;
+        case '\n': da_append_many(line, "\\n", 2); break;
+        default: da_append(line, *field); break;
+        }
+    }
+}
+
+// Appends an operation to the plan with a single write. Paths of file
+// operations are made absolute, `n` is the number of args of PO_Exec.
+static void _plan_record(_Plan_Op_Kind kind, char **args, size_t n)
+{
+    if (!state.dry || INVALID_FILE_DES == state.plan_fd)
+        return;
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        die("Failed to get the working directory:");
+
+    Buffer line = zero(Buffer);
+    da_append_many(&line, _plan_kinds[kind], strlen(_plan_kinds[kind]));
+    _plan_escape(&line, state.installer ? state.installer : "");
+    _plan_escape(&line, cwd);
+    for (size_t i = 0; i < n; i += 1) {
+        const bool path = PO_Exec != kind && '/' != *args[i] && 0 != strcmp("-r", args[i]);
+        _plan_escape(&line, path ? concat(cwd, "/", args[i]) : args[i]);
+    }
+    da_append(&line, '\n');
+    if ((ssize_t) line.len != write(state.plan_fd, line.items, line.len))
+        die("Failed to record the plan:");
+    _free(line.items);
+}
+
 int rm(Strings paths)
 {
     if (state.dry) {
-        for (size_t i = 0; i < paths.len; i += 1)
+        for (size_t i = 0; i < paths.len; i += 1) {
             msg(LL_Info, "Removing '%s'", paths.items[i]);
+            _plan_record(PO_Remove, &paths.items[i], 1);
+        }
         return 0;
     }
 
     int errs = 0;
     for (size_t i = 0; i < paths.len; i += 1) {
+        _track_write(paths.items[i]);
         if (-1 == remove(paths.items[i])) {
             msg(LL_Error, "Failed to remove '%s':", paths.items[i]);
             errs += 1;
@@ -352,6 +1596,50 @@ int rm(Strings paths)
     return errs;
 }
 
+// Copies everything from the current offset of `rfd` to `wfd`. In order the
+// following is tried, each one falling back to the next:
+// 1. FICLONE: shares the extents (reflink), only supported by some file systems.
+//    It always clones the whole file, so it is only used if both offsets are 0.
+// 2. copy_file_range: in kernel copy, may be offloaded by the file system
+// 3. sendfile: in kernel copy
+// 4. read/write using a fixed size buffer
+// Memory usage is constant in every case.
+static bool _copy_fd(Fd rfd, Fd wfd)
+{
+    if (0 == lseek(rfd, 0, SEEK_CUR) && 0 == lseek(wfd, 0, SEEK_CUR)
+            && 0 == ioctl(wfd, FICLONE, rfd))
+        return true;
+
+    ssize_t n;
+    while (0 < (n = copy_file_range(rfd, NULL, wfd, NULL, COPY_CHUNK_SIZE * 16, 0)));
+    if (0 == n)
+        return true;
+    if (ENOSYS != errno && EXDEV != errno && EINVAL != errno && EOPNOTSUPP != errno) {
+        msg(LL_Error, "copy_file_range failed:");
+        return false;
+    }
+
+    // File offsets have been advanced for everything copied so far
+    while (0 < (n = sendfile(wfd, rfd, NULL, COPY_CHUNK_SIZE * 16)));
+    if (0 == n)
+        return true;
+    if (ENOSYS != errno && EINVAL != errno) {
+        msg(LL_Error, "sendfile failed:");
+        return false;
+    }
+
+    char buf[COPY_CHUNK_SIZE];
+    while (0 < (n = read(rfd, buf, sizeof(buf)))) {
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(wfd, buf + written, n - written);
+            fail_if(-1 == w, "Failed to write:");
+            written += w;
+        }
+    }
+    fail_if(-1 == n, "Failed to read:");
+    return true;
+}
+
 bool cp(char *from, char *to)
 {
 
@@ -365,606 +1653,4657 @@ bool cp(char *from, char *to)
 
     if (state.dry) {
         msg(LL_Info, "Copying '%s' -> '%s'", from, to);
+        _plan_record(PO_Copy, (char*[]) { from, to }, 2);
         return true;
     }
 
     Fd rfd = open(from, O_RDONLY);
     fail_if(rfd == INVALID_FILE_DES, "Failed to open %s:", from);
 
-    Fd wfd = open(to, O_CREAT | O_WRONLY | O_TRUNC);
+    _track_write(to);
+    Fd wfd = open(to, O_CREAT | O_WRONLY | O_TRUNC, from_stat.st_mode & 07777);
     if (wfd == INVALID_FILE_DES) {
         msg(LL_Error, "Failed to open %s:", to);
         close(rfd);
         return false;
     }
-    fail_if(-1 == fchmod(wfd, from_stat.st_mode), "Failed to copy file permission:");
 
-    // TODO: for bigger files do multiple read-write cycles
-    bool ok = false;
-    Buffer bytes = read_all(rfd);
-    if (bytes.items)
-        ok = write_all(wfd, bytes);
+    bool ok = _copy_fd(rfd, wfd);
+    if (ok && -1 == fchmod(wfd, from_stat.st_mode & 07777)) {
+        msg(LL_Error, "Failed to copy file permission to '%s':", to);
+        ok = false;
+    }
+    const struct timespec times[2] = { from_stat.st_atim, from_stat.st_mtim };
+    if (ok && -1 == futimens(wfd, times)) {
+        msg(LL_Error, "Failed to copy timestamps to '%s':", to);
+        ok = false;
+    }
 
     close(rfd);
-    close(wfd);
+    if (-1 == close(wfd) && ok) {
+        msg(LL_Error, "Failed to close %s:", to);
+        ok = false;
+    }
     return ok;
 }
 
-bool _cp_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter,
-             const size_t root_len, const size_t to_len)
-{
-    if (from->kind != TN_Node)
-        die("Should only be called with directories");
-
-    Buffer buf = zero(Buffer);
-    da_append_many(&buf, to, to_len);
-    if (buf.items[buf.len - 1] != '/')
-        da_append(&buf, '/');
-    da_append_many(&buf, from->name + root_len, strlen(from->name) - root_len);
-    if (buf.items[buf.len - 1] != '/')
-        da_append(&buf, '/');
-    da_append(&buf, '\0');
-
-    if (state.dry)
-        msg(LL_Info, "mkdir %.*s", (int) buf.len, buf.items);
-    else
-        mkdir(buf.items, 0755);
+// :io_uring
+// Minimal io_uring wrapper using the raw syscalls, liburing is not required.
 
-    bool encountered_node = false;
-    for (size_t i = 0; i < from->children.len; i += 1) {
-        if (filter && !filter(&from->children.items[i]))
-            continue;
+// Files bigger than this are copied using `_copy_fd` instead of a single
+// read/write pair.
+#define URING_COPY_MAX (256 * BUFFER_SIZE)
+// Buffer shared by all small files of a batch
+#define URING_BUFFER_SIZE (4 * 1024 * BUFFER_SIZE)
+#define URING_DEPTH (256)
 
-        buf.len = to_len;
-        Tree_Node *child = &from->children.items[i];
-        switch (child->kind) {
-        case TN_Leaf:
-            // This assert should never be triggered because `tree(...)` will sort
-            // files before directories.
-            assert(!encountered_node && "Buffer corrupted");
-            da_append_many(&buf, child->name + root_len, strlen(child->name + root_len));
-            da_append(&buf, '\0');
-            cp(child->name, buf.items);
-            break;
-        case TN_Node:
-            encountered_node = true;
-            da_append(&buf, '/');
-            da_append(&buf, '\0');
-            _cp_dir(child, to, filter, root_len, to_len);
-            break;
-        default:
-            unreachable();
-        }
-    }
-    
-    if (buf.items)
-        _free(buf.items);
-    return true;
+typedef struct {
+    Fd fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    // Number of entries queued but not yet submitted
+    unsigned queued;
+} Uring;
+
+static void _uring_close(Uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_len);
+    if (INVALID_FILE_DES != r->fd)
+        close(r->fd);
+    *r = zero(Uring);
+    r->fd = INVALID_FILE_DES;
 }
 
-bool cp_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter)
+// Fails if io_uring is not available or does not support all `ops`.
+static bool _uring_open(Uring *r, unsigned entries, const int *ops, size_t ops_len)
 {
-    if (from->kind != TN_Node) {
-        // TODO: simply call cp or fail?
-        msg(LL_Error, "Not a directory: '%s'", from->name);
+    *r = zero(Uring);
+    struct io_uring_params p = zero(struct io_uring_params);
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (INVALID_FILE_DES == r->fd) {
+        msg(LL_Debug, "io_uring is not available:");
         return false;
     }
-    size_t root_len = strlen(from->name);
-    char *to2 = to[strlen(to) - 1] == '/' ? to : concat(to, "/");
-    const bool ok = _cp_dir(from, to2, filter, root_len, strlen(to2));
-    return ok;
-}
 
-bool write_all(Fd fd, Buffer bytes)
-{
-    if (state.dry) {
-        msg(LL_Info, "Writing %zu bytes to fd %d", bytes.len, fd);
-        return true;
+    const size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (!probe)
+        die("Allocation failed:");
+    bool supported = 0 == syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256);
+    for (size_t i = 0; supported && i < ops_len; i += 1) {
+        supported = ops[i] <= probe->last_op
+            && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    _free(probe);
+    if (!supported) {
+        msg(LL_Debug, "io_uring does not support all required operations");
+        _uring_close(r);
+        return false;
     }
 
-    size_t written = 0;
-    while (written < bytes.len) {
-        ssize_t w = write(fd, bytes.items + written, bytes.len - written);
-        fail_if(-1 == w, "Failed to write to fd:");
-        written += w;
+    r->entries = p.sq_entries;
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len)
+            r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == r->sq_ring) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == r->cq_ring) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
     }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == r->sqes) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_tail  = (unsigned*) ((char*) r->sq_ring + p.sq_off.tail);
+    r->sq_mask  = (unsigned*) ((char*) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*) ((char*) r->sq_ring + p.sq_off.array);
+    r->cq_head  = (unsigned*) ((char*) r->cq_ring + p.cq_off.head);
+    r->cq_tail  = (unsigned*) ((char*) r->cq_ring + p.cq_off.tail);
+    r->cq_mask  = (unsigned*) ((char*) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*) ((char*) r->cq_ring + p.cq_off.cqes);
     return true;
+
+fail:
+    msg(LL_Debug, "Failed to map io_uring:");
+    _uring_close(r);
+    return false;
 }
 
-Buffer read_all(Fd fd)
+// Returns a cleared submission entry. At most `r->entries` entries may be
+// queued before calling `_uring_run`.
+static struct io_uring_sqe *_uring_sqe(Uring *r, int op, Fd fd, uint64_t user_data)
 {
-    char rbuf[BUFFER_SIZE];
-    Buffer buf = zero(Buffer);
-    bool error = false;
-    bool exit = false;
-    do {
-        ssize_t r = read(fd, rbuf, sizeof(rbuf));
-        switch (r) {
-        case -1:
-            msg(LL_Error, "Failed to read fd:");
-            error = true;
-        case 0:
-            exit = true;
-            break;
-        default:
-            da_append_many(&buf, rbuf, r);
-            break;
+    assert(r->queued < r->entries && "Submission queue is full");
+    const unsigned tail = *r->sq_tail + r->queued;
+    const unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    r->queued += 1;
+    return sqe;
+}
+
+// Submits everything queued and waits until all of it completed.
+// The result of every entry is stored at `res[user_data]`.
+static bool _uring_run(Uring *r, int *res)
+{
+    const unsigned n = r->queued;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->queued = 0;
+
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    while (completed < n) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, n - submitted, n - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (-1 == ret) {
+            if (EINTR == errno || EAGAIN == errno || EBUSY == errno)
+                continue;
+            fail_if(true, "io_uring_enter failed:");
         }
-    } while (!exit);
+        submitted += ret;
 
-    if (error) {
-        if (buf.items)
-            _free(buf.items);
-        buf = zero(Buffer);
-    } else {
-        register_ptr(buf.items);
+        unsigned head = *r->cq_head;
+        const unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head += 1, completed += 1) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
     }
-    
-    return buf;
+    return true;
 }
 
-// :command :process
-
-Process cmd_execa(Cmd cmd, int redirects)
+// Everything cp_dir has to create. Directories are stored in pre-order, so
+// parents always come before their children.
+typedef struct {
+    Strings dirs;
+    Sizes depths;
+    // Source node of each directory
+    DA_STRUCT(Tree_Node*) nodes;
+    Strings srcs;
+    Strings dsts;
+    // Number of srcs, that could not be copied
+    size_t failed;
+    // Size of the srcs, that were copied
+    size_t bytes;
+} Cp_Plan;
+
+static void _cp_plan_free(Cp_Plan *plan)
 {
-    Buffer cmd_str = zero(Buffer);
-    for (size_t i = 0; i < cmd.len; i += 1) {
-        da_append_many(&cmd_str, cmd.items[i], strlen(cmd.items[i]));
-        da_append(&cmd_str, ' ');
-    }
-    da_append(&cmd_str, '\0');
-    if (strcmp(cmd.items[0], "sudo") == 0)
-        msg(LL_Warn, "Running sudo cmd: %s", cmd_str.items);
-    else 
-        msg(state.dry ? LL_Info : LL_Debug, "Running cmd: %s", cmd_str.items);
-    _free(cmd_str.items);
-
-    if (state.dry && !state.dry_allow_commands) {
-        return PSEUDO_PROCESS;
-    }
+    for (size_t i = 0; i < plan->dirs.len; i += 1)
+        free(plan->dirs.items[i]);
+    for (size_t i = 0; i < plan->dsts.len; i += 1)
+        free(plan->dsts.items[i]);
+    if (plan->dirs.items)
+        _free(plan->dirs.items);
+    if (plan->depths.items)
+        _free(plan->depths.items);
+    if (plan->nodes.items)
+        _free(plan->nodes.items);
+    if (plan->srcs.items)
+        _free(plan->srcs.items);
+    if (plan->dsts.items)
+        _free(plan->dsts.items);
+    *plan = zero(Cp_Plan);
+}
 
-    // TODO: Exit when something errors?
-    int stdin_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
-    if (redirects & IOR_stdin) {
-        if (-1 == pipe(stdin_pipe))
-            msg(LL_Error, "Failed to create stdin pipe:");
-    }
+static void _cp_dir_collect(Tree_Node *from, Tree_Node_Filter_fn filter,
+                            const size_t root_len, char *to, size_t depth, Cp_Plan *plan)
+{
+    const char *rel = from->name + root_len;
+    if ('/' == *rel)
+        rel += 1;
+    char *dir;
+    if (-1 == asprintf(&dir, "%s%s%s", to, rel, (*rel && rel[strlen(rel) - 1] != '/') ? "/" : ""))
+        die("Allocation failed:");
+    da_append(&plan->dirs, dir);
+    da_append(&plan->depths, depth);
+    da_append(&plan->nodes, from);
 
-    int stdout_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
-    if (redirects & IOR_stdout) {
-        if (-1 == pipe(stdout_pipe))
-            msg(LL_Error, "Failed to create stdout pipe:");
+    for (size_t i = 0; i < from->children.len; i += 1) {
+        Tree_Node *child = &from->children.items[i];
+        if (filter && !filter(child))
+            continue;
+        if (TN_Node == child->kind) {
+            _cp_dir_collect(child, filter, root_len, to, depth + 1, plan);
+            continue;
+        }
+        rel = child->name + root_len;
+        if ('/' == *rel)
+            rel += 1;
+        char *dst;
+        if (-1 == asprintf(&dst, "%s%s", to, rel))
+            die("Allocation failed:");
+        da_append(&plan->srcs, child->name);
+        da_append(&plan->dsts, dst);
     }
+}
 
-    int stderr_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
-    if (redirects & IOR_stderr) {
-        if (-1 == pipe(stderr_pipe))
-            msg(LL_Error, "Failed to create stderr pipe:");
-    }
+// Executes the plan by batching the system calls for many files using io_uring.
+// Returns the number of errors or -1 if io_uring is not usable, in which case
+// nothing has been done yet.
+static ssize_t _cp_plan_uring(Cp_Plan *plan)
+{
+    static const int ops[] = {
+        IORING_OP_MKDIRAT, IORING_OP_STATX, IORING_OP_OPENAT,
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE,
+    };
+    Uring r;
+    if (!_uring_open(&r, URING_DEPTH, ops, sizeof(ops) / sizeof(*ops)))
+        return -1;
 
-    Pid id = fork();
-    if (id < 0) {
-        msg(LL_Error, "Failed to fork child process:");
-        return INVALID_PROCESS;
+    size_t errors = 0;
+    int *res = calloc(r.entries, sizeof(*res));
+    if (!res)
+        die("Allocation failed:");
+
+    // Parents have to exist before their children, so directories are
+    // created one level at a time.
+    size_t max_depth = 0;
+    for (size_t i = 0; i < plan->depths.len; i += 1)
+        max_depth = plan->depths.items[i] > max_depth ? plan->depths.items[i] : max_depth;
+    for (size_t depth = 0; depth <= max_depth; depth += 1) {
+        Sizes batch = zero(Sizes);
+        for (size_t i = 0; i <= plan->dirs.len; i += 1) {
+            if (batch.len == r.entries || (i == plan->dirs.len && batch.len)) {
+                if (!_uring_run(&r, res))
+                    die("io_uring failed");
+                for (size_t j = 0; j < batch.len; j += 1) {
+                    if (0 == res[j] || -EEXIST == res[j])
+                        continue;
+                    errno = -res[j];
+                    msg(LL_Error, "Failed to create directory '%s':", plan->dirs.items[batch.items[j]]);
+                    errors += 1;
+                }
+                batch.len = 0;
+            }
+            if (i == plan->dirs.len || plan->depths.items[i] != depth)
+                continue;
+            struct io_uring_sqe *sqe = _uring_sqe(&r, IORING_OP_MKDIRAT, AT_FDCWD, batch.len);
+            sqe->addr = (uint64_t) plan->dirs.items[i];
+            sqe->len = 0755;
+            da_append(&batch, i);
+        }
+        if (batch.items)
+            _free(batch.items);
     }
 
-    if (id == 0) {
-        if (stdin_pipe[PIPE_READ] != INVALID_FILE_DES) {
-            if (-1 == dup2(stdin_pipe[PIPE_READ], STDIN_FILENO))
-                msg(LL_Error, "Failed to redirect stdin:");
-            close(stdin_pipe[PIPE_WRITE]);
+    // Per batch of files:
+    // 1. statx and open the sources
+    // 2. open the destinations
+    // 3. linked read-write pairs for small files, the rest uses _copy_fd
+    // 4. permissions and timestamps, then closing everything
+    const size_t batch_len = r.entries / 2;
+    struct statx *stx = calloc(batch_len, sizeof(*stx));
+    Fd *rfds = calloc(batch_len, sizeof(*rfds));
+    Fd *wfds = calloc(batch_len, sizeof(*wfds));
+    bool *ok = calloc(batch_len, sizeof(*ok));
+    char *buf = malloc(URING_BUFFER_SIZE);
+    if (!stx || !rfds || !wfds || !ok || !buf)
+        die("Allocation failed:");
+
+    for (size_t start = 0; start < plan->srcs.len; start += batch_len) {
+        const size_t n = plan->srcs.len - start < batch_len ? plan->srcs.len - start : batch_len;
+        char **src = plan->srcs.items + start;
+        char **dst = plan->dsts.items + start;
+
+        for (size_t i = 0; i < n; i += 1) {
+            struct io_uring_sqe *sqe = _uring_sqe(&r, IORING_OP_STATX, AT_FDCWD, 2 * i);
+            sqe->addr = (uint64_t) src[i];
+            sqe->len = STATX_MODE | STATX_SIZE | STATX_ATIME | STATX_MTIME;
+            sqe->off = (uint64_t) &stx[i];
+            sqe = _uring_sqe(&r, IORING_OP_OPENAT, AT_FDCWD, 2 * i + 1);
+            sqe->addr = (uint64_t) src[i];
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
         }
-        if (stdout_pipe[PIPE_WRITE] != INVALID_FILE_DES) {
-            if (-1 == dup2(stdout_pipe[PIPE_WRITE], STDOUT_FILENO))
-                msg(LL_Error, "Failed to redirect stdout:");
-            close(stdout_pipe[PIPE_READ]);
+        if (!_uring_run(&r, res))
+            die("io_uring failed");
+        for (size_t i = 0; i < n; i += 1) {
+            rfds[i] = res[2 * i + 1] >= 0 ? res[2 * i + 1] : INVALID_FILE_DES;
+            wfds[i] = INVALID_FILE_DES;
+            ok[i] = res[2 * i] >= 0 && INVALID_FILE_DES != rfds[i];
+            if (!ok[i]) {
+                errno = -(res[2 * i] < 0 ? res[2 * i] : res[2 * i + 1]);
+                msg(LL_Error, "Failed to open %s:", src[i]);
+                continue;
+            }
+            struct io_uring_sqe *sqe = _uring_sqe(&r, IORING_OP_OPENAT, AT_FDCWD, i);
+            sqe->addr = (uint64_t) dst[i];
+            sqe->len = stx[i].stx_mode & 07777;
+            sqe->open_flags = O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC;
         }
-        if (stderr_pipe[PIPE_WRITE] != INVALID_FILE_DES) {
-            if (-1 == dup2(stderr_pipe[PIPE_WRITE], STDERR_FILENO))
-                msg(LL_Error, "Failed to redirect stderr:");
-            close(stderr_pipe[PIPE_READ]);
+        if (!_uring_run(&r, res))
+            die("io_uring failed");
+        for (size_t i = 0; i < n; i += 1) {
+            if (!ok[i])
+                continue;
+            if (res[i] < 0) {
+                errno = -res[i];
+                msg(LL_Error, "Failed to open %s:", dst[i]);
+                ok[i] = false;
+                continue;
+            }
+            wfds[i] = res[i];
         }
 
-        da_append(&cmd, NULL);
-        if (-1 == execvp(cmd.items[0], (char*const*)cmd.items)) {
-            msg(LL_Error, "execution failed:");
-            exit(1);
-        }
+#define _uring_small(i) (ok[i] && 0 < stx[i].stx_size && stx[i].stx_size <= URING_COPY_MAX)
+        size_t used = 0;
+        size_t first = 0;
+        for (size_t i = 0; i <= n; i += 1) {
+            if (i == n || (_uring_small(i) && used + stx[i].stx_size > URING_BUFFER_SIZE)) {
+                if (used && !_uring_run(&r, res))
+                    die("io_uring failed");
+                for (size_t j = first; used && j < i; j += 1) {
+                    if (!_uring_small(j))
+                        continue;
+                    const int size = stx[j].stx_size;
+                    if (res[2 * j] == size && res[2 * j + 1] == size)
+                        continue;
+                    // Short read or write, e.g. the file changed in the meantime
+                    ok[j] = -1 != lseek(rfds[j], 0, SEEK_SET)
+                        && -1 != ftruncate(wfds[j], 0)
+                        && _copy_fd(rfds[j], wfds[j]);
+                }
+                used = 0;
+                first = i;
+            }
+            if (i == n)
+                break;
+            if (!ok[i] || 0 == stx[i].stx_size)
+                continue;
+            if (!_uring_small(i)) {
+                ok[i] = _copy_fd(rfds[i], wfds[i]);
+                continue;
+            }
 
-        unreachable();
+            struct io_uring_sqe *sqe = _uring_sqe(&r, IORING_OP_READ, rfds[i], 2 * i);
+            sqe->addr = (uint64_t) (buf + used);
+            sqe->len = stx[i].stx_size;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = _uring_sqe(&r, IORING_OP_WRITE, wfds[i], 2 * i + 1);
+            sqe->addr = (uint64_t) (buf + used);
+            sqe->len = stx[i].stx_size;
+            used += stx[i].stx_size;
+        }
+#undef _uring_small
+
+        for (size_t i = 0; i < n; i += 1) {
+            if (ok[i]) {
+                const struct timespec times[2] = {
+                    { stx[i].stx_atime.tv_sec, stx[i].stx_atime.tv_nsec },
+                    { stx[i].stx_mtime.tv_sec, stx[i].stx_mtime.tv_nsec },
+                };
+                if (-1 == fchmod(wfds[i], stx[i].stx_mode & 07777)) {
+                    msg(LL_Error, "Failed to copy file permission to '%s':", dst[i]);
+                    ok[i] = false;
+                } else if (-1 == futimens(wfds[i], times)) {
+                    msg(LL_Error, "Failed to copy timestamps to '%s':", dst[i]);
+                    ok[i] = false;
+                }
+            }
+            if (!ok[i]) {
+                errors += 1;
+                plan->failed += 1;
+            } else {
+                plan->bytes += stx[i].stx_size;
+            }
+            if (INVALID_FILE_DES != rfds[i])
+                _uring_sqe(&r, IORING_OP_CLOSE, rfds[i], 2 * i);
+            if (INVALID_FILE_DES != wfds[i])
+                _uring_sqe(&r, IORING_OP_CLOSE, wfds[i], 2 * i + 1);
+        }
+        if (!_uring_run(&r, res))
+            die("io_uring failed");
     }
 
-    if (stdin_pipe[PIPE_READ] != INVALID_FILE_DES)
-        close(stdin_pipe[PIPE_READ]);
-    if (stdout_pipe[PIPE_WRITE] != INVALID_FILE_DES)
-        close(stdout_pipe[PIPE_WRITE]);
-    if (stderr_pipe[PIPE_WRITE] != INVALID_FILE_DES)
+    _free(stx);
+    _free(rfds);
+    _free(wfds);
+    _free(ok);
+    _free(buf);
+    _free(res);
+    _uring_close(&r);
+    return errors;
+}
+
+// Executes the plan one system call at a time. Returns the number of errors.
+static size_t _cp_plan_sync(Cp_Plan *plan)
+{
+    size_t errors = 0;
+    for (size_t i = 0; i < plan->dirs.len; i += 1) {
+        if (state.dry) {
+            msg(LL_Info, "mkdir %s", plan->dirs.items[i]);
+            _plan_record(PO_Mkdir, &plan->dirs.items[i], 1);
+        } else if (-1 == mkdir(plan->dirs.items[i], 0755) && EEXIST != errno) {
+            msg(LL_Error, "Failed to create directory '%s':", plan->dirs.items[i]);
+            errors += 1;
+        }
+    }
+    for (size_t i = 0; i < plan->srcs.len; i += 1) {
+        struct stat st;
+        if (!cp(plan->srcs.items[i], plan->dsts.items[i])) {
+            errors += 1;
+            plan->failed += 1;
+        } else if (0 == stat(plan->srcs.items[i], &st)) {
+            plan->bytes += st.st_size;
+        }
+    }
+    return errors;
+}
+
+static int _rm_entry(const char *path, const struct stat *s, int flag, struct FTW *ftw)
+{
+    ignore_param(s);
+    ignore_param(flag);
+    ignore_param(ftw);
+    if (-1 == remove(path)) {
+        msg(LL_Error, "Failed to remove '%s':", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Removes everything inside the destination directory of `node`, that has no
+// counterpart in `node`. Entries excluded by a filter still count as present.
+// Returns the number of errors.
+static size_t _cp_dir_prune(Tree_Node *node, char *dir, Cp_Stats *stats)
+{
+    Ls_Files entries;
+    if (!exists(dir, FF_Directory))
+        return 0; // dry mode
+    if (!ls(dir, FF_Any ^ (FF_Current | FF_Parent), &entries))
+        return 1;
+
+    Strings names = zero(Strings);
+    for (size_t i = 0; i < node->children.len; i += 1) {
+        char *name = strrchr(node->children.items[i].name, '/');
+        da_append(&names, name ? name + 1 : node->children.items[i].name);
+    }
+    if (names.items)
+        qsort(names.items, names.len, sizeof(*names.items), _strcmp);
+
+    size_t errors = 0;
+    for (size_t i = 0; i < entries.len; i += 1) {
+        if (names.items && bsearch(&entries.items[i].name, names.items, names.len,
+                                   sizeof(*names.items), _strcmp))
+            continue;
+        char *path = concat(dir, entries.items[i].name);
+        stats->deleted += 1;
+        if (state.dry) {
+            msg(LL_Info, "Removing '%s'", path);
+            _plan_record(PO_Remove, (char*[]) { path, "-r" }, 2);
+            continue;
+        }
+        msg(LL_Debug, "Removing '%s'", path);
+        if (-1 == nftw(path, _rm_entry, 16, FTW_DEPTH | FTW_PHYS))
+            errors += 1;
+    }
+    if (names.items)
+        _free(names.items);
+    return errors;
+}
+
+bool cp_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter)
+{
+    return cp_dir_sync(from, to, filter, CP_None, NULL);
+}
+
+bool cp_dir_sync(Tree_Node *from, char *to, Tree_Node_Filter_fn filter, int flags,
+                 Cp_Stats *stats)
+{
+    if (from->kind != TN_Node) {
+        // TODO: simply call cp or fail?
+        msg(LL_Error, "Not a directory: '%s'", from->name);
+        return false;
+    }
+    _Span span = _span_begin("fs", "cp_dir %s -> %s", from->name, to);
+    _track_write(to);
+    Cp_Stats local = zero(Cp_Stats);
+    if (!stats)
+        stats = &local;
+    *stats = zero(Cp_Stats);
+
+    size_t root_len = strlen(from->name);
+    char *to2 = to[strlen(to) - 1] == '/' ? to : concat(to, "/");
+    Cp_Plan plan = zero(Cp_Plan);
+    _cp_dir_collect(from, filter, root_len, to2, 0, &plan);
+
+    size_t errors = 0;
+    if (flags & CP_Prune) {
+        for (size_t i = 0; i < plan.dirs.len; i += 1) {
+            // The children of directories cut off by max_depth are unknown
+            if (!plan.nodes.items[i]->truncated)
+                errors += _cp_dir_prune(plan.nodes.items[i], plan.dirs.items[i], stats);
+        }
+    }
+
+    // Drop everything that is up to date, not necessary for a plain copy
+    const bool check = (flags & (CP_Sync | CP_Hash)) || stats != &local;
+    size_t kept = 0;
+    for (size_t i = 0; check && i < plan.srcs.len; i += 1) {
+        struct stat src, dst;
+        if (-1 == stat(plan.srcs.items[i], &src)) {
+            msg(LL_Error, "Failed to stat file '%s' for copy:", plan.srcs.items[i]);
+            free(plan.dsts.items[i]);
+            errors += 1;
+            continue;
+        }
+        bool same = false;
+        if ((flags & (CP_Sync | CP_Hash)) && 0 == stat(plan.dsts.items[i], &dst)
+                && S_ISREG(dst.st_mode) && src.st_size == dst.st_size
+                && (src.st_mode & 07777) == (dst.st_mode & 07777)) {
+            if (flags & CP_Hash) {
+                uint64_t a = FNV_OFFSET, b = FNV_OFFSET;
+                same = _hash_file(&a, plan.srcs.items[i])
+                    && _hash_file(&b, plan.dsts.items[i]) && a == b;
+            } else {
+                same = src.st_mtim.tv_sec == dst.st_mtim.tv_sec
+                    && src.st_mtim.tv_nsec == dst.st_mtim.tv_nsec;
+            }
+        }
+        if (same) {
+            stats->skipped += 1;
+            free(plan.dsts.items[i]);
+            continue;
+        }
+        plan.srcs.items[kept] = plan.srcs.items[i];
+        plan.dsts.items[kept] = plan.dsts.items[i];
+        kept += 1;
+    }
+    if (check) {
+        plan.srcs.len = kept;
+        plan.dsts.len = kept;
+    }
+
+    ssize_t copy_errors = -1;
+    if (state.io_uring && !state.dry && plan.srcs.len) {
+        copy_errors = _cp_plan_uring(&plan);
+        if (-1 == copy_errors)
+            state.io_uring = false; // not available, don't try again
+    }
+    if (-1 == copy_errors)
+        copy_errors = _cp_plan_sync(&plan);
+    errors += copy_errors;
+    stats->copied = plan.srcs.len - plan.failed;
+    stats->bytes = plan.bytes;
+
+    if (flags != CP_None)
+        msg(LL_Info, "Synced '%s' -> '%s': %zu copied (%zu bytes), %zu skipped, %zu deleted",
+            from->name, to, stats->copied, stats->bytes, stats->skipped, stats->deleted);
+    _cp_plan_free(&plan);
+    if (span.cat) {
+        char args[256];
+        snprintf(args, sizeof(args), "\"copied\": %zu, \"bytes\": %zu, \"skipped\": %zu, "
+                 "\"deleted\": %zu, \"errors\": %zu", stats->copied, stats->bytes,
+                 stats->skipped, stats->deleted, errors);
+        _span_end(span, args);
+    }
+    return 0 == errors;
+}
+
+// :link
+// link_dir deploys a tree as symlinks pointing back into it, like GNU Stow.
+// Directories missing at the destination become a single symlink (folding),
+// existing ones are descended into. Symlinks into the source tree are owned
+// by link_dir. Files with the same content as their source, like copies from
+// before switching to link_dir, are replaced, anything else in the way is a
+// conflict. Everything is checked before the first change, so a conflict
+// leaves the destination untouched.
+
+typedef enum {
+    LK_Mkdir,
+    // Removes an owned symlink to a directory and creates the directory
+    LK_Unfold,
+    // Creates or replaces an owned symlink
+    LK_Link,
+    // Replaces a file equal to its source with a symlink
+    LK_Adopt,
+} _Link_Op_Kind;
+
+typedef struct {
+    _Link_Op_Kind kind;
+    char *path;
+    // Absolute path inside of the source tree, only for LK_Link and LK_Adopt
+    char *target;
+} _Link_Op;
+
+typedef DA_STRUCT(_Link_Op) _Link_Ops;
+
+typedef struct {
+    Tree_Node_Filter_fn filter;
+    // Absolute path of the source tree
+    char *root;
+    // Length of the name of the root node
+    size_t root_len;
+    _Link_Ops ops;
+    size_t conflicts;
+    size_t up_to_date;
+} _Link_Walk;
+
+// A directory may only be folded if the filter excludes nothing inside it
+static bool _link_foldable(const Tree_Node *node, Tree_Node_Filter_fn filter)
+{
+    for (size_t i = 0; filter && i < node->children.len; i += 1) {
+        const Tree_Node *child = &node->children.items[i];
+        if (!filter(child) || (TN_Node == child->kind && !_link_foldable(child, filter)))
+            return false;
+    }
+    return true;
+}
+
+// Replaces the symlink or nothing at `path` with a symlink to `target`, or a
+// regular file if `adopt` is set.
+static bool _link_replace(char *target, char *path, bool adopt)
+{
+    struct stat s;
+    if (0 == lstat(path, &s) && !S_ISLNK(s.st_mode) && !(adopt && S_ISREG(s.st_mode))) {
+        msg(LL_Error, "Failed to link '%s': it is in the way", path);
+        return false;
+    }
+    char *tmp;
+    if (-1 == asprintf(&tmp, "%s.%d.tmp", path, getpid()))
+        die("Allocation failed:");
+    // Renamed over the old symlink, so the path never goes missing
+    bool ok = 0 == symlink(target, tmp);
+    if (ok && -1 == rename(tmp, path)) {
+        unlink(tmp);
+        ok = false;
+    }
+    if (!ok)
+        msg(LL_Error, "Failed to link '%s' to '%s':", path, target);
+    _free(tmp);
+    return ok;
+}
+
+// Returns true if `path` is a symlink into `root`, `target` is set to where it
+// points to.
+static bool _link_owned(const char *root, const char *path, char target[PATH_MAX])
+{
+    const ssize_t len = readlink(path, target, PATH_MAX - 1);
+    if (-1 == len)
+        return false;
+    target[len] = '\0';
+    const size_t n = strlen(root);
+    return 0 == strncmp(target, root, n) && ('\0' == target[n] || '/' == target[n]);
+}
+
+// Returns true if the regular file `path`, that `s` was taken of, has the same
+// content as `src`.
+static bool _link_identical(const char *src, const char *path, const struct stat *s)
+{
+    struct stat from;
+    if (!S_ISREG(s->st_mode) || -1 == stat(src, &from) || from.st_size != s->st_size)
+        return false;
+    uint64_t a = FNV_OFFSET, b = FNV_OFFSET;
+    return _hash_file(&a, src) && _hash_file(&b, path) && a == b;
+}
+
+// `missing` is set if a parent of `dst` is created by the plan.
+static void _link_collect(_Link_Walk *w, const Tree_Node *node, char *dst, bool missing)
+{
+    const char *rel = node->name + w->root_len;
+    if ('/' == *rel)
+        rel += 1;
+    char *target = *rel ? concat(w->root, "/", rel) : w->root;
+    const bool fold = TN_Node != node->kind || _link_foldable(node, w->filter);
+
+    struct stat s;
+    char current[PATH_MAX];
+    if (missing || -1 == lstat(dst, &s)) {
+        if (fold) {
+            da_append(&w->ops, ((_Link_Op) { LK_Link, dst, target }));
+            return;
+        }
+        da_append(&w->ops, ((_Link_Op) { LK_Mkdir, dst, NULL }));
+        missing = true;
+    } else if (S_ISLNK(s.st_mode) && _link_owned(w->root, dst, current)) {
+        if (fold) {
+            if (0 == strcmp(current, target))
+                w->up_to_date += 1;
+            else
+                da_append(&w->ops, ((_Link_Op) { LK_Link, dst, target }));
+            return;
+        }
+        // Folded before, but the filter excludes something inside it now
+        da_append(&w->ops, ((_Link_Op) { LK_Unfold, dst, NULL }));
+        missing = true;
+    } else if (TN_Node != node->kind && _link_identical(target, dst, &s)) {
+        da_append(&w->ops, ((_Link_Op) { LK_Adopt, dst, target }));
+        return;
+    } else if (TN_Node != node->kind || !S_ISDIR(s.st_mode)) {
+        msg(LL_Error, "Conflict: '%s' is in the way of a link to '%s'", dst, target);
+        w->conflicts += 1;
+        return;
+    }
+
+    for (size_t i = 0; i < node->children.len; i += 1) {
+        const Tree_Node *child = &node->children.items[i];
+        if (w->filter && !w->filter(child))
+            continue;
+        const char *name = strrchr(child->name, '/');
+        _link_collect(w, child, concat(dst, "/", name ? name + 1 : child->name), missing);
+    }
+}
+
+bool link_dir(Tree_Node *from, char *to, Tree_Node_Filter_fn filter)
+{
+    if (from->kind != TN_Node) {
+        msg(LL_Error, "Not a directory: '%s'", from->name);
+        return false;
+    }
+    char *root = realpath(from->name, NULL);
+    if (!root) {
+        msg(LL_Error, "Failed to resolve '%s':", from->name);
+        return false;
+    }
+    _Span span = _span_begin("fs", "link_dir %s -> %s", from->name, to);
+    _track_write(to);
+    const size_t scope = scope_push();
+
+    // A symlink is created at the path itself, not inside of it
+    char *dst = concat(to);
+    for (size_t len = strlen(dst); len > 1 && '/' == dst[len - 1]; len -= 1)
+        dst[len - 1] = '\0';
+    _Link_Walk w = { .filter = filter, .root = root, .root_len = strlen(from->name) };
+    _link_collect(&w, from, dst, false);
+
+    size_t errors = 0;
+    if (0 < w.conflicts) {
+        msg(LL_Error, "Not linking '%s' -> '%s': %zu conflict%s", from->name, to,
+            w.conflicts, 1 == w.conflicts ? "" : "s");
+        w.ops.len = 0;
+        errors = w.conflicts;
+    }
+    for (size_t i = 0; i < w.ops.len; i += 1) {
+        _Link_Op *op = &w.ops.items[i];
+        if (state.dry) {
+            msg(LL_Info, "%s %s%s%s", op->target ? "link" : "mkdir", op->path,
+                op->target ? " -> " : "", op->target ? op->target : "");
+            if (LK_Unfold == op->kind || LK_Adopt == op->kind)
+                _plan_record(PO_Remove, &op->path, 1);
+            if (op->target)
+                _plan_record(PO_Link, (char*[]) { op->target, op->path }, 2);
+            else
+                _plan_record(PO_Mkdir, &op->path, 1);
+            continue;
+        }
+        if (op->target) {
+            errors += !_link_replace(op->target, op->path, LK_Adopt == op->kind);
+            continue;
+        }
+        if ((LK_Unfold == op->kind && -1 == unlink(op->path))
+                || (-1 == mkdir(op->path, 0755) && EEXIST != errno)) {
+            msg(LL_Error, "Failed to create directory '%s':", op->path);
+            errors += 1;
+        }
+    }
+
+    msg(LL_Info, "Linked '%s' -> '%s': %zu changed, %zu up to date",
+        from->name, to, w.ops.len, w.up_to_date);
+    if (span.cat) {
+        char args[128];
+        snprintf(args, sizeof(args), "\"changed\": %zu, \"up_to_date\": %zu, \"conflicts\": %zu",
+                 w.ops.len, w.up_to_date, w.conflicts);
+        _span_end(span, args);
+    }
+    if (w.ops.items)
+        _free(w.ops.items);
+    scope_pop(scope);
+    _free(root);
+    return 0 == errors;
+}
+
+bool write_all(Fd fd, Buffer bytes)
+{
+    if (state.dry) {
+        msg(LL_Info, "Writing %zu bytes to fd %d", bytes.len, fd);
+        return true;
+    }
+
+    // The fd might belong to a new executable
+    state.exes.checked = false;
+    size_t written = 0;
+    while (written < bytes.len) {
+        ssize_t w = write(fd, bytes.items + written, bytes.len - written);
+        fail_if(-1 == w, "Failed to write to fd:");
+        written += w;
+    }
+    return true;
+}
+
+Buffer read_all(Fd fd)
+{
+    char rbuf[BUFFER_SIZE];
+    Buffer buf = zero(Buffer);
+    _da_scoped(&buf);
+    bool error = false;
+    bool exit = false;
+    do {
+        ssize_t r = read(fd, rbuf, sizeof(rbuf));
+        switch (r) {
+        case -1:
+            msg(LL_Error, "Failed to read fd:");
+            error = true;
+        case 0:
+            exit = true;
+            break;
+        default:
+            da_append_many(&buf, rbuf, r);
+            break;
+        }
+    } while (!exit);
+
+    if (error)
+        buf = zero(Buffer);
+
+    return buf;
+}
+
+// :command :process
+
+Process cmd_execa(Cmd cmd, int redirects)
+{
+    Buffer cmd_str = zero(Buffer);
+    for (size_t i = 0; i < cmd.len; i += 1) {
+        da_append_many(&cmd_str, cmd.items[i], strlen(cmd.items[i]));
+        da_append(&cmd_str, ' ');
+    }
+    da_append(&cmd_str, '\0');
+    if (strcmp(cmd.items[0], "sudo") == 0)
+        msg(LL_Warn, "Running sudo cmd: %s", cmd_str.items);
+    else 
+        msg(state.dry ? LL_Info : LL_Debug, "Running cmd: %s", cmd_str.items);
+    _free(cmd_str.items);
+    _plan_record(PO_Exec, cmd.items, cmd.len);
+
+    if (state.dry && !state.dry_allow_commands) {
+        return PSEUDO_PROCESS;
+    }
+
+    if (redirects & IOR_forward)
+        redirects |= IOR_stdout | IOR_stderr;
+
+    // All pipes are CLOEXEC, so concurrently spawned children do not keep each
+    // others pipes open.
+    // TODO: Exit when something errors?
+    int stdin_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
+    if (redirects & IOR_stdin) {
+        if (-1 == pipe2(stdin_pipe, O_CLOEXEC))
+            msg(LL_Error, "Failed to create stdin pipe:");
+    }
+
+    int stdout_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
+    if (redirects & IOR_stdout) {
+        if (-1 == pipe2(stdout_pipe, O_CLOEXEC))
+            msg(LL_Error, "Failed to create stdout pipe:");
+    }
+
+    int stderr_pipe[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
+    if (redirects & IOR_stderr) {
+        if (-1 == pipe2(stderr_pipe, O_CLOEXEC))
+            msg(LL_Error, "Failed to create stderr pipe:");
+    }
+
+    // posix_spawn uses vfork semantics, so the cost of spawning does not grow
+    // with the address space of sys-setup. Exec failures are returned by it.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_pipe[PIPE_READ] != INVALID_FILE_DES)
+        posix_spawn_file_actions_adddup2(&actions, stdin_pipe[PIPE_READ], STDIN_FILENO);
+    if (stdout_pipe[PIPE_WRITE] != INVALID_FILE_DES)
+        posix_spawn_file_actions_adddup2(&actions, stdout_pipe[PIPE_WRITE], STDOUT_FILENO);
+    if (stderr_pipe[PIPE_WRITE] != INVALID_FILE_DES)
+        posix_spawn_file_actions_adddup2(&actions, stderr_pipe[PIPE_WRITE], STDERR_FILENO);
+
+    char **argv = malloc((cmd.len + 1) * sizeof(*argv));
+    if (!argv)
+        die("Allocation failed:");
+    memcpy(argv, cmd.items, cmd.len * sizeof(*argv));
+    argv[cmd.len] = NULL;
+
+    Pid id = INVALID_PID;
+    int error = posix_spawnp(&id, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    _free(argv);
+
+    if (stdin_pipe[PIPE_READ] != INVALID_FILE_DES)
+        close(stdin_pipe[PIPE_READ]);
+    if (stdout_pipe[PIPE_WRITE] != INVALID_FILE_DES)
+        close(stdout_pipe[PIPE_WRITE]);
+    if (stderr_pipe[PIPE_WRITE] != INVALID_FILE_DES)
         close(stderr_pipe[PIPE_WRITE]);
 
-    return (Process) {
-        .id      = id,
-        .stdin_  = stdin_pipe[PIPE_WRITE],
-        .stdout_ = stdout_pipe[PIPE_READ],
-        .stderr_ = stderr_pipe[PIPE_READ],
-    };
+    if (0 != error) {
+        errno = error;
+        msg(LL_Error, "Failed to execute %s:", cmd.items[0]);
+        if (stdin_pipe[PIPE_WRITE] != INVALID_FILE_DES)
+            close(stdin_pipe[PIPE_WRITE]);
+        if (stdout_pipe[PIPE_READ] != INVALID_FILE_DES)
+            close(stdout_pipe[PIPE_READ]);
+        if (stderr_pipe[PIPE_READ] != INVALID_FILE_DES)
+            close(stderr_pipe[PIPE_READ]);
+        return INVALID_PROCESS;
+    }
+
+    _trace_spawned(id, cmd);
+    _track_cmd(true);
+    state.exes.checked = false;
+    return (Process) {
+        .id        = id,
+        .stdin_    = stdin_pipe[PIPE_WRITE],
+        .stdout_   = stdout_pipe[PIPE_READ],
+        .stderr_   = stderr_pipe[PIPE_READ],
+        .redirects = redirects,
+    };
+}
+
+bool prcs_write(Process p, char *in)
+{
+    fail_if(p.stdin_ == INVALID_FILE_DES, "Can not write to stdin");
+
+    const size_t in_len = strlen(in);
+    size_t written = 0;
+    while (written < in_len) {
+        ssize_t w = write(p.stdin_, in + written, in_len - written);
+        if (-1 == w) {
+            msg(LL_Error, "Failed to write to child stdin (continuing):");
+            break;
+        }
+        written += w;
+    }
+    return written == in_len;
+}
+
+// State of a process while its output is drained by an event loop.
+typedef struct {
+    Process *p;
+    Buffer *bufs[2];
+    // Incomplete last line of each stream, only used with IOR_forward
+    Buffer lines[2];
+    // stdout, stderr and a pidfd of the process
+    Fd fds[3];
+} _Await;
+
+static void _await_start(_Await *a, Process *p, Buffer *out, Buffer *err)
+{
+    *a = (_Await) { .p = p, .bufs = { out, err } };
+    if (p->stdin_ != INVALID_FILE_DES) {
+        if (-1 == close(p->stdin_))
+            msg(LL_Error, "Failed to close stdin:");
+        p->stdin_ = INVALID_FILE_DES;
+    }
+    a->fds[0] = p->stdout_;
+    a->fds[1] = p->stderr_;
+    // Without a pidfd the process is only reaped after its output ended
+    a->fds[2] = syscall(SYS_pidfd_open, p->id, 0);
+    for (size_t i = 0; i < 2; i += 1) {
+        if (a->bufs[i])
+            _da_scoped(a->bufs[i]);
+    }
+}
+
+// Appends the fds a is still waiting on to pfds, returns their count.
+static size_t _await_pollfds(const _Await *a, struct pollfd *pfds)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < 3; i += 1) {
+        if (a->fds[i] >= 0)
+            pfds[n++] = (struct pollfd) { .fd = a->fds[i], .events = POLLIN };
+    }
+    return n;
+}
+
+static bool _await_done(const _Await *a)
+{
+    return a->fds[0] < 0 && a->fds[1] < 0 && a->fds[2] < 0;
+}
+
+static void _await_forward(_Await *a, size_t i, bool flush)
+{
+    Buffer *line = &a->lines[i];
+    const Log_Level ll = i == 0 ? LL_Info : LL_Warn;
+    const char *name = state.installer ? state.installer : "sys-setup";
+    size_t start = 0;
+    for (size_t j = 0; j < line->len; j += 1) {
+        if ('\n' != line->items[j])
+            continue;
+        msg(ll, "%s: %.*s", name, (int) (j - start), line->items + start);
+        start = j + 1;
+    }
+    if (flush && start < line->len) {
+        msg(ll, "%s: %.*s", name, (int) (line->len - start), line->items + start);
+        start = line->len;
+    }
+    memmove(line->items, line->items + start, line->len - start);
+    line->len -= start;
+}
+
+// Handles a ready fd of a, which must be one returned by _await_pollfds.
+static void _await_handle(_Await *a, const struct pollfd *pfd)
+{
+    if (pfd->fd == a->fds[2]) {
+        // The process exited, its output is still drained until EOF
+        close(a->fds[2]);
+        a->fds[2] = INVALID_FILE_DES;
+        return;
+    }
+
+    const size_t i = pfd->fd == a->fds[0] ? 0 : 1;
+    char buf[16 * BUFFER_SIZE];
+    ssize_t r = read(pfd->fd, buf, sizeof(buf));
+    if (-1 == r && EINTR == errno)
+        return;
+    if (r > 0) {
+        if (a->bufs[i])
+            da_append_many(a->bufs[i], buf, r);
+        if (a->p->redirects & IOR_forward) {
+            da_append_many(&a->lines[i], buf, r);
+            _await_forward(a, i, false);
+        }
+        return;
+    }
+
+    if (-1 == r)
+        msg(LL_Error, "Error while reading std%s:", i == 0 ? "out" : "err");
+    if (a->p->redirects & IOR_forward)
+        _await_forward(a, i, true);
+    if (-1 == close(pfd->fd))
+        msg(LL_Error, "Failed to close std%s:", i == 0 ? "out" : "err");
+    a->fds[i] = INVALID_FILE_DES;
+}
+
+static bool _await_finish(_Await *a)
+{
+    for (size_t i = 0; i < 2; i += 1) {
+        if (a->lines[i].items)
+            _free(a->lines[i].items);
+        if (a->bufs[i])
+            _adopt(a->bufs[i]->items);
+    }
+    a->p->stdout_ = INVALID_FILE_DES;
+    a->p->stderr_ = INVALID_FILE_DES;
+    struct rusage ru;
+    if (-1 == wait4(a->p->id, &a->p->status, 0, &ru)) {
+        msg(LL_Error, "Wait failed:");
+        return false;
+    }
+    _trace_reaped(a->p->id, a->p->status, &ru);
+    _track_cmd(false);
+    return true;
+}
+
+bool prcs_await(Process *p, Buffer *out, Buffer *err)
+{
+    if (PSEUDO_PID == p->id) {
+        p->status = 0;
+        return true;
+    }
+    fail_if(INVALID_PID == p->id, "Can not wait for an invalid process");
+
+    _Await a;
+    _await_start(&a, p, out, err);
+    struct pollfd pfds[3];
+    while (!_await_done(&a)) {
+        const size_t n = _await_pollfds(&a, pfds);
+        if (-1 == poll(pfds, n, -1)) {
+            if (EINTR == errno)
+                continue;
+            die("Poll failed:");
+        }
+        for (size_t i = 0; i < n; i += 1) {
+            if (pfds[i].revents)
+                _await_handle(&a, &pfds[i]);
+        }
+    }
+    return _await_finish(&a);
+}
+
+int cmd_execw(Cmd cmd, char *in, Buffer *out, Buffer *err)
+{
+    int redirects = IOR_none;
+    if (in)  redirects |= IOR_stdin;
+    if (out) redirects |= IOR_stdout;
+    if (err) redirects |= IOR_stderr;
+
+    Process p = cmd_execa(cmd, redirects);
+    if (p.id == INVALID_PID)
+        return -1;
+    if (in) {
+        // NOTE: Ignoring error because we still need to wait for the process
+        prcs_write(p, in);
+    }
+
+    if (state.dry && !state.dry_allow_commands)
+        return 0;
+
+    if (!prcs_await(&p, out, err))
+        return -1;
+    return WIFEXITED(p.status) ? WEXITSTATUS(p.status) : -1;
+}
+
+size_t cmd_exec_many(Cmd *cmds, size_t n, size_t max_parallel, Cmd_Result *results)
+{
+    if (0 == max_parallel) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_parallel = cpus > 0 ? cpus : 1;
+    }
+    if (max_parallel > n)
+        max_parallel = n;
+
+    // One slot per running command, `cmd` indexes into cmds
+    struct exec_slot {
+        size_t cmd;
+        Process p;
+        _Await a;
+    } *slots = calloc(max_parallel ? max_parallel : 1, sizeof(*slots));
+    struct pollfd *pfds = calloc(3 * max_parallel + 1, sizeof(*pfds));
+    size_t *owners = calloc(3 * max_parallel + 1, sizeof(*owners));
+    if (!slots || !pfds || !owners)
+        die("Allocation failed:");
+
+    size_t failures = 0, next = 0, running = 0;
+    while (next < n || running > 0) {
+        for (size_t s = 0; s < max_parallel && next < n; s += 1) {
+            if (slots[s].p.id > 0)
+                continue;
+            const size_t i = next++;
+            Cmd_Result *res = results ? &results[i] : NULL;
+            if (res)
+                *res = (Cmd_Result) { .code = -1 };
+            Process p = cmd_execa(cmds[i], res ? IOR_stdout | IOR_stderr : IOR_forward);
+            if (INVALID_PID == p.id || PSEUDO_PID == p.id) {
+                const int code = INVALID_PID == p.id ? -1 : 0;
+                if (res)
+                    res->code = code;
+                failures += 0 != code;
+                continue;
+            }
+            slots[s].cmd = i;
+            slots[s].p = p;
+            _await_start(&slots[s].a, &slots[s].p, res ? &res->out : NULL, res ? &res->err : NULL);
+            running += 1;
+        }
+        if (0 == running)
+            continue;
+
+        size_t npfds = 0;
+        for (size_t s = 0; s < max_parallel; s += 1) {
+            if (slots[s].p.id <= 0)
+                continue;
+            const size_t added = _await_pollfds(&slots[s].a, pfds + npfds);
+            for (size_t j = 0; j < added; j += 1)
+                owners[npfds + j] = s;
+            npfds += added;
+        }
+        if (-1 == poll(pfds, npfds, -1)) {
+            if (EINTR == errno)
+                continue;
+            die("Poll failed:");
+        }
+
+        for (size_t j = 0; j < npfds; j += 1) {
+            struct exec_slot *slot = &slots[owners[j]];
+            if (!pfds[j].revents)
+                continue;
+            _await_handle(&slot->a, &pfds[j]);
+            if (!_await_done(&slot->a))
+                continue;
+
+            const int status = _await_finish(&slot->a) ? slot->p.status : -1;
+            const int code = -1 != status && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            if (results)
+                results[slot->cmd].code = code;
+            failures += 0 != code;
+            slot->p = INVALID_PROCESS;
+            running -= 1;
+        }
+    }
+
+    _free(owners);
+    _free(pfds);
+    _free(slots);
+    return failures;
+}
+
+// :journal
+// Every installer has an append-only journal of the steps that succeeded.
+// Each line holds the fingerprint of a step and the fingerprint of its outputs.
+
+// Part of the environment, that is included in every fingerprint
+static const char *_journal_env[] = { "PATH", "CC", "CFLAGS", "LDFLAGS", "MAKEFLAGS" };
+
+static void _journal_free(_Journal *j)
+{
+    _index_free(&j->index);
+    if (j->installer)
+        _free(j->installer);
+    *j = zero(_Journal);
+}
+
+// Returns the journal of the running installer, loading it if necessary.
+static _Journal *_journal()
+{
+    _Journal *j = &state.journal;
+    const char *installer = state.installer ? state.installer : "sys-setup";
+    if (j->installer && 0 == strcmp(j->installer, installer))
+        return j;
+    _journal_free(j);
+    j->installer = strdup(installer);
+    if (!j->installer)
+        die("Allocation failed:");
+    if (!state.state_dir)
+        return j;
+
+    char *path = concat(state.state_dir, "/journal/", installer);
+    Fd fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (INVALID_FILE_DES == fd)
+        return j;
+    Buffer journal = read_all(fd);
+    close(fd);
+    da_append(&journal, '\0');
+    // Later lines replace earlier ones
+    size_t lines = 0;
+    for (char *line = journal.items; *line; lines += 1) {
+        char *end = strchrnul(line, '\n');
+        unsigned long long step, outputs;
+        char key[32];
+        if (2 == sscanf(line, "%llx %llx", &step, &outputs)) {
+            snprintf(key, sizeof(key), HASH_FMT, step);
+            _index_add(&j->index, key, outputs);
+            _index_get(&j->index, key)->value = outputs;
+        }
+        line = *end ? end + 1 : end;
+    }
+    msg(LL_Debug, "Loaded %zu journaled steps of %s", j->index.len, installer);
+
+    // Drops replaced lines once they make up most of the journal
+    if (state.dry || lines <= 2 * j->index.len + 64)
+        return j;
+    char *tmp = concat(path, ".tmp");
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    Buffer compact = zero(Buffer);
+    for (size_t i = 0; i < j->index.cap; i += 1) {
+        const _Index_Entry *e = &j->index.items[i];
+        if (!e->hash)
+            continue;
+        char line[64];
+        int len = snprintf(line, sizeof(line), "%s "HASH_FMT"\n",
+                           j->index.pool.items + e->key, HASH_ARG(e->value));
+        da_append_many(&compact, line, len);
+    }
+    if (INVALID_FILE_DES == fd || (ssize_t) compact.len != write(fd, compact.items, compact.len)
+            || -1 == rename(tmp, path)) {
+        msg(LL_Warn, "Failed to compact the journal of %s:", installer);
+        unlink(tmp);
+    }
+    if (INVALID_FILE_DES != fd)
+        close(fd);
+    if (compact.items)
+        _free(compact.items);
+    return j;
+}
+
+// Hashes the content of a file or of all files below a directory.
+static uint64_t _hash_input(uint64_t h, char *path)
+{
+    h = _hash_str(h, path);
+    struct stat st;
+    if (-1 == stat(path, &st))
+        return _hash_str(h, "<missing>");
+    if (!S_ISDIR(st.st_mode)) {
+        if (!_hash_file(&h, path))
+            h = _hash_str(h, "<unreadable>");
+        return h;
+    }
+    Tree_Node root;
+    if (!tree(path, FF_File | FF_Directory | FF_Symlink | FF_Hidden, PATH_MAX, &root))
+        return _hash_str(h, "<unreadable>");
+    // Children are sorted, so the order of the walk is stable
+    DA_STRUCT(Tree_Node*) stack = zero(typeof(stack));
+    da_append(&stack, &root);
+    while (stack.len > 0) {
+        Tree_Node *node = stack.items[--stack.len];
+        h = _hash_str(h, node->name);
+        if (TN_Leaf == node->kind && !_hash_file(&h, node->name))
+            h = _hash_str(h, "<unreadable>");
+        for (size_t i = TN_Node == node->kind ? node->children.len : 0; i > 0; i -= 1)
+            da_append(&stack, &node->children.items[i - 1]);
+    }
+    _free(stack.items);
+    return h;
+}
+
+// Hashes the metadata of all outputs, returns 0 if one of them is missing.
+static uint64_t _hash_outputs(Strings outputs)
+{
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < outputs.len; i += 1) {
+        struct stat st;
+        if (-1 == lstat(outputs.items[i], &st))
+            return 0;
+        h = _hash_str(h, outputs.items[i]);
+        h = _hash(h, &st.st_size, sizeof(st.st_size));
+        h = _hash(h, &st.st_mtim, sizeof(st.st_mtim));
+        h = _hash(h, &st.st_mode, sizeof(st.st_mode));
+    }
+    return h | 1;
+}
+
+Step step_begin(Strings keys, Strings inputs, Strings outputs)
+{
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < keys.len; i += 1)
+        h = _hash_str(_hash_str(h, keys.items[i]), "\x1f");
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)))
+        h = _hash_str(h, cwd);
+    for (size_t i = 0; i < sizeof(_journal_env) / sizeof(*_journal_env); i += 1) {
+        const char *v = getenv(_journal_env[i]);
+        h = _hash_str(_hash_str(h, _journal_env[i]), v ? v : "");
+    }
+    for (size_t i = 0; i < inputs.len; i += 1)
+        h = _hash_input(h, inputs.items[i]);
+    for (size_t i = 0; i < outputs.len; i += 1)
+        h = _hash_str(h, outputs.items[i]);
+
+    Step step = { .fingerprint = h, .outputs = outputs };
+    if (state.force)
+        return step;
+    char key[32];
+    snprintf(key, sizeof(key), HASH_FMT, HASH_ARG(h));
+    _Index_Entry *e = _index_get(&_journal()->index, key);
+    step.skip = e && e->value == _hash_outputs(outputs);
+    if (step.skip)
+        msg(LL_Info, "Skipping journaled step "HASH_FMT, HASH_ARG(h));
+    return step;
+}
+
+void step_end(Step step)
+{
+    if (step.skip || state.dry || !state.state_dir)
+        return;
+    const uint64_t outputs = _hash_outputs(step.outputs);
+    if (0 == outputs) {
+        msg(LL_Warn, "Step "HASH_FMT" is not journaled, an output is missing", HASH_ARG(step.fingerprint));
+        return;
+    }
+
+    _Journal *j = _journal();
+    char key[32];
+    snprintf(key, sizeof(key), HASH_FMT, HASH_ARG(step.fingerprint));
+    _index_add(&j->index, key, outputs);
+    _index_get(&j->index, key)->value = outputs;
+
+    char *dir = concat(state.state_dir, "/journal");
+    Fd fd = _mkdirs(dir, 0755)
+        ? open(concat(dir, "/", j->installer), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)
+        : INVALID_FILE_DES;
+    char line[64];
+    int len = snprintf(line, sizeof(line), HASH_FMT" "HASH_FMT"\n",
+                       HASH_ARG(step.fingerprint), HASH_ARG(outputs));
+    // A single append, so the journal stays intact if sys-setup is killed
+    if (INVALID_FILE_DES == fd || len != write(fd, line, len))
+        msg(LL_Warn, "Failed to write the journal of %s:", j->installer);
+    if (INVALID_FILE_DES != fd)
+        close(fd);
+}
+
+int cmd_execj(Cmd cmd, Strings inputs, Strings outputs)
+{
+    Step step = step_begin(cmd, inputs, outputs);
+    if (step.skip)
+        return 0;
+    int code = cmd_exec(cmd);
+    if (0 == code)
+        step_end(step);
+    return code;
+}
+
+Cmd sudo(Cmd cmd)
+{
+    da_insert_shift(&cmd, 0, "sudo");
+    return cmd;
+}
+
+Cmd make(Strings rules, char *in_dir)
+{
+    Cmd cmd = zero(Cmd);
+    da_append(&cmd, _arena_strdup("make"));
+    if (in_dir)
+        da_expand(&cmd, strs("-C", in_dir));
+    da_expand(&cmd, rules);
+    return cmd;
+}
+
+Cmd git_clone(char *repo, char *dest_dir, bool init_submodules)
+{
+    Cmd cmd = strs("git", "clone");
+    if (init_submodules)
+        da_expand(&cmd, strs("--recurse-submodules", "-j8"));
+    da_expand(&cmd, strs(repo, dest_dir));
+    return cmd;
+}
+
+Cmd git_checkout(char *repo_dir, char *target)
+{
+    return strs("git", "-C", repo_dir, "checkout", target);
+}
+
+Cmd git_clean(char *repo_dir)
+{
+    todo();
+}
+
+// :package :installation
+
+// Checks every directory in `path` with access(2), used if the index is wrong.
+static bool _exe_scan(const char *path, const char *name)
+{ // https://stackoverflow.com/questions/41230547/check-if-program-is-installed-in-c
+    char *buf = malloc(strlen(path) + strlen(name) + 3);
+    for(; *path; ++path) {
+        char *p = buf;
+        for(; *path && *path!=':'; ++path,++p) {
+            *p = *path;
+        }
+        if(p == buf)
+            *p++ = '.';
+        if(p[-1] != '/')
+            *p++ = '/';
+
+        strcpy(p, name);
+        if(0 == access(buf, X_OK)) {
+            _free(buf);
+            return true;
+        }
+        if(!*path)
+            break;
+    }
+    _free(buf);
+    return false;
+}
+
+static void _exe_index_free(_Exe_Index *exes)
+{
+    _index_free(&exes->index);
+    for (size_t i = 0; i < exes->dirs.len; i += 1)
+        _free(exes->dirs.items[i].name);
+    if (exes->dirs.items)
+        _free(exes->dirs.items);
+    if (exes->path)
+        _free(exes->path);
+    *exes = zero(_Exe_Index);
+}
+
+// Returns true if a directory of the index changed since it was read.
+static bool _exe_index_stale(const _Exe_Index *exes)
+{
+    for (size_t i = 0; i < exes->dirs.len; i += 1) {
+        struct stat st;
+        struct timespec mtime = { 0 };
+        if (0 == stat(exes->dirs.items[i].name, &st))
+            mtime = st.st_mtim;
+        if (mtime.tv_sec != exes->dirs.items[i].mtime.tv_sec
+                || mtime.tv_nsec != exes->dirs.items[i].mtime.tv_nsec)
+            return true;
+    }
+    return false;
+}
+
+// Reads every directory of `path` once, earlier directories take precedence.
+static void _exe_index_build(_Exe_Index *exes, const char *path)
+{
+    _exe_index_free(exes);
+    exes->path = strdup(path);
+    if (!exes->path)
+        die("Allocation failed:");
+
+    for (const char *start = path;; start += 1) {
+        const char *end = strchrnul(start, ':');
+        // An empty entry means the current directory
+        char *name = end == start ? strdup(".") : strndup(start, end - start);
+        if (!name)
+            die("Allocation failed:");
+        struct _Exe_Dir d = { .name = name };
+        struct stat st;
+        DIR *dir = 0 == stat(name, &st) ? opendir(name) : NULL;
+        if (dir) {
+            d.mtime = st.st_mtim;
+            struct dirent *ent;
+            while ((ent = readdir(dir))) {
+                if (DT_REG == ent->d_type || DT_LNK == ent->d_type || DT_UNKNOWN == ent->d_type)
+                    _index_add(&exes->index, ent->d_name, exes->dirs.len);
+            }
+            closedir(dir);
+        }
+        da_append(&exes->dirs, d);
+        if (!*end)
+            break;
+        start = end;
+    }
+    exes->loaded = true;
+    msg(LL_Debug, "Indexed %zu executables in %zu directories", exes->index.len, exes->dirs.len);
+}
+
+bool exe_exists(char *name)
+{
+    if (strchr(name, '/'))
+        return 0 == access(name, X_OK);
+
+    const char *path = getenv("PATH");
+    fail_if(!path, "Failed to get PATH");
+
+    _Exe_Index *exes = &state.exes;
+    if (!exes->loaded || 0 != strcmp(path, exes->path))
+        _exe_index_build(exes, path);
+
+    _Index_Entry *e = _index_get(&exes->index, name);
+    // Only misses check for new executables, so hits stay a single lookup
+    if (!e && !exes->checked) {
+        if (_exe_index_stale(exes)) {
+            _exe_index_build(exes, path);
+            e = _index_get(&exes->index, name);
+        }
+        exes->checked = true;
+    }
+    if (!e)
+        return false;
+
+    char exe[PATH_MAX];
+    snprintf(exe, sizeof(exe), "%s/%s", exes->dirs.items[e->value].name, name);
+    return 0 == access(exe, X_OK) || _exe_scan(path, name);
+}
+
+bool exes_exist(Strings names)
+{
+    Buffer missing = zero(Buffer);
+    for (size_t i = 0; i < names.len; i += 1) {
+        if (exe_exists(names.items[i]))
+            continue;
+        if (missing.len)
+            da_append_many(&missing, ", ", 2);
+        da_append_many(&missing, names.items[i], strlen(names.items[i]));
+    }
+    if (0 == missing.len)
+        return true;
+    da_append(&missing, '\0');
+    msg(LL_Warn, "Missing executables: %s", missing.items);
+    _free(missing.items);
+    return false;
+}
+
+static void _pkg_index_free(_Pkg_Index *pkgs)
+{
+    _index_free(&pkgs->index);
+    *pkgs = zero(_Pkg_Index);
+}
+
+// Returns the value following `%key%` in a desc file, it ends at the next
+// newline.
+static char *_pkg_desc_value(char *desc, const char *key)
+{
+    char *v = strstr(desc, key);
+    if (!v || (v != desc && '\n' != v[-1]) || '\n' != v[strlen(key)])
+        return NULL;
+    return v + strlen(key) + 1;
+}
+
+// (Re)builds the index of installed packages if `<pkg_db>/local` changed.
+static bool _pkg_index_load()
+{
+    _Pkg_Index *pkgs = &state.pkgs;
+    char local[PATH_MAX];
+    snprintf(local, sizeof(local), "%s/local", state.pkg_db);
+    struct stat st;
+    if (-1 == stat(local, &st)) {
+        msg(LL_Error, "Failed to open package database '%s':", local);
+        return false;
+    }
+    if (pkgs->loaded && pkgs->mtime.tv_sec == st.st_mtim.tv_sec
+            && pkgs->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return true;
+
+    _pkg_index_free(pkgs);
+    Fd dfd = open(local, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = INVALID_FILE_DES == dfd ? NULL : fdopendir(dfd);
+    if (!dir) {
+        msg(LL_Error, "Failed to open package database '%s':", local);
+        if (INVALID_FILE_DES != dfd)
+            close(dfd);
+        return false;
+    }
+
+    _Index *idx = &pkgs->index;
+    Buffer desc = zero(Buffer);
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if ('.' == ent->d_name[0])
+            continue;
+        char path[NAME_MAX + sizeof("/desc")];
+        snprintf(path, sizeof(path), "%s/desc", ent->d_name);
+        Fd fd = openat(dfd, path, O_RDONLY | O_CLOEXEC);
+        if (INVALID_FILE_DES == fd)
+            continue;
+        desc.len = 0;
+        char buf[16 * BUFFER_SIZE];
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0)
+            da_append_many(&desc, buf, r);
+        close(fd);
+        da_append(&desc, '\0');
+
+        char *name = _pkg_desc_value(desc.items, "%NAME%");
+        char *version = _pkg_desc_value(desc.items, "%VERSION%");
+        if (!name || !version) {
+            msg(LL_Warn, "Malformed package description: %s/%s", local, path);
+            continue;
+        }
+        *strchrnul(name, '\n') = '\0';
+        *strchrnul(version, '\n') = '\0';
+        const size_t off = idx->pool.len;
+        da_append_many(&idx->pool, version, strlen(version) + 1);
+        _index_add(idx, name, off);
+    }
+    closedir(dir);
+    if (desc.items)
+        _free(desc.items);
+
+    pkgs->mtime = st.st_mtim;
+    pkgs->loaded = true;
+    msg(LL_Debug, "Indexed %zu installed packages of %s", idx->len, local);
+    return true;
+}
+
+char *pkg_db(char *root)
+{
+    // The state owns its copy, `root` may live in a scope of the caller
+    char *prev = _arena_strdup(state.pkg_db);
+    _free(state.pkg_db);
+    state.pkg_db = strdup(root);
+    if (!state.pkg_db)
+        die("Allocation failed:");
+    _pkg_index_free(&state.pkgs);
+    return prev;
+}
+
+char *pkg_version(char *pkg)
+{
+    if (!_pkg_index_load())
+        return NULL;
+    _Index_Entry *e = _index_get(&state.pkgs.index, pkg);
+    return e ? state.pkgs.index.pool.items + e->value : NULL;
+}
+
+bool is_installed(char *pkg)
+{
+    return NULL != pkg_version(pkg);
+}
+
+// pacman runs one transaction at a time, so installers running in parallel
+// wait for each other on `<cache>/pacman.lock`. Returns the locked fd, which
+// is closed once the transaction finished.
+static Fd _pkg_lock()
+{
+    if (!state.cache_dir || (state.dry && !state.dry_allow_commands))
+        return INVALID_FILE_DES;
+    char *path = concat(state.cache_dir, "/pacman.lock");
+    Fd fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (INVALID_FILE_DES == fd) {
+        msg(LL_Warn, "Failed to open '%s':", path);
+        return fd;
+    }
+    if (-1 == flock(fd, LOCK_EX))
+        msg(LL_Warn, "Failed to lock '%s':", path);
+    return fd;
+}
+
+// The mtime of `<cache>/last-sync` is the time of the last successful sync.
+// It is locked while syncing, so concurrent installers sync only once.
+bool ensure_uptodate(Strings pkgs)
+{
+    ignore_param(pkgs); // pacman does not support partial upgrades
+    if (state.synced)
+        return true;
+
+    const bool dry = state.dry && !state.dry_allow_commands;
+    Fd fd = INVALID_FILE_DES;
+    if (state.cache_dir && !dry) {
+        char *stamp = concat(state.cache_dir, "/last-sync");
+        fd = open(stamp, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (INVALID_FILE_DES == fd)
+            msg(LL_Warn, "Failed to open '%s', syncing anyway:", stamp);
+    }
+    if (INVALID_FILE_DES != fd) {
+        if (-1 == flock(fd, LOCK_EX))
+            msg(LL_Warn, "Failed to lock the sync timestamp:");
+        struct stat st;
+        const time_t now = time(NULL);
+        // A new file is empty, while a synced one contains a marker
+        const bool stamped = 0 == fstat(fd, &st) && st.st_size > 0;
+        // Synced by another installer of this run, also with --refresh
+        const bool this_run = stamped && (st.st_mtim.tv_sec > state.started.tv_sec
+            || (st.st_mtim.tv_sec == state.started.tv_sec
+                && st.st_mtim.tv_nsec >= state.started.tv_nsec));
+        if (this_run || (!state.refresh && stamped
+                         && now - st.st_mtim.tv_sec < (time_t) state.sync_ttl)) {
+            msg(LL_Info, "Packages were synced %lds ago, skipping the sync",
+                (long) (now - st.st_mtim.tv_sec));
+            state.synced = true;
+            close(fd);
+            return true;
+        }
+    }
+
+    Cmd cmd = strs("sudo", "pacman", "-Syu");
+    Fd lock = _pkg_lock();
+    state.synced = 0 == cmd_exec(cmd);
+    if (INVALID_FILE_DES != lock)
+        close(lock);
+    if (INVALID_FILE_DES != fd) {
+        if (state.synced && (1 != pwrite(fd, "\n", 1, 0) || -1 == futimens(fd, NULL)))
+            msg(LL_Warn, "Failed to update the sync timestamp:");
+        close(fd);
+    }
+    return state.synced;
+}
+
+bool install_pkg(char *name)
+{
+    return install_pkgs(strs(name));
+}
+
+bool install_pkgs(Strings pkgs)
+{
+    Cmd cmd = strs("sudo", "pacman", "-S", "--needed");
+    const size_t base = cmd.len;
+    for (size_t i = 0; i < pkgs.len; i += 1) {
+        if (!is_installed(pkgs.items[i]))
+            da_append(&cmd, pkgs.items[i]);
+    }
+    if (cmd.len == base)
+        return true;
+    Fd lock = _pkg_lock();
+    const bool ok = 0 == cmd_exec(cmd);
+    if (INVALID_FILE_DES != lock)
+        close(lock);
+    return ok;
+}
+
+void queue_pkgs(Strings pkgs)
+{
+    _da_scoped(&state.queued_pkgs);
+    da_expand(&state.queued_pkgs, pkgs);
+}
+
+// Installs everything queued by the current phase in one transaction.
+static bool _flush_pkgs()
+{
+    if (0 == state.queued_pkgs.len)
+        return true;
+    bool ok = install_pkgs(state.queued_pkgs);
+    state.queued_pkgs = zero(Strings);
+    if (!ok)
+        msg(LL_Error, "Failed to install queued packages");
+    return ok;
+}
+
+// :compilation
+
+bool compile(char *file, char *out, Strings cflags, Strings lflags)
+{
+    _Span span = _span_begin("compile", "compile %s", file);
+    Cmd cmd = zero(Cmd);
+    da_append(&cmd, state.cc);
+    da_expand(&cmd, state.cflags);
+    if (cflags.len)
+        da_expand(&cmd, cflags);
+    da_expand(&cmd, strs(file, "-o", out));
+    if (lflags.len)
+        da_expand(&cmd, lflags);
+
+    Buffer err = zero(Buffer);
+    bool ok = !cmd_execw(cmd, NULL, NULL, &err);
+    if (!ok)
+        msg(LL_Error, "Compilation of '%s' failed:\n%.*s",
+            file, (int) err.len, err.items);
+
+    if (cmd.items)
+        _free(cmd.items);
+
+    _span_end(span, NULL);
+    return ok;
+}
+
+// Identifies the compiler by its resolved path, size and modification time,
+// this way an update of the compiler invalidates the cache without having to
+// spawn it.
+static uint64_t _hash_compiler(uint64_t h)
+{
+    h = _hash_str(h, state.cc);
+
+    char buf[PATH_MAX];
+    struct stat s;
+    bool found = false;
+    if (strchr(state.cc, '/')) {
+        found = 0 == stat(state.cc, &s);
+    } else if (getenv("PATH")) {
+        const char *path = getenv("PATH");
+        while (!found) {
+            const char *sep = strchrnul(path, ':');
+            int dir_len = sep - path;
+            int n = snprintf(buf, sizeof(buf), "%.*s/%s",
+                             dir_len ? dir_len : 1, dir_len ? path : ".", state.cc);
+            found = 0 < n && (size_t) n < sizeof(buf) && 0 == stat(buf, &s);
+            if (found)
+                h = _hash_str(h, buf);
+            if (!*sep)
+                break;
+            path = sep + 1;
+        }
+    }
+
+    if (found) {
+        h = _hash(h, &s.st_size, sizeof(s.st_size));
+        h = _hash(h, &s.st_mtim, sizeof(s.st_mtim));
+    }
+    return h;
+}
+
+// Splits a depfile written with -MD into its dependencies, targets are
+// skipped. Everything is allocated in the current scope.
+static Strings _deps_parse(Buffer deps)
+{
+    Strings res = zero(Strings);
+    _da_scoped(&res);
+    Buffer dep = zero(Buffer);
+    for (size_t i = 0; i <= deps.len; i += 1) {
+        char c = i < deps.len ? deps.items[i] : '\n';
+        if ('\\' == c && i + 1 < deps.len) {
+            char next = deps.items[i + 1];
+            i += 1;
+            if (' ' == next)
+                da_append(&dep, ' ');
+            // otherwise a line continuation
+            continue;
+        }
+        if (' ' != c && '\n' != c && '\t' != c) {
+            da_append(&dep, c);
+            continue;
+        }
+        if (0 == dep.len)
+            continue;
+        // targets end with ':'
+        if (':' != dep.items[dep.len - 1]) {
+            da_append(&dep, '\0');
+            da_append(&res, _arena_strdup(dep.items));
+        }
+        dep.len = 0;
+    }
+    if (dep.items)
+        _free(dep.items);
+    return res;
+}
+
+// Hashes every prerequisite listed in the make-style dependency files
+// concatenated in `deps`. Returns false if any of them can not be read.
+static bool _hash_deps(uint64_t *h, Buffer deps)
+{
+    const size_t scope = scope_push();
+    Strings paths = _deps_parse(deps);
+    bool ok = true;
+    for (size_t i = 0; i < paths.len && ok; i += 1) {
+        *h = _hash_str(*h, paths.items[i]);
+        ok = _hash_file(h, paths.items[i]);
+        if (!ok)
+            msg(LL_Debug, "Dependency '%s' is unavailable", paths.items[i]);
+    }
+    scope_pop(scope);
+    return ok;
+}
+
+// Copies the file and replaces `to` atomically, so a shared object that is
+// currently loaded is never modified in place.
+static bool _replace_file(char *from, char *to)
+{
+    char *tmp;
+    if (-1 == asprintf(&tmp, "%s.%d.tmp", to, getpid()))
+        die("Allocation failed:");
+    bool ok = cp(from, tmp);
+    if (ok && -1 == rename(tmp, to)) {
+        msg(LL_Error, "Failed to move '%s' to '%s':", tmp, to);
+        ok = false;
+    }
+    if (!ok)
+        unlink(tmp);
+    _free(tmp);
+    return ok;
+}
+
+// Returns where the object (`ext` ".o") or the depfile (".d") of `cfile` is
+// written: in the cache keyed by the path of `cfile`, so the directories of
+// the sources stay clean. Allocated in the current scope.
+static char *_compile_output(const char *cfile, const char *ext)
+{
+    if (!state.cache_dir)
+        return concat(cfile, ext);
+    char path[PATH_MAX];
+    _path_normalize(cfile, path);
+    char name[32];
+    snprintf(name, sizeof(name), "/"HASH_FMT, HASH_ARG(_hash_str(FNV_OFFSET, path)));
+    return concat(state.cache_dir, "/objs", name, ext);
+}
+
+static bool _compile_so(Strings cfiles, char *so, Strings cflags, Strings lflags)
+{
+    bool ok = true;
+
+    // The build cache works in two steps:
+    // 1. The compiler, all flags and the sources result in the `base` hash.
+    //    `<base>.d` stores the dependency files of the last build for it.
+    // 2. All dependencies (including headers) listed in `<base>.d` are hashed
+    //    into `key`. `<key>.so` is the resulting shared object.
+    uint64_t base = _hash_compiler(FNV_OFFSET);
+    for (size_t i = 0; i < state.cflags.len; i += 1)
+        base = _hash_str(base, state.cflags.items[i]);
+    for (size_t i = 0; i < cflags.len; i += 1)
+        base = _hash_str(base, cflags.items[i] ? cflags.items[i] : "");
+    base = _hash_str(base, "--");
+    for (size_t i = 0; i < lflags.len; i += 1)
+        base = _hash_str(base, lflags.items[i] ? lflags.items[i] : "");
+    for (size_t i = 0; i < cfiles.len; i += 1) {
+        base = _hash_str(base, cfiles.items[i]);
+        fail_if(!_hash_file(&base, cfiles.items[i]),
+                "Failed to read file %s:", cfiles.items[i]);
+    }
+
+    char *manifest = NULL;
+    if (state.cache_dir) {
+        if (-1 == asprintf(&manifest, "%s/"HASH_FMT".d", state.cache_dir, HASH_ARG(base)))
+            die("Allocation failed:");
+        register_ptr(manifest);
+
+        Fd fd = open(manifest, O_RDONLY);
+        if (INVALID_FILE_DES != fd) {
+            Buffer deps = read_all(fd);
+            close(fd);
+            uint64_t key = base;
+            if (deps.items && _hash_deps(&key, deps)) {
+                char *cached;
+                if (-1 == asprintf(&cached, "%s/"HASH_FMT".so", state.cache_dir, HASH_ARG(key)))
+                    die("Allocation failed:");
+                register_ptr(cached);
+                if (exists(cached, FF_File) && _replace_file(cached, so)) {
+                    msg(LL_Debug, "%s is up to date (cached)", so);
+                    return true;
+                }
+            }
+        }
+    }
+
+    Strings objs = zero(Strings);
+    Strings depfiles = zero(Strings);
+    if (state.cache_dir && !_mkdirs(concat(state.cache_dir, "/objs"), 0755)) {
+        msg(LL_Error, "Failed to create '%s/objs':", state.cache_dir);
+        return false;
+    }
+    for (size_t i = 0; i < cfiles.len; i += 1) {
+        char *obj = _compile_output(cfiles.items[i], ".o");
+        da_append(&objs, obj);
+        char *dep = _compile_output(cfiles.items[i], ".d");
+        da_append(&depfiles, dep);
+
+        // TODO: also use passed cflags and lflags
+        ok = compile(cfiles.items[i], obj, strs("-c", "-fPIC", "-MD", "-MF", dep),
+                     zero(Strings));
+        if (!ok)
+            goto exit;
+    }
+
+    Cmd cmd = zero(Cmd);
+    da_append(&cmd, state.cc);
+    da_expand(&cmd, state.cflags);
+    if (cflags.len)
+        da_expand(&cmd, cflags);
+    da_expand(&cmd, strs("-shared", "-o", so));
+    da_expand(&cmd, objs);
+    if (lflags.len)
+        da_expand(&cmd, lflags);
+
+    Buffer err = zero(Buffer);
+    ok = !cmd_execw(cmd, NULL, NULL, &err);
+    if (!ok) {
+        msg(LL_Error, "Compilation of '%s' failed:\n%.*s", so, (int) err.len, err.items);
+        goto exit;
+    }
+
+    if (manifest && !state.dry) {
+        Buffer deps = zero(Buffer);
+        for (size_t i = 0; i < depfiles.len; i += 1) {
+            Fd fd = open(depfiles.items[i], O_RDONLY);
+            if (INVALID_FILE_DES == fd)
+                goto exit; // Nothing to cache
+            Buffer dep = read_all(fd);
+            close(fd);
+            if (!dep.items)
+                goto exit;
+            da_append_many(&deps, dep.items, dep.len);
+            da_append(&deps, '\n');
+        }
+
+        uint64_t key = base;
+        if (!_hash_deps(&key, deps)) {
+            _free(deps.items);
+            goto exit;
+        }
+        char *cached;
+        if (-1 == asprintf(&cached, "%s/"HASH_FMT".so", state.cache_dir, HASH_ARG(key)))
+            die("Allocation failed:");
+        register_ptr(cached);
+
+        // The manifest is written last, it is only used once the object exists
+        Fd fd = INVALID_FILE_DES;
+        char *tmp = concat(manifest, ".tmp");
+        if (_replace_file(so, cached)
+                && INVALID_FILE_DES != (fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644))
+                && write_all(fd, deps)) {
+            if (-1 == rename(tmp, manifest))
+                msg(LL_Warn, "Failed to update build cache '%s':", manifest);
+        } else {
+            msg(LL_Warn, "Failed to store %s in the build cache", so);
+        }
+        if (INVALID_FILE_DES != fd)
+            close(fd);
+        _free(deps.items);
+    }
+
+exit:
+    if (objs.items)
+        register_ptr(objs.items);
+    if (depfiles.items)
+        register_ptr(depfiles.items);
+    return ok;
+}
+
+bool compile_so(Strings cfiles, char *so, Strings cflags, Strings lflags)
+{
+    _Span span = _span_begin("compile", "compile_so %s", so);
+    bool ok = _compile_so(cfiles, so, cflags, lflags);
+    _span_end(span, NULL);
+    return ok;
+}
+
+// :net :http
+
+#define HTTP_MAX_REDIRECTS 5
+// Interrupted transfers are resumed this often using a Range request
+#define HTTP_RETRIES 3
+#define HTTP_TIMEOUT_MS (30 * 1000)
+#define HTTP_HEADER_MAX (64 * BUFFER_SIZE)
+
+typedef enum {
+    _HS_Connect,
+    _HS_Send,
+    _HS_Header,
+    // Identity body, until `remaining` is 0 or the connection is closed
+    _HS_Body,
+    _HS_Chunk_Size,
+    _HS_Chunk_Data,
+    // CRLF after the data of a chunk
+    _HS_Chunk_End,
+    _HS_Trailer,
+    _HS_Done,
+    _HS_Failed,
+} _Http_State;
+
+// A single request, that is driven by _http_run. The body of the response is
+// streamed to `out` and/or `buf`.
+typedef struct {
+    const char *method;
+    // Replaced when redirected, allocated in the arena
+    char *url;
+    Buffer body;
+
+    Fd out;
+    Buffer *buf;
+    // Bytes of the body that are already present, requested using Range
+    size_t offset;
+    // Running hash of the whole body, including the first `offset` bytes
+    uint64_t hash;
+    // Strong ETag or Last-Modified of the body in the sinks, sent as If-Range
+    // when resuming. Empty if unknown, then resuming starts over.
+    char validator[256];
+    // Keeps the validator next to a partial download, NULL if not needed
+    char *validator_file;
+    // Validator of a copy the caller already has, sent as If-None-Match or
+    // If-Modified-Since. Empty if there is none.
+    char known[256];
+    // The server answered with 304 to `known`, nothing was received
+    bool not_modified;
+
+    Fd sock;
+    _Http_State st;
+    Buffer req;
+    size_t sent;
+    Buffer head;
+    // Incomplete chunk size or trailer line
+    Buffer line;
+    int status;
+    // -1 if the body ends with the connection
+    ssize_t remaining;
+    size_t redirects;
+    // Body bytes received by the current attempt
+    size_t received;
+    // The connection broke, retrying might succeed
+    bool retry;
+    // The transfer was redirected to a scheme only curl can handle
+    bool curl;
+} _Http;
+
+typedef struct {
+    char host[256];
+    char port[8];
+    const char *path;
+} _Url;
+
+static bool _url_parse(const char *url, _Url *u)
+{
+    if (0 != strncmp(url, "http://", 7))
+        return false;
+    const char *host = url + 7;
+    const char *path = strchrnul(host, '/');
+    const char *port = NULL;
+    const char *host_end = path;
+    if ('[' == *host) {
+        const char *close = memchr(host, ']', path - host);
+        if (!close)
+            return false;
+        host += 1;
+        host_end = close;
+        if (':' == close[1])
+            port = close + 2;
+    } else {
+        port = memchr(host, ':', path - host);
+        if (port)
+            host_end = port++;
+    }
+    if (host_end == host || (size_t) (host_end - host) >= sizeof(u->host)
+            || (port && (path == port || (size_t) (path - port) >= sizeof(u->port))))
+        return false;
+    memcpy(u->host, host, host_end - host);
+    u->host[host_end - host] = '\0';
+    if (port) {
+        memcpy(u->port, port, path - port);
+        u->port[path - port] = '\0';
+    } else {
+        strcpy(u->port, "80");
+    }
+    u->path = *path ? path : "/";
+    return true;
+}
+
+static void _http_fail(_Http *h, bool retry)
+{
+    if (INVALID_FILE_DES != h->sock)
+        close(h->sock);
+    h->sock = INVALID_FILE_DES;
+    h->st = _HS_Failed;
+    h->retry = retry;
+}
+
+// Drops everything that was written to the sinks of h.
+static bool _http_restart_body(_Http *h)
+{
+    h->offset = 0;
+    h->hash = FNV_OFFSET;
+    if (h->buf)
+        h->buf->len = 0;
+    if (INVALID_FILE_DES != h->out && (-1 == ftruncate(h->out, 0) || -1 == lseek(h->out, 0, SEEK_SET))) {
+        msg(LL_Error, "Failed to truncate download of %s:", h->url);
+        return false;
+    }
+    return true;
+}
+
+// The header sending `known` back to the server, see _Http.known
+static const char *_http_condition(const char *known)
+{
+    // Only strong ETags are kept, they are quoted unlike dates
+    return '"' == *known ? "If-None-Match" : "If-Modified-Since";
+}
+
+// Connects to the host of h->url and prepares the request.
+static void _http_start(_Http *h)
+{
+    h->sock = INVALID_FILE_DES;
+    h->req.len = h->sent = h->head.len = h->line.len = 0;
+    h->status = 0;
+    h->received = 0;
+    h->retry = false;
+
+    _Url u;
+    if (!_url_parse(h->url, &u)) {
+        h->curl = 0 == strncmp(h->url, "https://", 8);
+        if (!h->curl)
+            msg(LL_Error, "Unsupported url: %s", h->url);
+        _http_fail(h, false);
+        return;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addrs;
+    int error = getaddrinfo(u.host, u.port, &hints, &addrs);
+    if (0 != error) {
+        msg(LL_Error, "Failed to resolve %s: %s", u.host, gai_strerror(error));
+        _http_fail(h, true);
+        return;
+    }
+    h->sock = socket(addrs->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (INVALID_FILE_DES == h->sock || (-1 == connect(h->sock, addrs->ai_addr, addrs->ai_addrlen)
+                                        && EINPROGRESS != errno)) {
+        msg(LL_Error, "Failed to connect to %s:", h->url);
+        freeaddrinfo(addrs);
+        _http_fail(h, true);
+        return;
+    }
+    freeaddrinfo(addrs);
+
+    char line[PATH_MAX + 64];
+    // IPv6 literals are bracketed, just like in the url
+    const bool ipv6 = strchr(u.host, ':');
+    int len = snprintf(line, sizeof(line), "%s %s HTTP/1.1\r\nHost: %s%s%s:%s\r\n",
+                       h->method, u.path, ipv6 ? "[" : "", u.host, ipv6 ? "]" : "", u.port);
+    da_append_many(&h->req, line, len);
+    static const char common[] =
+        "User-Agent: sys-setup\r\nAccept-Encoding: identity\r\nConnection: close\r\n";
+    da_append_many(&h->req, common, sizeof(common) - 1);
+    // Without a validator the partial body might belong to another version
+    if (h->offset && !*h->validator && !_http_restart_body(h)) {
+        _http_fail(h, false);
+        return;
+    }
+    if (h->offset) {
+        len = snprintf(line, sizeof(line), "Range: bytes=%zu-\r\nIf-Range: %s\r\n",
+                       h->offset, h->validator);
+        da_append_many(&h->req, line, len);
+    }
+    if (*h->known) {
+        len = snprintf(line, sizeof(line), "%s: %s\r\n", _http_condition(h->known), h->known);
+        da_append_many(&h->req, line, len);
+    }
+    if (h->body.items) {
+        len = snprintf(line, sizeof(line), "Content-Length: %zu\r\n", h->body.len);
+        da_append_many(&h->req, line, len);
+    }
+    da_append_many(&h->req, "\r\n", 2);
+    if (h->body.items)
+        da_append_many(&h->req, h->body.items, h->body.len);
+    h->st = _HS_Connect;
+}
+
+static bool _http_emit(_Http *h, const char *data, size_t len)
+{
+    h->hash = _hash(h->hash, data, len);
+    h->received += len;
+    if (h->buf)
+        da_append_many(h->buf, data, len);
+    for (size_t written = 0; INVALID_FILE_DES != h->out && written < len;) {
+        ssize_t w = write(h->out, data + written, len - written);
+        if (-1 == w) {
+            msg(LL_Error, "Failed to write download of %s:", h->url);
+            return false;
+        }
+        written += w;
+    }
+    return true;
+}
+
+// Returns the value of the header `name` in h->head, terminated by '\r'.
+static const char *_http_header(const _Http *h, const char *name)
+{
+    const size_t len = strlen(name);
+    for (const char *l = strstr(h->head.items, "\r\n"); l && l[2] != '\r'; l = strstr(l + 2, "\r\n")) {
+        if (0 == strncasecmp(l + 2, name, len) && ':' == l[2 + len]) {
+            const char *v = l + 3 + len;
+            while (' ' == *v || '\t' == *v)
+                v += 1;
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// Takes the validator of a complete response, weak ETags can not be used
+// for If-Range.
+static void _http_validator(_Http *h)
+{
+    const char *etag = _http_header(h, "ETag");
+    const char *modified = _http_header(h, "Last-Modified");
+    const char *v = etag && 0 != strncmp(etag, "W/", 2) ? etag : modified;
+    size_t len = v ? strcspn(v, "\r") : 0;
+    if (len >= sizeof(h->validator))
+        len = 0;
+    if (len)
+        memcpy(h->validator, v, len);
+    h->validator[len] = '\0';
+    if (!h->validator_file)
+        return;
+    if (!*h->validator) {
+        unlink(h->validator_file);
+        return;
+    }
+    Fd fd = open(h->validator_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (INVALID_FILE_DES == fd || (ssize_t) len != write(fd, h->validator, len))
+        msg(LL_Warn, "Failed to store the validator of %s:", h->url);
+    if (INVALID_FILE_DES != fd)
+        close(fd);
+}
+
+// Takes the status and validator of the last response, that curl dumped to
+// `file`. The ones before it were redirects.
+static void _http_curl_head(_Http *h, const char *file)
+{
+    Fd fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (INVALID_FILE_DES == fd)
+        return;
+    Buffer head = read_all(fd);
+    close(fd);
+    unlink(file);
+    da_append(&head, '\0');
+    const char *last = head.items;
+    for (const char *l = last; (l = strstr(l, "\r\nHTTP/")); l += 2)
+        last = l + 2;
+    h->head.len = 0;
+    da_append_many(&h->head, last, strlen(last) + 1);
+    if (1 != sscanf(h->head.items, "HTTP/%*s %d", &h->status))
+        return;
+    h->not_modified = 304 == h->status && *h->known;
+    if (!h->not_modified)
+        _http_validator(h);
+}
+
+// Parses the status line and headers in h->head, which ends with CRLF CRLF.
+static void _http_headers(_Http *h)
+{
+    da_append(&h->head, '\0');
+    if (1 != sscanf(h->head.items, "HTTP/1.%*d %d", &h->status)) {
+        msg(LL_Error, "Malformed response from %s", h->url);
+        _http_fail(h, false);
+        return;
+    }
+
+    if (304 == h->status && *h->known) {
+        h->not_modified = true;
+        h->st = _HS_Done;
+        return;
+    }
+
+    const char *location = _http_header(h, "Location");
+    if (h->status >= 300 && h->status < 400 && location) {
+        if (h->redirects++ >= HTTP_MAX_REDIRECTS) {
+            msg(LL_Error, "Too many redirects: %s", h->url);
+            _http_fail(h, false);
+            return;
+        }
+        const size_t len = strcspn(location, "\r");
+        char *url;
+        if ('/' == *location) {
+            // Relative to the current origin
+            const char *origin = strchrnul(strstr(h->url, "//") + 2, '/');
+            url = arena_alloc(origin - h->url + len + 1);
+            memcpy(url, h->url, origin - h->url);
+            memcpy(url + (origin - h->url), location, len);
+            url[origin - h->url + len] = '\0';
+        } else {
+            url = arena_alloc(len + 1);
+            memcpy(url, location, len);
+            url[len] = '\0';
+        }
+        msg(LL_Debug, "Redirected: %s -> %s", h->url, url);
+        h->url = url;
+        close(h->sock);
+        _http_start(h);
+        return;
+    }
+
+    if (206 == h->status) {
+        size_t start;
+        const char *range = _http_header(h, "Content-Range");
+        const char *etag = _http_header(h, "ETag");
+        const bool changed = etag && '"' == *h->validator
+            && (strcspn(etag, "\r") != strlen(h->validator)
+                || 0 != strncmp(etag, h->validator, strlen(h->validator)));
+        if (!range || 1 != sscanf(range, "bytes %zu-", &start) || start != h->offset || changed) {
+            msg(LL_Error, "Unexpected range in response from %s", h->url);
+            _http_restart_body(h);
+            _http_fail(h, true);
+            return;
+        }
+    } else if (h->status >= 200 && h->status < 300) {
+        // The whole body is sent, also if If-Range did not match
+        if (h->offset && !_http_restart_body(h)) {
+            _http_fail(h, false);
+            return;
+        }
+        _http_validator(h);
+    } else {
+        msg(LL_Error, "%s %s: HTTP %d", h->method, h->url, h->status);
+        // Starts over if the range was not satisfiable
+        if (416 == h->status && _http_restart_body(h))
+            _http_fail(h, true);
+        else
+            _http_fail(h, false);
+        return;
+    }
+
+    const char *te = _http_header(h, "Transfer-Encoding");
+    const char *cl = _http_header(h, "Content-Length");
+    if (te && strcasestr(te, "chunked")) {
+        h->st = _HS_Chunk_Size;
+    } else if (cl) {
+        h->remaining = strtoll(cl, NULL, 10);
+        h->st = 0 == h->remaining ? _HS_Done : _HS_Body;
+    } else if (204 == h->status) {
+        h->st = _HS_Done;
+    } else {
+        h->remaining = -1;
+        h->st = _HS_Body;
+    }
+}
+
+// Appends data to h->line up to a newline, returns the number of consumed
+// bytes. h->line is complete if it ends with '\n'.
+static size_t _http_line(_Http *h, const char *data, size_t len)
+{
+    const char *nl = memchr(data, '\n', len);
+    const size_t n = nl ? (size_t) (nl - data) + 1 : len;
+    da_append_many(&h->line, data, n);
+    if (h->line.len > HTTP_HEADER_MAX) {
+        msg(LL_Error, "Malformed chunk in response from %s", h->url);
+        _http_fail(h, false);
+    }
+    return n;
+}
+
+// Consumes received bytes depending on the state of h.
+static void _http_feed(_Http *h, const char *data, size_t len)
+{
+    while (len > 0) {
+        size_t n = len;
+        switch (h->st) {
+        case _HS_Header: {
+            // The end of the headers may be split between reads
+            const size_t before = h->head.len >= 3 ? h->head.len - 3 : 0;
+            da_append_many(&h->head, data, len);
+            char *end = memmem(h->head.items + before, h->head.len - before, "\r\n\r\n", 4);
+            if (!end) {
+                if (h->head.len > HTTP_HEADER_MAX) {
+                    msg(LL_Error, "Headers of %s are too large", h->url);
+                    _http_fail(h, false);
+                }
+                return;
+            }
+            n = len - (h->head.len - (end + 4 - h->head.items));
+            h->head.len = end + 4 - h->head.items;
+            _http_headers(h);
+            break;
+        }
+
+        case _HS_Body:
+        case _HS_Chunk_Data:
+            if (h->remaining >= 0 && (size_t) h->remaining < n)
+                n = h->remaining;
+            if (!_http_emit(h, data, n)) {
+                _http_fail(h, false);
+                return;
+            }
+            if (h->remaining >= 0)
+                h->remaining -= n;
+            if (0 == h->remaining)
+                h->st = _HS_Body == h->st ? _HS_Done : _HS_Chunk_End;
+            break;
+
+        case _HS_Chunk_Size:
+        case _HS_Chunk_End:
+        case _HS_Trailer:
+            n = _http_line(h, data, len);
+            if (_HS_Failed == h->st || '\n' != h->line.items[h->line.len - 1])
+                break;
+            if (_HS_Chunk_End == h->st) {
+                h->st = _HS_Chunk_Size;
+            } else if (_HS_Trailer == h->st) {
+                if (h->line.len <= 2)
+                    h->st = _HS_Done;
+            } else {
+                char *end;
+                h->remaining = strtoll(h->line.items, &end, 16);
+                if (end == h->line.items || h->remaining < 0) {
+                    msg(LL_Error, "Malformed chunk in response from %s", h->url);
+                    _http_fail(h, false);
+                    return;
+                }
+                h->st = 0 == h->remaining ? _HS_Trailer : _HS_Chunk_Data;
+            }
+            h->line.len = 0;
+            break;
+
+        default:
+            // Everything after the response is ignored
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void _http_event(_Http *h)
+{
+    if (_HS_Connect == h->st) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (-1 == getsockopt(h->sock, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+            errno = error;
+            msg(LL_Error, "Failed to connect to %s:", h->url);
+            _http_fail(h, true);
+            return;
+        }
+        h->st = _HS_Send;
+    }
+    if (_HS_Send == h->st) {
+        ssize_t w = send(h->sock, h->req.items + h->sent, h->req.len - h->sent, MSG_NOSIGNAL);
+        if (-1 == w && EAGAIN != errno) {
+            msg(LL_Error, "Failed to send request to %s:", h->url);
+            _http_fail(h, true);
+            return;
+        }
+        h->sent += w > 0 ? w : 0;
+        if (h->sent == h->req.len)
+            h->st = _HS_Header;
+        return;
+    }
+
+    char buf[COPY_CHUNK_SIZE];
+    ssize_t r = recv(h->sock, buf, sizeof(buf), 0);
+    if (-1 == r) {
+        if (EAGAIN == errno || EINTR == errno)
+            return;
+        msg(LL_Error, "Failed to receive from %s:", h->url);
+        _http_fail(h, true);
+    } else if (0 == r) {
+        if (_HS_Body == h->st && -1 == h->remaining) {
+            h->st = _HS_Done;
+        } else {
+            msg(LL_Warn, "Connection to %s closed early", h->url);
+            _http_fail(h, true);
+        }
+    } else {
+        _http_feed(h, buf, r);
+    }
+    if (_HS_Done == h->st) {
+        close(h->sock);
+        h->sock = INVALID_FILE_DES;
+    }
+}
+
+// Drives all started requests until each of them is done or failed.
+static void _http_run(_Http *hs, size_t n)
+{
+    struct pollfd *pfds = calloc(n ? n : 1, sizeof(*pfds));
+    size_t *owners = calloc(n ? n : 1, sizeof(*owners));
+    if (!pfds || !owners)
+        die("Allocation failed:");
+    while (true) {
+        size_t npfds = 0;
+        for (size_t i = 0; i < n; i += 1) {
+            if (_HS_Done == hs[i].st || _HS_Failed == hs[i].st)
+                continue;
+            const bool out = _HS_Connect == hs[i].st || _HS_Send == hs[i].st;
+            pfds[npfds] = (struct pollfd) { .fd = hs[i].sock, .events = out ? POLLOUT : POLLIN };
+            owners[npfds++] = i;
+        }
+        if (0 == npfds)
+            break;
+
+        int ready = poll(pfds, npfds, HTTP_TIMEOUT_MS);
+        if (-1 == ready && EINTR != errno)
+            die("Poll failed:");
+        if (0 == ready) {
+            for (size_t i = 0; i < npfds; i += 1) {
+                msg(LL_Error, "Timed out: %s", hs[owners[i]].url);
+                _http_fail(&hs[owners[i]], true);
+            }
+        }
+        for (size_t i = 0; ready > 0 && i < npfds; i += 1) {
+            if (pfds[i].revents)
+                _http_event(&hs[owners[i]]);
+        }
+    }
+    _free(owners);
+    _free(pfds);
+}
+
+static _Http _http_new(const char *method, char *url)
+{
+    return (_Http) {
+        .method = method,
+        .url = url,
+        .out = INVALID_FILE_DES,
+        .hash = FNV_OFFSET,
+        .sock = INVALID_FILE_DES,
+        .st = _HS_Failed,
+    };
+}
+
+static void _http_free(_Http *h)
+{
+    if (h->req.items)
+        _free(h->req.items);
+    if (h->head.items)
+        _free(h->head.items);
+    if (h->line.items)
+        _free(h->line.items);
+}
+
+// Starts and runs all requests, interrupted GET requests are resumed with
+// the remaining range. Returns the number of failed requests.
+static size_t _http_transfer(_Http *hs, size_t n)
+{
+    for (size_t i = 0; i < n; i += 1)
+        _http_start(&hs[i]);
+    _http_run(hs, n);
+    for (size_t attempt = 0; attempt < HTTP_RETRIES; attempt += 1) {
+        size_t again = 0;
+        for (size_t i = 0; i < n; i += 1) {
+            _Http *h = &hs[i];
+            if (_HS_Failed != h->st || !h->retry || 0 != strcmp(h->method, "GET"))
+                continue;
+            h->offset += h->received;
+            msg(LL_Info, "Resuming %s at %zu bytes", h->url, h->offset);
+            _http_start(h);
+            again += 1;
+        }
+        if (0 == again)
+            break;
+        _http_run(hs, n);
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < n; i += 1)
+        failures += _HS_Done != hs[i].st;
+    return failures;
+}
+
+static Cmd _curl(char *url)
+{
+    return strs("curl", "--fail", "--silent", "--show-error", "--location",
+                "--retry", "3", url);
+}
+
+// Returns `<cache>/downloads/<hash><ext>` or NULL if there is no cache.
+static char *_dwnld_cache_file(uint64_t hash, const char *ext)
+{
+    if (!state.cache_dir)
+        return NULL;
+    char name[32];
+    snprintf(name, sizeof(name), "/"HASH_FMT, HASH_ARG(hash));
+    return concat(state.cache_dir, "/downloads", name, ext);
+}
+
+// Looks up a previous download of `url`. Returns the file with its content
+// and sets `validator` to the one of its response, or returns NULL.
+static char *_dwnld_cached(char *url, char validator[256])
+{
+    *validator = '\0';
+    char *index = _dwnld_cache_file(_hash_str(FNV_OFFSET, url), ".url");
+    if (!index)
+        return NULL;
+    Fd fd = open(index, O_RDONLY | O_CLOEXEC);
+    if (INVALID_FILE_DES == fd)
+        return NULL;
+    // The hash and the validator, each on its own line
+    char buf[32 + 256] = { 0 };
+    ssize_t r = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    unsigned long long content;
+    if (r <= 0 || 1 != sscanf(buf, "%llx", &content))
+        return NULL;
+    char *blob = _dwnld_cache_file(content, ".blob");
+    if (!exists(blob, FF_File))
+        return NULL;
+    const char *v = strchr(buf, '\n');
+    if (v) {
+        v += 1;
+        const size_t len = strcspn(v, "\n");
+        memcpy(validator, v, len);
+        validator[len] = '\0';
+    }
+    return blob;
+}
+
+// Stores `path` as the content of `url`, it is addressed by its hash.
+// `validator` is sent along when downloading `url` again.
+static void _dwnld_store(char *url, char *path, uint64_t content, const char *validator)
+{
+    char *blob = _dwnld_cache_file(content, ".blob");
+    if (!blob || !_mkdirs(concat(state.cache_dir, "/downloads"), 0755))
+        return;
+    if (!exists(blob, FF_File) && !_replace_file(path, blob))
+        return;
+
+    char *index = _dwnld_cache_file(_hash_str(FNV_OFFSET, url), ".url");
+    char *tmp = concat(index, ".tmp");
+    Fd fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (INVALID_FILE_DES == fd)
+        return;
+    bool ok = 0 < dprintf(fd, HASH_FMT"\n%s\n", HASH_ARG(content), validator);
+    close(fd);
+    if (!ok || -1 == rename(tmp, index)) {
+        msg(LL_Warn, "Failed to cache download of %s:", url);
+        unlink(tmp);
+    }
+}
+
+size_t dwnld_many(char **urls, char **paths, size_t n)
+{
+    if (state.dry) {
+        for (size_t i = 0; i < n; i += 1)
+            msg(LL_Info, "Downloading '%s' -> '%s'", urls[i], paths[i]);
+        return 0;
+    }
+
+    size_t failures = 0;
+    _Http *hs = calloc(n ? n : 1, sizeof(*hs));
+    size_t *idxs = calloc(n ? n : 1, sizeof(*idxs));
+    // Cached content of the active downloads, NULL if there is none
+    char **blobs = calloc(n ? n : 1, sizeof(*blobs));
+    if (!hs || !idxs || !blobs)
+        die("Allocation failed:");
+    size_t active = 0;
+    for (size_t i = 0; i < n; i += 1) {
+        // Partial downloads of earlier runs are resumed, if the validator of
+        // their response was stored
+        char *part = concat(paths[i], ".part");
+        _track_write(paths[i]);
+        _track_write(part);
+        _track_write(concat(part, ".validator"));
+        _track_write(concat(part, ".headers"));
+        Fd fd = open(part, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (INVALID_FILE_DES == fd) {
+            msg(LL_Error, "Failed to open '%s':", part);
+            failures += 1;
+            continue;
+        }
+        _Http *h = &hs[active];
+        *h = _http_new("GET", urls[i]);
+        h->out = fd;
+        blobs[active] = _dwnld_cached(urls[i], h->known);
+        h->validator_file = concat(part, ".validator");
+        Fd vfd = open(h->validator_file, O_RDONLY | O_CLOEXEC);
+        if (INVALID_FILE_DES != vfd) {
+            ssize_t r = read(vfd, h->validator, sizeof(h->validator) - 1);
+            h->validator[r > 0 ? r : 0] = '\0';
+            close(vfd);
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size > 0 && _hash_file(&h->hash, part))
+            h->offset = size;
+        else if (size > 0)
+            _http_restart_body(h);
+        idxs[active++] = i;
+    }
+
+    _http_transfer(hs, active);
+
+    // https is left to curl, which runs concurrently as well
+    Cmd *curls = calloc(active ? active : 1, sizeof(*curls));
+    size_t *curl_idxs = calloc(active ? active : 1, sizeof(*curl_idxs));
+    size_t ncurls = 0;
+    if (!curls || !curl_idxs)
+        die("Allocation failed:");
+    for (size_t j = 0; j < active; j += 1) {
+        _Http *h = &hs[j];
+        if (!h->curl)
+            continue;
+        // curl starts over, the part is hashed once it finished
+        unlink(h->validator_file);
+        char *part = concat(paths[idxs[j]], ".part");
+        curls[ncurls] = _curl(h->url);
+        da_expand(&curls[ncurls], strs("--output", part, "--dump-header", concat(part, ".headers")));
+        if (*h->known)
+            da_expand(&curls[ncurls], strs("--header", concat(_http_condition(h->known), ": ", h->known)));
+        curl_idxs[ncurls++] = j;
+    }
+    if (ncurls) {
+        if (!exe_exists("curl")) {
+            msg(LL_Error, "curl is required to download https urls");
+        } else {
+            Cmd_Result *results = arena_alloc(ncurls * sizeof(*results));
+            cmd_exec_many(curls, ncurls, 0, results);
+            for (size_t k = 0; k < ncurls; k += 1) {
+                _Http *h = &hs[curl_idxs[k]];
+                if (0 != results[k].code) {
+                    msg(LL_Error, "curl failed to download %s: %.*s", h->url,
+                        (int) results[k].err.len, results[k].err.items);
+                    continue;
+                }
+                char *part = concat(paths[idxs[curl_idxs[k]]], ".part");
+                _http_curl_head(h, concat(part, ".headers"));
+                h->hash = FNV_OFFSET;
+                h->st = h->not_modified || _hash_file(&h->hash, part) ? _HS_Done : _HS_Failed;
+            }
+        }
+    }
+
+    for (size_t j = 0; j < active; j += 1) {
+        _Http *h = &hs[j];
+        char *path = paths[idxs[j]];
+        close(h->out);
+        if (h->not_modified || (_HS_Done != h->st && blobs[j])) {
+            if (h->not_modified) {
+                msg(LL_Debug, "Not modified, copying from cache: %s", urls[idxs[j]]);
+                unlink(concat(path, ".part"));
+                unlink(h->validator_file);
+            } else {
+                msg(LL_Warn, "Failed to download %s, using the cached copy", urls[idxs[j]]);
+            }
+            if (!_replace_file(blobs[j], path)) {
+                msg(LL_Error, "Failed to copy the cached download to '%s'", path);
+                failures += 1;
+            }
+        } else if (_HS_Done != h->st) {
+            msg(LL_Error, "Failed to download %s", urls[idxs[j]]);
+            failures += 1;
+        } else if (-1 == rename(concat(path, ".part"), path)) {
+            msg(LL_Error, "Failed to move download to '%s':", path);
+            failures += 1;
+        } else {
+            unlink(h->validator_file);
+            _dwnld_store(urls[idxs[j]], path, h->hash, h->validator);
+        }
+        _http_free(h);
+    }
+    _free(curl_idxs);
+    _free(curls);
+    _free(blobs);
+    _free(idxs);
+    _free(hs);
+    return failures;
+}
+
+bool dwnld(char *url, char *path)
+{
+    return 0 == dwnld_many(&url, &path, 1);
+}
+
+bool http_get_fd(char *url, Fd fd)
+{
+    _Http h = _http_new("GET", url);
+    h.out = fd;
+    bool ok = 0 == _http_transfer(&h, 1);
+    if (h.curl) {
+        // Streamed through a pipe, as `fd` might not be reopenable by path
+        Process p = cmd_execa(_curl(h.url), IOR_stdout);
+        ok = INVALID_PID != p.id;
+        char buf[BUFFER_SIZE];
+        ssize_t r;
+        while (ok && PSEUDO_PID != p.id && 0 != (r = read(p.stdout_, buf, sizeof(buf)))) {
+            if (-1 == r && EINTR == errno)
+                continue;
+            ok = -1 != r && _http_emit(&h, buf, r);
+        }
+        if (INVALID_PID != p.id)
+            ok = prcs_await(&p, NULL, NULL) && ok && WIFEXITED(p.status) && 0 == WEXITSTATUS(p.status);
+    }
+    _http_free(&h);
+    return ok;
+}
+
+Buffer http_get(char *url)
+{
+    Buffer buf = zero(Buffer);
+    _da_scoped(&buf);
+    _Http h = _http_new("GET", url);
+    h.buf = &buf;
+    bool ok = 0 == _http_transfer(&h, 1);
+    if (h.curl) {
+        buf.len = 0;
+        ok = 0 == cmd_execw(_curl(h.url), NULL, &buf, NULL);
+    }
+    _http_free(&h);
+    return ok ? buf : zero(Buffer);
+}
+
+Buffer http_post(char *url, Buffer data)
+{
+    Buffer buf = zero(Buffer);
+    _da_scoped(&buf);
+    _Http h = _http_new("POST", url);
+    h.buf = &buf;
+    h.body = data;
+    if (!h.body.items)
+        h.body.items = "";
+    bool ok = 0 == _http_transfer(&h, 1);
+    if (h.curl) {
+        // The body is passed to curl through an inherited memfd
+        Fd fd = memfd_create("sys-setup-post", 0);
+        if (INVALID_FILE_DES == fd)
+            die("Failed to create memfd:");
+        for (size_t written = 0; written < data.len;) {
+            ssize_t w = write(fd, data.items + written, data.len - written);
+            if (-1 == w)
+                die("Failed to write post data:");
+            written += w;
+        }
+        char arg[32];
+        snprintf(arg, sizeof(arg), "@/dev/fd/%d", fd);
+        Cmd cmd = _curl(h.url);
+        da_expand(&cmd, strs("--data-binary", arg));
+        buf.len = 0;
+        ok = 0 == cmd_execw(cmd, NULL, &buf, NULL);
+        close(fd);
+    }
+    _http_free(&h);
+    return ok ? buf : zero(Buffer);
+}
+
+// :main :handler
+
+void unload_installer(Installer *i)
+{
+    if (i->handle)
+        dlclose(i->handle);
+    if (i->jit)
+        state.tcc.delete(i->jit);
+    i->handle = NULL;
+    i->jit = NULL;
+}
+
+static bool _load_installer(char *path, char *name, Installer *i)
+{
+    msg(LL_Debug, "Loading: %s at %s", name, path);
+    unload_installer(i);
+    char *source = i->source;
+    *i = zero(Installer);
+    i->source = source;
+    i->path = _keep(path);
+    i->name = _keep(name);
+
+    i->handle = dlopen(i->path, RTLD_NOW);
+    fail_if(!i->handle, "Failed to open installer: %s", dlerror());
+    i->setup = dlsym(i->handle, "setup");
+    i->run_install = dlsym(i->handle, "run_install");
+    fail_if(!i->run_install, "Failed to find 'run_install' function: %s", dlerror());
+    i->cleanup = dlsym(i->handle, "cleanup");
+    i->dependencies = dlsym(i->handle, "dependencies");
+
+    return true;
+}
+
+// If i->handle is not NULL this is equivalent to reloading the installer.
+__attribute__((nonnull))
+bool load_installer(char *path, char *name, Installer *i)
+{
+    _Span span = _span_begin("load", "load_installer %s", name);
+    bool ok = _load_installer(path, name, i);
+    _span_end(span, NULL);
+    return ok;
+}
+
+// :jit
+
+bool load_libtcc()
+{
+    static const char *libs[] = { "libtcc.so", "libtcc.so.1", "libtcc.so.0" };
+    void *handle = NULL;
+    for (size_t i = 0; !handle && i < sizeof(libs) / sizeof(*libs); i += 1)
+        handle = dlopen(libs[i], RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        msg(LL_Debug, "libtcc is not available: %s", dlerror());
+        return false;
+    }
+
+#define _tcc_sym(field, sym) do {                                               \
+    *(void**) &state.tcc.field = dlsym(handle, (sym));                          \
+    if (!state.tcc.field) {                                                     \
+        msg(LL_Warn, "Unsupported libtcc, missing '%s'", (sym));                \
+        dlclose(handle);                                                        \
+        state.tcc = zero(Libtcc);                                               \
+        return false;                                                           \
+    }                                                                           \
+} while (0);
+    _tcc_sym(new, "tcc_new");
+    _tcc_sym(delete, "tcc_delete");
+    _tcc_sym(set_error_func, "tcc_set_error_func");
+    _tcc_sym(set_options, "tcc_set_options");
+    _tcc_sym(set_output_type, "tcc_set_output_type");
+    _tcc_sym(add_file, "tcc_add_file");
+    _tcc_sym(relocate, "tcc_relocate");
+    _tcc_sym(get_symbol, "tcc_get_symbol");
+#undef _tcc_sym
+
+    state.tcc.handle = handle;
+    return true;
+}
+
+static void _tcc_error(void *opaque, const char *err)
+{
+    Buffer *errors = opaque;
+    da_append_many(errors, err, strlen(err));
+    da_append(errors, '\n');
+}
+
+// Compiles `source` in memory using libtcc. Symbols marked as API are resolved
+// directly against the sys-setup executable (this requires -rdynamic).
+// If i->jit or i->handle is not NULL this is equivalent to reloading the installer.
+__attribute__((nonnull))
+bool jit_installer(char *source, char *name, Installer *i)
+{
+    fail_if(!state.tcc.handle, "libtcc is not loaded");
+    msg(LL_Debug, "Compiling in memory: %s at %s", name, source);
+    unload_installer(i);
+    *i = zero(Installer);
+    i->source = source;
+    i->path = _keep(source);
+    i->name = _keep(name);
+
+    TCCState *s = state.tcc.new();
+    fail_if(!s, "Failed to create tcc state");
+    _Span span = _span_begin("compile", "jit %s", name);
+    Buffer errors = zero(Buffer);
+    state.tcc.set_error_func(s, &errors, _tcc_error);
+    // The same flags the compiler gets, e.g. for debug information
+    for (size_t j = 0; j < state.cflags.len; j += 1)
+        state.tcc.set_options(s, state.cflags.items[j]);
+    bool ok = -1 != state.tcc.set_output_type(s, TCC_OUTPUT_MEMORY)
+        && -1 != state.tcc.add_file(s, source)
+        && -1 != state.tcc.relocate(s, TCC_RELOCATE_AUTO);
+    if (ok) {
+        i->jit = s;
+        i->setup = state.tcc.get_symbol(s, "setup");
+        i->run_install = state.tcc.get_symbol(s, "run_install");
+        i->cleanup = state.tcc.get_symbol(s, "cleanup");
+        i->dependencies = state.tcc.get_symbol(s, "dependencies");
+        if (!i->run_install) {
+            msg(LL_Error, "Failed to find 'run_install' function in %s", source);
+            unload_installer(i);
+            ok = false;
+        }
+    } else {
+        msg(LL_Warn, "In memory compilation of '%s' failed:\n%.*s",
+            source, (int) errors.len, errors.items);
+        state.tcc.delete(s);
+    }
+    _span_end(span, NULL);
+
+    if (errors.items)
+        _free(errors.items);
+    return ok;
+}
+
+// Reloads an already loaded installer using the backend it was loaded with.
+bool reload_installer(Installer *i)
+{
+    if (i->jit)
+        return jit_installer(i->path, i->name, i);
+    return load_installer(i->path, i->name, i);
+}
+
+// Compiles every `sources.items[i]` into `targets.items[i]` using up to
+// `state.jobs` worker processes and stores the outcome in `ok[i]`.
+// The log output of each worker is captured and printed in order once all jobs
+// are done, that way compiler errors stay grouped per installer.
+void compile_installers(Strings sources, Strings targets, bool *ok)
+{
+    assert(sources.len == targets.len);
+    if (state.jobs <= 1 || sources.len <= 1) {
+        for (size_t i = 0; i < sources.len; i += 1)
+            ok[i] = compile_so(strs(sources.items[i]), targets.items[i],
+                               zero(Strings), zero(Strings));
+        return;
+    }
+
+    struct compile_job {
+        Pid id;
+        FILE *log;
+    } *jobs = calloc(sources.len, sizeof(*jobs));
+    if (!jobs)
+        die("Allocation failed:");
+
+    fflush(stdout);
+    fflush(stderr);
+    size_t next = 0;
+    size_t running = 0;
+    while (next < sources.len || running > 0) {
+        while (running < state.jobs && next < sources.len) {
+            struct compile_job *job = &jobs[next];
+            ok[next] = false;
+            job->log = tmpfile();
+            if (!job->log)
+                msg(LL_Warn, "Failed to capture output for %s:", sources.items[next]);
+
+            job->id = fork();
+            if (job->id < 0) {
+                msg(LL_Error, "Failed to fork compile job:");
+                if (job->log)
+                    fclose(job->log);
+                job->log = NULL;
+                next += 1;
+                continue;
+            }
+            if (job->id == 0) {
+                if (job->log)
+                    dup2(fileno(job->log), STDERR_FILENO);
+                _trace_process(sources.items[next]);
+                bool res = compile_so(strs(sources.items[next]), targets.items[next],
+                                      zero(Strings), zero(Strings));
+                _log_flush();
+                fflush(stderr);
+                _exit(res ? 0 : 1);
+            }
+            msg(LL_Debug, "Compiling %s (pid %d)", sources.items[next], job->id);
+            next += 1;
+            running += 1;
+        }
+        if (0 == running)
+            break;
+
+        int status;
+        Pid id = waitpid(-1, &status, 0);
+        if (-1 == id) {
+            if (errno == EINTR)
+                continue;
+            die("Waiting for compile jobs failed:");
+        }
+        for (size_t i = 0; i < next; i += 1) {
+            if (jobs[i].id != id)
+                continue;
+            ok[i] = WIFEXITED(status) && 0 == WEXITSTATUS(status);
+            running -= 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < sources.len; i += 1) {
+        if (!jobs[i].log)
+            continue;
+        Fd fd = fileno(jobs[i].log);
+        if (0 == lseek(fd, 0, SEEK_SET)) {
+            Buffer out = read_all(fd);
+            if (out.len) {
+                fwrite(out.items, 1, out.len, stderr);
+                fflush(stderr);
+            }
+        }
+        fclose(jobs[i].log);
+    }
+    _free(jobs);
+}
+
+// Finds every `*/install.c`. Nothing is compiled or loaded yet, see
+// `materialize_installers`.
+Installers discover_installers()
+{
+    _Span span = _span_begin("discovery", "discover_installers");
+    Installers installers = zero(Installers);
+
+    Ls_Files ls_res;
+    if (!ls(".", FF_Directory, &ls_res))
+        die("ls failed:");
+
+    static const char *install_c = "/install.c";
+    for (size_t i = 0; i < ls_res.len; i += 1) {
+        if (ls_res.items[i].name[0] == '.') {
+            // Hidden must be passed to ls via FF_Hidden, this therefore only serves
+            // for the peace of mind.
+            unreachable();
+        }
+
+        char *source = concat(ls_res.items[i].name, install_c);
+        if (!exists(source, FF_File)) // no installer, so we ignore it
+            continue;
+
+        da_append(&installers, ((Installer) {
+            .name = ls_res.items[i].name,
+            .source = source,
+        }));
+    }
+
+    _span_end(span, NULL);
+    return installers;
+}
+
+// Compiles and loads every installer at `idxs` inside `state.available`, that
+// is not loaded yet. Returns the number of installers that failed to load.
+size_t materialize_installers(Sizes idxs)
+{
+    static const char *libinstaller = "/libinstaller.so";
+    size_t failures = 0;
+    // Compilation has to go through even in dry mode
+    const bool dry = state.dry;
+    state.dry = false;
+
+    // Everything libtcc can not handle is passed on to the compiler
+    Strings cc_sources = zero(Strings);
+    Strings cc_targets = zero(Strings);
+    Sizes cc_idxs = zero(Sizes);
+    for (size_t i = 0; i < idxs.len; i += 1) {
+        Installer *inst = &state.available.items[idxs.items[i]];
+        if (inst->run_install)
+            continue; // already loaded
+        if (BE_Tcc == state.backend && jit_installer(inst->source, inst->name, inst))
+            continue;
+        da_append(&cc_sources, inst->source);
+        da_append(&cc_targets, concat(inst->name, libinstaller));
+        da_append(&cc_idxs, idxs.items[i]);
+    }
+
+    bool *compiled = calloc(cc_idxs.len ? cc_idxs.len : 1, sizeof(*compiled));
+    if (!compiled)
+        die("Allocation failed:");
+    // TODO: Check here if the installer needs to be rebuild not in the compile_so
+    compile_installers(cc_sources, cc_targets, compiled);
+    for (size_t i = 0; i < cc_idxs.len; i += 1) {
+        Installer *inst = &state.available.items[cc_idxs.items[i]];
+        if (!compiled[i] || !load_installer(cc_targets.items[i], inst->name, inst))
+            failures += 1;
+    }
+
+    if (0 < failures)
+        msg(LL_Warn, "Failed to load %zu installer%s",
+            failures, 1 == failures ? "" : "s");
+
+    _free(compiled);
+    if (cc_sources.items)
+        _free(cc_sources.items);
+    if (cc_targets.items)
+        _free(cc_targets.items);
+    if (cc_idxs.items)
+        _free(cc_idxs.items);
+
+    state.dry = dry;
+    return failures;
+}
+
+static bool _run_installer(Installer *inst, Context ctx)
+{
+    state.exes.checked = false;
+    if (inst->setup) {
+        ctx.name = inst->name;
+        ctx.path = inst->path;
+        _Span span = _span_begin("installer", "%s setup", inst->name);
+        Setup_Result res = inst->setup(ctx);
+        _span_end(span, NULL);
+        if (!_flush_pkgs())
+            res.ok = false;
+
+        // TODO: should res.ok take priority over res.request_reload?
+        if (res.request_reload) {
+            ctx.reloaded = true;
+            ctx.reload_data = res.reload_data;
+            if (!reload_installer(inst)) {
+                msg(LL_Error, "Installer reload failed");
+                return false;
+            }
+            return _run_installer(inst, ctx);
+        }
+
+        if (!res.ok) {
+            msg(LL_Error, "Setup for installer %s failed", inst->name);
+            return false;
+        }
+    }
+
+    _Span span = _span_begin("installer", "%s run_install", inst->name);
+    bool ok = inst->run_install();
+    ok = _flush_pkgs() && ok;
+    _span_end(span, NULL);
+
+    if (inst->cleanup) {
+        span = _span_begin("installer", "%s cleanup", inst->name);
+        inst->cleanup();
+        _span_end(span, NULL);
+    }
+    
+    return ok;
 }
 
-bool prcs_write(Process p, char *in)
+// sets name and path in ctx if inst->setup is defined
+// Everything the installer allocated is released afterwards, reload_data
+// survives reloads.
+bool run_installer(Installer *inst, Context ctx)
 {
-    fail_if(p.stdin_ == INVALID_FILE_DES, "Can not write to stdin");
+    _Span span = _span_begin("installer", "%s", inst->name);
+    const size_t scope = scope_push();
+    const char *installer = state.installer;
+    state.installer = inst->name;
+    bool ok = _run_installer(inst, ctx);
+    state.installer = installer;
+    state.queued_pkgs = zero(Strings);
+    scope_pop(scope);
+    _span_end(span, ok ? "\"ok\": true" : "\"ok\": false");
+    return ok;
+}
 
-    const size_t in_len = strlen(in);
-    size_t written = 0;
-    while (written < in_len) {
-        ssize_t w = write(p.stdin_, in + written, in_len - written);
-        if (-1 == w) {
-            msg(LL_Error, "Failed to write to child stdin (continuing):");
-            break;
-        }
-        written += w;
+// :schedule
+
+typedef enum {
+    IS_Pending,
+    IS_Running,
+    IS_Done,
+    IS_Failed,
+    IS_Cancelled,
+} Install_Status;
+
+typedef struct {
+    // Index into state.available
+    size_t idx;
+    // Indices into the surrounding Install_Jobs
+    Sizes deps;
+    // Set if a dependency could not be found, the job will fail
+    bool broken;
+    Install_Status status;
+    Pid pid;
+} Install_Job;
+
+typedef DA_STRUCT(Install_Job) Install_Jobs;
+
+ssize_t find_installer(const char *name)
+{
+    for (size_t i = 0; i < state.available.len; i += 1) {
+        if (0 == strcmp(name, state.available.items[i].name))
+            return i;
     }
-    return written == in_len;
+    return -1;
 }
 
-bool prcs_await(Process *p, Buffer *out, Buffer *err)
+// Adds the installer at `idx` and all of its (transitive) dependencies to
+// `jobs`, if they are not part of it yet. Returns the position inside `jobs`.
+size_t add_install_job(Install_Jobs *jobs, size_t idx)
 {
-    fail_if(-1 == waitpid(p->id, &p->status, 0), "Wait failed:");
-
-    if (!out && !err)
-        return true;
+    for (size_t i = 0; i < jobs->len; i += 1) {
+        if (jobs->items[i].idx == idx)
+            return i;
+    }
 
-    char buf[BUFFER_SIZE];
-    Fd fds[2] = { p->stdout_, p->stderr_ };
-    Buffer *bs[2] = { out, err };
+    const size_t pos = jobs->len;
+    da_append(jobs, ((Install_Job) { .idx = idx, .status = IS_Pending }));
 
-    for (size_t i = 0; i < 2; i += 1) {
-        if (fds[i] == INVALID_FILE_DES || bs[i] == NULL)
+    const Installer *inst = &state.available.items[idx];
+    if (!inst->run_install) {
+        msg(LL_Error, "Installer %s is not loaded", inst->name);
+        jobs->items[pos].broken = true;
+    }
+    for (const char **dep = inst->dependencies; dep && *dep; dep += 1) {
+        ssize_t dep_idx = find_installer(*dep);
+        if (-1 == dep_idx) {
+            msg(LL_Error, "Unknown dependency '%s' of installer %s", *dep, inst->name);
+            jobs->items[pos].broken = true;
             continue;
+        }
+        // NOTE: jobs->items might be reallocated, so no pointers are kept around
+        size_t dep_pos = add_install_job(jobs, dep_idx);
+        da_append(&jobs->items[pos].deps, dep_pos);
+    }
+    return pos;
+}
 
-        bool exit = false;
-        do {
-            ssize_t r = read(fds[i], buf, sizeof(buf));
-            switch (r) {
-            case -1:
-                msg(LL_Error, "Error while reading std%s:", i == 0 ? "out" : "err");
-            case 0:
-                exit = true;
-                break;
-            default:
-                da_append_many(bs[i], buf, r);
-                break;
+// Colors: 0 = unvisited, 1 = on the current path, 2 = finished
+static void _check_cycles(Install_Jobs *jobs, size_t pos, int *color, Sizes *path)
+{
+    color[pos] = 1;
+    da_append(path, pos);
+    for (size_t i = 0; i < jobs->items[pos].deps.len; i += 1) {
+        size_t dep = jobs->items[pos].deps.items[i];
+        if (2 == color[dep])
+            continue;
+        if (1 == color[dep]) {
+            Buffer cycle = zero(Buffer);
+            size_t start = 0;
+            while (path->items[start] != dep)
+                start += 1;
+            for (size_t j = start; j < path->len; j += 1) {
+                char *name = state.available.items[jobs->items[path->items[j]].idx].name;
+                da_append_many(&cycle, name, strlen(name));
+                da_append_many(&cycle, " -> ", 4);
             }
-        } while (!exit);
-        register_ptr(bs[i]->items);
+            char *name = state.available.items[jobs->items[dep].idx].name;
+            da_append_many(&cycle, name, strlen(name));
+            da_append(&cycle, '\0');
+            die("Dependency cycle: %s", cycle.items);
+        }
+        _check_cycles(jobs, dep, color, path);
+    }
+    path->len -= 1;
+    color[pos] = 2;
+}
+
+void check_dependency_cycles(Install_Jobs *jobs)
+{
+    int *color = calloc(jobs->len ? jobs->len : 1, sizeof(*color));
+    if (!color)
+        die("Allocation failed:");
+    Sizes path = zero(Sizes);
+    for (size_t i = 0; i < jobs->len; i += 1) {
+        if (0 == color[i])
+            _check_cycles(jobs, i, color, &path);
+    }
+    if (path.items)
+        _free(path.items);
+    _free(color);
+}
 
-        if (-1 == close(fds[i])) {
-            msg(LL_Error, "Failed to close std%s:", i == 0 ? "out" : "err");
+// Returns the status the job would have, if all dependencies are considered:
+// IS_Pending if at least one dependency has not finished, IS_Cancelled if one
+// of them did not succeed and IS_Done if the job is ready to run.
+static Install_Status _deps_status(const Install_Jobs *jobs, const Install_Job *job)
+{
+    Install_Status res = IS_Done;
+    for (size_t i = 0; i < job->deps.len; i += 1) {
+        switch (jobs->items[job->deps.items[i]].status) {
+        case IS_Failed:
+        case IS_Cancelled:
+            return IS_Cancelled;
+        case IS_Pending:
+        case IS_Running:
+            res = IS_Pending;
+            break;
+        case IS_Done:
+            break;
         }
     }
+    return res;
+}
 
-    return true;
+// Compiles and loads the installers at `to_run` and their dependencies.
+void materialize_needed(Sizes to_run)
+{
+    Sizes needed = zero(Sizes);
+    da_expand(&needed, to_run);
+    for (size_t done = 0; done < needed.len;) {
+        Sizes batch = { needed.items + done, needed.len - done, 0 };
+        materialize_installers(batch);
+        for (const size_t end = needed.len; done < end; done += 1) {
+            const Installer *inst = &state.available.items[needed.items[done]];
+            for (const char **dep = inst->dependencies; dep && *dep; dep += 1) {
+                ssize_t idx = find_installer(*dep);
+                if (-1 == idx)
+                    continue; // reported by add_install_job
+                bool known = false;
+                for (size_t j = 0; j < needed.len && !known; j += 1)
+                    known = needed.items[j] == (size_t) idx;
+                if (!known)
+                    da_append(&needed, (size_t) idx);
+            }
+        }
+    }
+    if (needed.items)
+        _free(needed.items);
 }
 
-int cmd_execw(Cmd cmd, char *in, Buffer *out, Buffer *err)
+// Runs all installers in `to_run` and their dependencies. Installers are started
+// as soon as all of their dependencies finished successfully. If
+// `state.parallel` is greater than 1, up to that many installers run
+// concurrently in worker processes. A failing installer only cancels the
+// installers depending on it.
+// Returns the number of installers that failed or were cancelled.
+size_t run_installers(Sizes to_run)
 {
-    int redirects = IOR_none;
-    if (in)  redirects |= IOR_stdin;
-    if (out) redirects |= IOR_stdout;
-    if (err) redirects |= IOR_stderr;
+    // Only the requested installers and their dependencies are compiled
+    materialize_needed(to_run);
+
+    Install_Jobs jobs = zero(Install_Jobs);
+    for (size_t i = 0; i < to_run.len; i += 1)
+        add_install_job(&jobs, to_run.items[i]);
+    for (size_t i = to_run.len; i < jobs.len; i += 1)
+        msg(LL_Info, "Adding %s as dependency",
+            state.available.items[jobs.items[i].idx].name);
+    check_dependency_cycles(&jobs);
+
+    const bool inline_run = state.parallel <= 1;
+    size_t running = 0;
+    size_t finished = 0;
+    size_t failures = 0;
+    while (finished < jobs.len) {
+        bool progress = false;
+        for (size_t i = 0; i < jobs.len && running < state.parallel; i += 1) {
+            Install_Job *job = &jobs.items[i];
+            Installer *inst = &state.available.items[job->idx];
+            if (IS_Pending != job->status)
+                continue;
 
-    Process p = cmd_execa(cmd, redirects);
-    if (p.id == INVALID_PID)
-        return -1;
-    if (in) {
-        // NOTE: Ignoring error because we still need to wait for the process
-        prcs_write(p, in);
+            Install_Status deps = job->broken ? IS_Cancelled : _deps_status(&jobs, job);
+            if (IS_Pending == deps)
+                continue;
+            progress = true;
+            if (IS_Cancelled == deps) {
+                msg(LL_Error, "Skipping %s: a dependency failed", inst->name);
+                job->status = IS_Cancelled;
+                finished += 1;
+                failures += 1;
+                continue;
+            }
+
+            _log_flush();
+            printf(":: Running %s\n", inst->name);
+            if (inline_run) {
+                job->status = run_installer(inst, zero(Context)) ? IS_Done : IS_Failed;
+                finished += 1;
+                if (IS_Failed == job->status) {
+                    msg(LL_Error, "Installer %s failed", inst->name);
+                    failures += 1;
+                }
+                // Restart so installers are run in a stable order
+                break;
+            }
+
+            fflush(stdout);
+            fflush(stderr);
+            job->pid = fork();
+            if (job->pid < 0) {
+                msg(LL_Error, "Failed to fork worker for %s:", inst->name);
+                job->status = IS_Failed;
+                finished += 1;
+                failures += 1;
+                continue;
+            }
+            if (0 == job->pid) {
+                _trace_process(inst->name);
+                bool ok = run_installer(inst, zero(Context));
+                _log_flush();
+                fflush(stdout);
+                fflush(stderr);
+                _exit(ok ? 0 : 1);
+            }
+            job->status = IS_Running;
+            running += 1;
+        }
+
+        if (0 == running) {
+            if (!progress)
+                unreachable(); // cycles are rejected beforehand
+            continue;
+        }
+
+        int status;
+        Pid id = waitpid(-1, &status, 0);
+        if (-1 == id) {
+            if (EINTR == errno)
+                continue;
+            die("Waiting for installers failed:");
+        }
+        for (size_t i = 0; i < jobs.len; i += 1) {
+            Install_Job *job = &jobs.items[i];
+            if (IS_Running != job->status || job->pid != id)
+                continue;
+            running -= 1;
+            finished += 1;
+            if (WIFEXITED(status) && 0 == WEXITSTATUS(status)) {
+                job->status = IS_Done;
+            } else {
+                job->status = IS_Failed;
+                failures += 1;
+                msg(LL_Error, "Installer %s failed",
+                    state.available.items[job->idx].name);
+            }
+            break;
+        }
     }
 
-    if (state.dry && !state.dry_allow_commands)
-        return 0;
+    for (size_t i = 0; i < jobs.len; i += 1) {
+        if (jobs.items[i].deps.items)
+            _free(jobs.items[i].deps.items);
+    }
+    if (jobs.items)
+        _free(jobs.items);
+    return failures;
+}
 
-    if (!prcs_await(&p, out, err))
-        return -1;
-    return WIFEXITED(p.status) ? WEXITSTATUS(p.status) : -1;
+// :watch
+// Every directory of the watched installers gets an inotify watch, just like
+// the headers from their depfiles outside of it. Once a burst of changes
+// settled, the installers they belong to are run again; if their install.c or
+// a header changed, they are recompiled and reloaded first.
+
+// Changes are collected until nothing happened for this many milliseconds
+#define WATCH_SETTLE_MS 50
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE \
+                      | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int wd;
+    // Index into state.available, SIZE_MAX for directories of cached trees
+    size_t idx;
+    char *dir;
+    // Only this file of `dir` is watched, a dependency of the installer. NULL
+    // if all of `dir` is watched.
+    char *file;
+} _Watch;
+
+typedef DA_STRUCT(_Watch) _Watches;
+
+static volatile sig_atomic_t _watch_stop = 0;
+
+static void _watch_interrupt(int sig)
+{
+    (void) sig;
+    _watch_stop = 1;
 }
 
-Cmd sudo(Cmd cmd)
+// Files written by materialize_installers, that must not trigger a rerun
+static bool _watch_ignored(const char *name)
 {
-    da_insert_shift(&cmd, 0, "sudo");
-    return cmd;
+    return '.' == name[0]
+        || '~' == name[strlen(name) - 1]
+        || 0 == strncmp(name, "libinstaller.so", strlen("libinstaller.so"));
 }
 
-Cmd make(Strings rules, char *in_dir)
+// Watches `dir` and its sub directories matching `ff`.
+static void _watch_dir(Fd fd, _Watches *watches, char *dir, size_t idx, int ff)
 {
-    Cmd cmd = zero(Cmd);
-    da_append(&cmd, strdup("make"));
-    if (in_dir)
-        da_expand(&cmd, strs("-C", in_dir));
-    da_expand(&cmd, rules);
-    return cmd;
+    int wd = inotify_add_watch(fd, dir, WATCH_EVENTS | IN_ONLYDIR);
+    if (-1 == wd) {
+        // Directories may be gone again before their creation is handled
+        if (ENOENT != errno)
+            msg(LL_Warn, "Failed to watch '%s':", dir);
+        return;
+    }
+    // Cached trees are watched once, no matter how often they are scanned
+    // again. The wd is the same as long as the directory is.
+    for (size_t i = 0; SIZE_MAX == idx && i < watches->len; i += 1) {
+        const _Watch *w = &watches->items[i];
+        if (SIZE_MAX == w->idx && w->wd == wd && 0 == strcmp(w->dir, dir))
+            return;
+    }
+    da_append(watches, ((_Watch) { .wd = wd, .idx = idx, .dir = _keep(dir) }));
+
+    const size_t scope = scope_push();
+    Ls_Files dirs;
+    if (ls(dir, FF_Directory | (ff & FF_Hidden), &dirs)) {
+        for (size_t i = 0; i < dirs.len; i += 1)
+            _watch_dir(fd, watches, concat(dir, "/", dirs.items[i].name), idx, ff);
+    }
+    scope_pop(scope);
 }
 
-Cmd git_clone(char *repo, char *dest_dir, bool init_submodules)
+// Watches the dependencies of the installer at `idx` outside of its directory,
+// which are listed in the depfile of its last compilation. System headers are
+// absolute and not watched.
+static void _watch_deps(Fd fd, _Watches *watches, size_t idx)
 {
-    Cmd cmd = strs("git", "clone");
-    if (init_submodules)
-        da_expand(&cmd, strs("--recurse-submodules", "-j8"));
-    da_expand(&cmd, strs(repo, dest_dir));
-    return cmd;
+    const Installer *inst = &state.available.items[idx];
+    const size_t scope = scope_push();
+    Strings deps = zero(Strings);
+    Fd dfd = open(_compile_output(inst->source, ".d"), O_RDONLY | O_CLOEXEC);
+    if (INVALID_FILE_DES != dfd) {
+        Buffer depfile = read_all(dfd);
+        close(dfd);
+        if (depfile.items)
+            deps = _deps_parse(depfile);
+    }
+    // Without a depfile, e.g. if compiled in memory, only the API is known
+    if (0 == deps.len)
+        deps = strs("installer.h");
+
+    char own[PATH_MAX];
+    _path_normalize(inst->name, own);
+    for (size_t i = 0; i < deps.len; i += 1) {
+        if ('/' == *deps.items[i])
+            continue;
+        char path[PATH_MAX];
+        _path_normalize(deps.items[i], path);
+        if (_path_within(path, own))
+            continue;
+        char *file = strrchr(path, '/');
+        *file++ = '\0';
+        bool known = false;
+        for (size_t j = 0; !known && j < watches->len; j += 1) {
+            const _Watch *w = &watches->items[j];
+            known = w->idx == idx && w->file && 0 == strcmp(w->file, file)
+                && 0 == strcmp(w->dir, *path ? path : "/");
+        }
+        if (known)
+            continue;
+        int wd = inotify_add_watch(fd, *path ? path : "/", WATCH_EVENTS | IN_ONLYDIR);
+        if (-1 == wd) {
+            msg(LL_Warn, "Failed to watch '%s/%s':", path, file);
+            continue;
+        }
+        da_append(watches, ((_Watch) {
+            .wd = wd, .idx = idx, .dir = _keep(*path ? path : "/"), .file = _keep(file),
+        }));
+    }
+    scope_pop(scope);
 }
 
-Cmd git_checkout(char *repo_dir, char *target)
+// Returns true if `dir`/`name` was probably changed by the installer, that
+// just ran: either by sys-setup itself or while one of its commands ran.
+static bool _watch_self(const char *dir, const char *name)
 {
-    return strs("git", "-C", repo_dir, "checkout", target);
+    char *path = concat(dir, "/", name);
+    if (_track_written(path))
+        return true;
+    if (0 == state.cmd_periods.len)
+        return false;
+    struct stat st;
+    // Removed by a command, it can not be told apart from a removal by the user
+    if (-1 == lstat(path, &st))
+        return true;
+    for (size_t i = 0; i < state.cmd_periods.len; i += 1) {
+        const struct _Period *p = &state.cmd_periods.items[i];
+        const bool after_start = st.st_ctim.tv_sec > p->start.tv_sec
+            || (st.st_ctim.tv_sec == p->start.tv_sec && st.st_ctim.tv_nsec >= p->start.tv_nsec);
+        const bool before_end = st.st_ctim.tv_sec < p->end.tv_sec
+            || (st.st_ctim.tv_sec == p->end.tv_sec && st.st_ctim.tv_nsec <= p->end.tv_nsec);
+        if (after_start && before_end)
+            return true;
+    }
+    return false;
 }
 
-Cmd git_clean(char *repo_dir)
+// The directory of the watch `e` was removed or moved away, so its path is
+// wrong from now on. Its cached trees are dropped and the watch is forgotten
+// once inotify removed it, a new directory at the path is watched again when
+// it is created or scanned.
+static void _watch_gone(Fd fd, _Watches *watches, const struct inotify_event *e)
 {
-    todo();
+    // Followed by IN_IGNORED
+    if (e->mask & IN_MOVE_SELF)
+        inotify_rm_watch(fd, e->wd);
+    for (size_t i = 0; i < watches->len;) {
+        _Watch *w = &watches->items[i];
+        if (w->wd != e->wd) {
+            i += 1;
+            continue;
+        }
+        if (SIZE_MAX == w->idx)
+            _tree_cache_invalidate(w->dir);
+        if (!(e->mask & IN_IGNORED)) {
+            i += 1;
+            continue;
+        }
+        msg(LL_Debug, "Not watching %s anymore", w->dir);
+        *w = watches->items[watches->len - 1];
+        watches->len -= 1;
+    }
 }
 
-// :package :installation
+// Reads the pending events and marks the installers they belong to in
+// `changed`, `rebuild` is set if their sources changed. Cached trees containing
+// the changes are dropped. Right after a run, `after_run` skips the changes the
+// installer made itself. Returns false on error.
+static bool _watch_read(Fd fd, _Watches *watches, bool *changed, bool *rebuild, bool after_run)
+{
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (-1 == n)
+        return EAGAIN == errno || EINTR == errno;
+
+    for (char *p = buf; p < buf + n;) {
+        const struct inotify_event *e = (struct inotify_event*) p;
+        p += sizeof(*e) + e->len;
+        if (e->mask & IN_Q_OVERFLOW) {
+            // Events were lost, no cached tree can be trusted anymore
+            _tree_cache_invalidate(NULL);
+            continue;
+        }
+        if (e->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+            _watch_gone(fd, watches, e);
+            continue;
+        }
 
-bool exe_exists(char *name)
-{ // https://stackoverflow.com/questions/41230547/check-if-program-is-installed-in-c
-    if (strchr(name, '/'))
-        return 0 == access(name, X_OK);
+        // A directory may be watched for an installer and for cached trees
+        for (size_t i = 0; e->len && i < watches->len; i += 1) {
+            if (watches->items[i].wd != e->wd)
+                continue;
+            // NOTE: watches->items might be moved by adding watches
+            const size_t idx = watches->items[i].idx;
+            char *dir = watches->items[i].dir;
+            const char *file = watches->items[i].file;
+            const bool cached = SIZE_MAX == idx;
+            if (cached)
+                _tree_cache_invalidate(dir);
+            else if (file ? 0 != strcmp(e->name, file) : _watch_ignored(e->name))
+                continue;
+            else if (after_run && _watch_self(dir, e->name))
+                continue;
+            msg(LL_Debug, "Changed: %s/%s", dir, e->name);
+            if (!file && (e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+                _watch_dir(fd, watches, concat(dir, "/", e->name), idx,
+                           cached ? FF_Directory | FF_Hidden : FF_Directory);
+            if (cached)
+                continue;
 
-    const char *path = getenv("PATH");
-    fail_if(!path, "Failed to get PATH");
+            const Installer *inst = &state.available.items[idx];
+            changed[idx] = true;
+            const size_t len = strlen(e->name);
+            if (file || (0 == strcmp(e->name, "install.c") && 0 == strcmp(dir, inst->name))
+                    || (len > 2 && 0 == strcmp(e->name + len - 2, ".h")))
+                rebuild[idx] = true;
+        }
+    }
+    return true;
+}
 
-    char *buf = malloc(strlen(path) + strlen(name) + 3);
-    for(; *path; ++path) {
-        char *p = buf;
-        for(; *path && *path!=':'; ++path,++p) {
-            *p = *path;
+// Keeps running the installers at `to_run` whenever a file inside of their
+// directories changes, until SIGINT or SIGTERM is received.
+// Returns the number of failed reruns.
+size_t watch_installers(Sizes to_run)
+{
+    Fd fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (INVALID_FILE_DES == fd) {
+        msg(LL_Error, "Failed to initialize inotify:");
+        return 1;
+    }
+    _Watches watches = zero(_Watches);
+    for (size_t i = 0; i < to_run.len; i += 1) {
+        const size_t idx = to_run.items[i];
+        _watch_dir(fd, &watches, state.available.items[idx].name, idx, FF_Directory);
+        _watch_deps(fd, &watches, idx);
+    }
+
+    // No SA_RESTART, so poll returns once the user is done
+    struct sigaction sa = { .sa_handler = _watch_interrupt };
+    struct sigaction old_int, old_term;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    bool *changed = calloc(state.available.len, 2 * sizeof(bool));
+    if (!changed)
+        die("Allocation failed:");
+    bool *rebuild = changed + state.available.len;
+
+    size_t failures = 0;
+    _log_flush();
+    printf(":: Watching %zu installer%s, press Ctrl-C to stop\n",
+           to_run.len, 1 == to_run.len ? "" : "s");
+    fflush(stdout);
+    while (!_watch_stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, -1);
+        if (-1 == ready && EINTR != errno) {
+            msg(LL_Error, "Waiting for changes failed:");
+            failures += 1;
+            break;
         }
-        if(p == buf)
-            *p++ = '.';
-        if(p[-1] != '/')
-            *p++ = '/';
+        if (ready <= 0)
+            continue;
 
-        strcpy(p, name);
-        if(0 == access(buf, X_OK)) {
-            _free(buf);
-            return true;
+        const size_t scope = scope_push();
+        // Editors tend to write a file in multiple steps
+        do {
+            if (!_watch_read(fd, &watches, changed, rebuild, false)) {
+                msg(LL_Error, "Reading changes failed:");
+                _watch_stop = 1;
+            }
+        } while (!_watch_stop && 0 < poll(&pfd, 1, WATCH_SETTLE_MS));
+
+        for (size_t i = 0; i < to_run.len && !_watch_stop; i += 1) {
+            const size_t idx = to_run.items[i];
+            Installer *inst = &state.available.items[idx];
+            if (!changed[idx])
+                continue;
+            const bool reload = rebuild[idx];
+            changed[idx] = rebuild[idx] = false;
+
+            if (reload) {
+                unload_installer(inst);
+                inst->run_install = NULL;
+                if (0 < materialize_installers((Sizes) { (size_t[]) { idx }, 1, 1 })) {
+                    failures += 1;
+                    continue; // retried with the next change
+                }
+                _watch_deps(fd, &watches, idx);
+            }
+            if (!inst->run_install)
+                continue;
+
+            _log_flush();
+            printf(":: Running %s\n", inst->name);
+            fflush(stdout);
+            state.track_writes = true;
+            if (!run_installer(inst, (Context) { .reloaded = true })) {
+                msg(LL_Error, "Installer %s failed", inst->name);
+                failures += 1;
+            }
+            state.track_writes = false;
+            _log_flush();
+            printf(":: Watching\n");
+            fflush(stdout);
         }
-        if(!*path)
-            break;
+
+        // Installers may write into their own directories, what they changed
+        // must not trigger them again. Other changes are handled right away.
+        while (0 < poll(&pfd, 1, 0) && _watch_read(fd, &watches, changed, rebuild, true));
+        _track_reset();
+        scope_pop(scope);
     }
-    _free(buf);
-    return false;
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    _watch_stop = 0;
+    _free(changed);
+    if (watches.items)
+        _free(watches.items);
+    close(fd);
+    return failures;
 }
 
-bool is_installed(char *pkg)
+// :plan
+// In dry mode every change is recorded by _plan_record instead of being made.
+// Afterwards the plan is printed with the difference to the live system, and
+// may be applied later with `--apply`.
+
+// Parses a plan written by _plan_record in place.
+static bool _plan_parse(char *text, _Plan_Ops *ops)
 {
-    Cmd cmd = strs("pacman", "-Q", pkg);
-    return 0 == cmd_exec(cmd);
+    size_t n = 0;
+    for (char *line = text; *line;) {
+        char *end = strchrnul(line, '\n');
+        char *next = *end ? end + 1 : end;
+        *end = '\0';
+        n += 1;
+
+        Strings fields = zero(Strings);
+        _da_scoped(&fields);
+        da_append(&fields, line);
+        char *w = line;
+        for (char *r = line; *r; r += 1) {
+            if ('\t' == *r) {
+                *w++ = '\0';
+                da_append(&fields, w);
+            } else if ('\\' == *r && r[1]) {
+                r += 1;
+                *w++ = 't' == *r ? '\t' : 'n' == *r ? '\n' : *r;
+            } else {
+                *w++ = *r;
+            }
+        }
+        *w = '\0';
+
+        _Plan_Op op = { .kind = PO_Exec + 1 };
+        for (size_t k = 0; k <= PO_Exec; k += 1) {
+            if (0 == strcmp(fields.items[0], _plan_kinds[k]))
+                op.kind = k;
+        }
+        const size_t args = fields.len < 3 ? 0 : fields.len - 3;
+        bool valid = false;
+        switch (op.kind) {
+        case PO_Mkdir:  valid = 1 == args; break;
+        case PO_Copy:   valid = 2 == args; break;
+        case PO_Remove: valid = 1 == args || (2 == args && 0 == strcmp("-r", fields.items[4])); break;
+        case PO_Link:   valid = 2 == args; break;
+        case PO_Exec:   valid = 0 < args; break;
+        }
+        if (!valid) {
+            msg(LL_Error, "Invalid operation in line %zu of the plan", n);
+            return false;
+        }
+        op.installer = fields.items[1];
+        op.cwd = fields.items[2];
+        op.args = (Strings) { fields.items + 3, args, args };
+        da_append(ops, op);
+        line = next;
+    }
+    return true;
 }
 
-bool ensure_uptodate(Strings pkgs)
+// Reads the whole plan in `fd`, ops are allocated in the current scope.
+bool load_plan(Fd fd, _Plan_Ops *ops)
 {
-    // TODO: cache the updated/upgraded packages so this is not run multiple times
-    ignore_param(pkgs); // pacman does not support partial upgrades
-    Cmd cmd = strs("sudo", "pacman", "-Syu");
-    return 0 == cmd_exec(cmd);
+    _da_scoped(ops);
+    if (-1 == lseek(fd, 0, SEEK_SET)) {
+        msg(LL_Error, "Failed to read the plan:");
+        return false;
+    }
+    Buffer text = read_all(fd);
+    if (!text.items)
+        return false;
+    da_append(&text, '\0');
+    return _plan_parse(text.items, ops);
 }
 
-bool install_pkg(char *name)
+static char *_plan_path(const _Plan_Op *op)
 {
-    Cmd cmd = strs("sudo", "pacman", "-S", name);
-    return 0 == cmd_exec(cmd);
+    return PO_Copy == op->kind || PO_Link == op->kind ? op->args.items[1] : op->args.items[0];
 }
 
-// :compilation
-
-bool compile(char *file, char *out, Strings cflags, Strings lflags)
+// Compares the operation with the live system: '=' if it would not change
+// anything, '+' if it creates, '~' if it replaces and '-' if it removes
+// something. Commands are always run and marked with '$'.
+// Paths in `touched` were changed by the plan before, the values are the kind
+// of the last operation. They take precedence over the live system.
+static char _plan_diff(const _Plan_Op *op, _Index *touched)
 {
-    Cmd cmd = zero(Cmd);
-    da_append(&cmd, state.cc);
-    da_expand(&cmd, state.cflags);
-    if (cflags.len)
-        da_expand(&cmd, cflags);
-    da_expand(&cmd, strs(file, "-o", out));
-    if (lflags.len)
-        da_expand(&cmd, lflags);
-
-    Buffer err = zero(Buffer);
-    bool ok = !cmd_execw(cmd, NULL, NULL, &err);
-    if (!ok)
-        msg(LL_Error, "Compilation of '%s' failed:\n%.*s",
-            file, (int) err.len, err.items);
-
-    if (cmd.items)
-        _free(cmd.items);
+    _Index_Entry *e = PO_Exec != op->kind ? _index_get(touched, _plan_path(op)) : NULL;
+    if (e && PO_Remove == e->value)
+        return PO_Remove == op->kind ? '=' : '+';
+    if (e)
+        return PO_Remove == op->kind ? '-' : PO_Mkdir == op->kind && PO_Mkdir == e->value ? '=' : '~';
+
+    struct stat src, dst;
+    switch (op->kind) {
+    case PO_Mkdir:
+        return 0 == lstat(op->args.items[0], &dst) ? '=' : '+';
+    case PO_Copy:
+        if (-1 == lstat(op->args.items[1], &dst))
+            return '+';
+        const bool same = 0 == stat(op->args.items[0], &src) && S_ISREG(dst.st_mode)
+            && src.st_size == dst.st_size && (src.st_mode & 07777) == (dst.st_mode & 07777)
+            && src.st_mtim.tv_sec == dst.st_mtim.tv_sec
+            && src.st_mtim.tv_nsec == dst.st_mtim.tv_nsec;
+        return same ? '=' : '~';
+    case PO_Remove:
+        return 0 == lstat(op->args.items[0], &dst) ? '-' : '=';
+    case PO_Link: {
+        if (-1 == lstat(op->args.items[1], &dst))
+            return '+';
+        char target[PATH_MAX];
+        const ssize_t len = readlink(op->args.items[1], target, sizeof(target) - 1);
+        if (-1 == len)
+            return '~';
+        target[len] = '\0';
+        return 0 == strcmp(target, op->args.items[0]) ? '=' : '~';
+    }
+    case PO_Exec:
+        return '$';
+    }
+    unreachable();
+}
 
-    return ok;
+static void _plan_print(const _Plan_Op *op, char diff)
+{
+    printf("%c [%s] %s", diff, op->installer, _plan_kinds[op->kind]);
+    if (PO_Remove == op->kind && 2 == op->args.len)
+        printf(" -r");
+    for (size_t i = 0; i < op->args.len; i += 1) {
+        if (PO_Remove != op->kind || 0 == i)
+            printf((PO_Copy == op->kind || PO_Link == op->kind) && 1 == i ? " -> %s" : " %s",
+                   op->args.items[i]);
+    }
+    if (PO_Exec == op->kind)
+        printf(" (in %s)", op->cwd);
+    printf("\n");
 }
 
-bool compile_so(Strings cfiles, char *so, Strings cflags, Strings lflags)
+// Marks operations, that are superseded within their batch: repeated mkdirs
+// and copies overwritten by a later copy. Batches are runs of mkdir and copy
+// operations, they end before a remove, a link, a command and a copy reading a
+// file written in the same batch. Returns the batch of every operation.
+static Sizes _plan_optimize(_Plan_Ops ops, bool *drop)
 {
-    bool ok = true;
-
-    // TODO: Maybe a generic function for a use-case like this
-    // TODO: Remove this up-to-date check from this function
-    if (exists(so, FF_File)) {
-        int latest_cfile = 0;
-        struct stat s;
-        for (size_t i = 0; i < cfiles.len; i += 1) {
-            fail_if(-1 == stat(cfiles.items[i], &s),
-                    "Failed to stat file %s:", cfiles.items[i]);
-            int modified = s.st_mtime;
-            if (modified > latest_cfile)
-                latest_cfile = modified;
-        }
-        fail_if(-1 == stat(so, &s),
-                    "Failed to stat so-file %s:", so);
-        if (latest_cfile < s.st_mtime) {
-            msg(LL_Debug, "%s needs no rebuild", so);
-            return true;
+    Sizes batches = zero(Sizes);
+    _da_scoped(&batches);
+    _Index dirs = zero(_Index), dsts = zero(_Index);
+    size_t batch = 0;
+    for (size_t i = 0; i < ops.len; i += 1) {
+        const _Plan_Op *op = &ops.items[i];
+        const bool barrier = PO_Remove == op->kind || PO_Link == op->kind || PO_Exec == op->kind
+            || (PO_Copy == op->kind && _index_get(&dsts, op->args.items[0]));
+        if (barrier && (dirs.len || dsts.len)) {
+            _index_free(&dirs);
+            _index_free(&dsts);
+            batch += 1;
+        }
+        if (PO_Mkdir == op->kind) {
+            drop[i] = NULL != _index_get(&dirs, op->args.items[0]);
+            _index_add(&dirs, op->args.items[0], i);
+        } else if (PO_Copy == op->kind) {
+            _Index_Entry *e = _index_get(&dsts, op->args.items[1]);
+            if (e)
+                drop[e->value] = true;
+            _index_add(&dsts, op->args.items[1], i);
+            _index_get(&dsts, op->args.items[1])->value = i;
         }
+        da_append(&batches, batch);
+        if (barrier)
+            batch += 1;
     }
+    _index_free(&dirs);
+    _index_free(&dsts);
+    return batches;
+}
 
-    Strings objs = zero(Strings);
-    for (size_t i = 0; i < cfiles.len; i += 1) {
-        char *obj;
-        asprintf(&obj, "%s%s", cfiles.items[i], ".o");
-        da_append(&objs, obj);
-        
-        // TODO: also use passed cflags and lflags
-        ok = compile(cfiles.items[i], obj, strs("-c", "-fPIC"), zero(Strings));
-        if (!ok)
-            goto exit;
+// Executes the mkdir and copy operations of `pending` as one Cp_Plan. Without
+// dry mode, operations without effect are dropped right before, so earlier
+// batches are taken into account.
+static size_t _plan_flush(_Plan_Ops ops, Sizes *pending, _Index *touched, size_t *dropped)
+{
+    Cp_Plan plan = zero(Cp_Plan);
+    for (size_t j = 0; j < pending->len; j += 1) {
+        const _Plan_Op *op = &ops.items[pending->items[j]];
+        char *path = _plan_path(op);
+        const char diff = _plan_diff(op, touched);
+        if ('=' == diff) {
+            *dropped += 1;
+            continue;
+        }
+        _plan_print(op, diff);
+        if (state.dry) {
+            _index_add(touched, path, op->kind);
+            _index_get(touched, path)->value = op->kind;
+            continue;
+        }
+        char *dup = strdup(path);
+        if (!dup)
+            die("Allocation failed:");
+        if (PO_Mkdir == op->kind) {
+            size_t depth = 0;
+            for (const char *c = path; *c; c += 1)
+                depth += '/' == *c;
+            da_append(&plan.dirs, dup);
+            da_append(&plan.depths, depth);
+        } else {
+            da_append(&plan.srcs, op->args.items[0]);
+            da_append(&plan.dsts, dup);
+        }
     }
+    pending->len = 0;
 
-    Cmd cmd = zero(Cmd);
-    da_append(&cmd, state.cc);
-    da_expand(&cmd, state.cflags);
-    if (cflags.len)
-        da_expand(&cmd, cflags);
-    da_expand(&cmd, strs("-shared", "-o", so));
-    da_expand(&cmd, objs);
-    if (lflags.len)
-        da_expand(&cmd, lflags);
-
-    Buffer err = zero(Buffer);
-    ok = !cmd_execw(cmd, NULL, NULL, &err);
-    if (!ok)
-        msg(LL_Error, "Compilation of '%s' failed:\n%.*s", so, (int) err.len, err.items);
-
-exit:
-    if (objs.items) {
-        register_ptrs((void**) objs.items, objs.len);
-        register_ptr(objs.items);
+    ssize_t errors = -1;
+    if (state.io_uring && (plan.dirs.len || plan.srcs.len)) {
+        errors = _cp_plan_uring(&plan);
+        if (-1 == errors)
+            state.io_uring = false;
     }
-    return ok;
+    if (-1 == errors)
+        errors = _cp_plan_sync(&plan);
+    _cp_plan_free(&plan);
+    return errors;
 }
 
-// :net :http
-
-Buffer http_get(char *url)
+// Creates an in memory plan, that is only printed.
+Fd plan_memfd()
 {
-    todo();
+    Fd fd = memfd_create("sys-setup-plan", MFD_CLOEXEC);
+    if (INVALID_FILE_DES == fd || -1 == fcntl(fd, F_SETFL, O_APPEND)) {
+        msg(LL_Warn, "Failed to create the plan, it is not printed:");
+        if (INVALID_FILE_DES != fd)
+            close(fd);
+        return INVALID_FILE_DES;
+    }
+    return fd;
 }
 
-Buffer http_post(char *url, Buffer data)
+// Applies the plan, in dry mode it is only printed. Returns the number of
+// errors, stops at the first failing command.
+size_t run_plan(_Plan_Ops ops)
 {
-    todo();
-}
+    bool *drop = calloc(ops.len + 1, sizeof(*drop));
+    if (!drop)
+        die("Allocation failed:");
+    Sizes batches = _plan_optimize(ops, drop);
+    // Only filled in dry mode, otherwise the live system reflects the changes
+    _Index touched = zero(_Index);
+    Sizes pending = zero(Sizes);
+    size_t errors = 0;
+    size_t dropped = 0;
+    const char *installer = state.installer;
+
+    for (size_t i = 0; i <= ops.len; i += 1) {
+        if (pending.len && (i == ops.len || batches.items[i] != batches.items[pending.items[0]]))
+            errors += _plan_flush(ops, &pending, &touched, &dropped);
+        if (i == ops.len)
+            break;
+        const _Plan_Op *op = &ops.items[i];
+        if (drop[i]) {
+            dropped += 1;
+            continue;
+        }
+        if (PO_Mkdir == op->kind || PO_Copy == op->kind) {
+            da_append(&pending, i);
+            continue;
+        }
 
-// :main :handler
+        const char diff = _plan_diff(op, &touched);
+        if ('=' == diff) {
+            dropped += 1;
+            continue;
+        }
+        _plan_print(op, diff);
+        if (state.dry) {
+            if (PO_Remove == op->kind || PO_Link == op->kind) {
+                _index_add(&touched, _plan_path(op), op->kind);
+                _index_get(&touched, _plan_path(op))->value = op->kind;
+            }
+            continue;
+        }
 
-// If i->handle is not NULL this is equivalent to reloading the installer.
-__attribute__((nonnull))
-bool load_installer(char *path, char *name, Installer *i)
-{
-    msg(LL_Debug, "Loading: %s at %s", name, path);
-    if (i->handle) {
-        dlclose(i->handle);
+        if (PO_Link == op->kind) {
+            if (!_link_replace(op->args.items[0], op->args.items[1], false))
+                errors += 1;
+            continue;
+        }
+
+        if (PO_Remove == op->kind) {
+            const bool tree = 2 == op->args.len;
+            if (tree ? -1 == nftw(op->args.items[0], _rm_entry, 16, FTW_DEPTH | FTW_PHYS)
+                     : -1 == remove(op->args.items[0])) {
+                if (!tree)
+                    msg(LL_Error, "Failed to remove '%s':", op->args.items[0]);
+                errors += 1;
+            }
+            continue;
+        }
+        if (-1 == chdir(op->cwd)) {
+            msg(LL_Error, "Failed to change into '%s':", op->cwd);
+            errors += 1;
+            break;
+        }
+        state.installer = op->installer;
+        const int code = cmd_exec(op->args);
+        state.installer = installer;
+        if (0 != code) {
+            msg(LL_Error, "Command of %s failed with %d, not applying the rest", op->installer, code);
+            errors += 1;
+            break;
+        }
     }
-    *i = zero(Installer);
-    i->path = strdup(path);
-    register_ptr(i->path);
-    i->name = strdup(name);
-    register_ptr(i->name);
+    printf(":: Plan: %zu operations, %zu without effect\n", ops.len, dropped);
 
-    i->handle = dlopen(i->path, RTLD_NOW);
-    fail_if(!i->handle, "Failed to open installer: %s", dlerror());
-    i->setup = dlsym(i->handle, "setup");
-    i->run_install = dlsym(i->handle, "run_install");
-    fail_if(!i->run_install, "Failed to find 'run_install' function: %s", dlerror());
-    i->cleanup = dlsym(i->handle, "cleanup");
+    _index_free(&touched);
+    if (pending.items)
+        _free(pending.items);
+    _free(drop);
+    return errors;
+}
+
+// :daemon
+// `--daemon` serves the requests of `--connect` clients on a Unix socket. It
+// keeps the compiled installers and the trees scanned by earlier requests
+// loaded, inotify drops them once their files change. Every request runs in a
+// forked worker, that inherits all of it and writes its output to the client.
+// A request is a single line: `run|dry|list [INSTALLER...]`. The output ends
+// with a NUL byte followed by the exit status of the request.
 
+#define DAEMON_REQUEST_MAX 4096
+
+// Every user has one daemon at $XDG_RUNTIME_DIR/sys-setup.sock
+static bool _daemon_addr(struct sockaddr_un *addr)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || '\0' == *dir) {
+        msg(LL_Error, "XDG_RUNTIME_DIR is not set, the daemon has no socket");
+        return false;
+    }
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    const int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/sys-setup.sock", dir);
+    if (len < 0 || (size_t) len >= sizeof(addr->sun_path)) {
+        msg(LL_Error, "The socket path inside of '%s' is too long", dir);
+        return false;
+    }
     return true;
 }
 
-Installers available_installers()
+// Sends `verb` and the installers in `argv` to the daemon and copies its output
+// to stdout. Returns the exit status of the request, which is 1 if the daemon
+// could not be reached.
+int daemon_request(const char *verb, const int argc, char **argv)
 {
-    Installers installers = zero(Installers);
-
-    Ls_Files ls_res;
-    if (!ls(".", FF_Directory, &ls_res))
-        die("ls failed:");
-
-    Buffer source = zero(Buffer);
-    Buffer target = zero(Buffer);
-    static const char *install_c = "/install.c";
-    static const char *libinstaller = "/libinstaller.so";
-    size_t failures = 0;
-    for (size_t i = 0; i < ls_res.len; i += 1) {
-        if (ls_res.items[i].name[0] == '.') {
-            // Hidden must be passed to ls via FF_Hidden, this therefore only serves
-            // for the peace of mind.
-            unreachable();
+    struct sockaddr_un addr;
+    if (!_daemon_addr(&addr))
+        return 1;
+
+    char req[DAEMON_REQUEST_MAX];
+    size_t len = snprintf(req, sizeof(req), "%s", verb);
+    for (int i = optind; i < argc && len < sizeof(req); i += 1)
+        len += snprintf(req + len, sizeof(req) - len, " %s", argv[i]);
+    if (len + 1 >= sizeof(req)) {
+        msg(LL_Error, "The request is too long");
+        return 1;
+    }
+    req[len++] = '\n';
+
+    Fd fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (INVALID_FILE_DES == fd || -1 == connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        msg(LL_Error, "Failed to connect to the daemon at %s:", addr.sun_path);
+        if (INVALID_FILE_DES != fd)
+            close(fd);
+        return 1;
+    }
+    bool ok = write_all(fd, (Buffer) { req, len, len });
+    shutdown(fd, SHUT_WR);
+    // The last two bytes are held back, they might be the status
+    char buf[16 * 1024];
+    size_t held = 0;
+    ssize_t n = 0;
+    while (ok && 0 < (n = read(fd, buf + held, sizeof(buf) - held))) {
+        held += n;
+        if (held > 2) {
+            ok = write_all(STDOUT_FILENO, (Buffer) { buf, held - 2, held - 2 });
+            memmove(buf, buf + held - 2, 2);
+            held = 2;
         }
+    }
+    if (!ok || -1 == n)
+        msg(LL_Error, "Talking to the daemon failed:");
+    close(fd);
+    if (!ok || -1 == n)
+        return 1;
+    if (2 != held || '\0' != buf[0]) {
+        write_all(STDOUT_FILENO, (Buffer) { buf, held, held });
+        msg(LL_Error, "The daemon did not finish the request");
+        return 1;
+    }
+    return (unsigned char) buf[1];
+}
 
-        source.len = 0;
-        target.len = 0;
+// Reads the request line of a client into `line`, without the newline.
+static bool _daemon_read(Fd client, char *line, size_t size)
+{
+    size_t len = 0;
+    while (len + 1 < size) {
+        ssize_t n = read(client, line + len, size - 1 - len);
+        if (-1 == n && EINTR == errno)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        if (memchr(line + len - n, '\n', n))
+            break;
+    }
+    line[len] = '\0';
+    line[strcspn(line, "\n")] = '\0';
+    return 0 < len;
+}
 
-        da_append_many(&source, ls_res.items[i].name, strlen(ls_res.items[i].name));
-        da_append_many(&source, install_c, strlen(install_c) + 1); // +1 copies \0
-        if (!exists(source.items, FF_File)) // no installer, so we ignore it
+// Picks up installers created since the daemon started.
+static void _daemon_discover(Fd inotify, _Watches *watches)
+{
+    Installers found = discover_installers();
+    for (size_t i = 0; i < found.len; i += 1) {
+        if (-1 != find_installer(found.items[i].name))
             continue;
+        msg(LL_Info, "Found new installer %s", found.items[i].name);
+        da_append(&state.available, ((Installer) {
+            .name = _keep(found.items[i].name),
+            .source = _keep(found.items[i].source),
+        }));
+        _watch_dir(inotify, watches, state.available.items[state.available.len - 1].name,
+                   state.available.len - 1, FF_Directory);
+        _watch_deps(inotify, watches, state.available.len - 1);
+    }
+    if (found.items)
+        _free(found.items);
+}
 
-        da_append_many(&target, ls_res.items[i].name, strlen(ls_res.items[i].name));
-        da_append_many(&target, libinstaller, strlen(libinstaller) + 1); // +1 copies \0
+// Runs the request of `client` in a worker. Its trees, that missed the cache,
+// are scanned again afterwards, so the next request finds them.
+static void _daemon_serve(Fd client, Fd inotify, _Watches *watches)
+{
+    char line[DAEMON_REQUEST_MAX];
+    const struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!_daemon_read(client, line, sizeof(line))) {
+        msg(LL_Warn, "Failed to read a request:");
+        return;
+    }
+    msg(LL_Info, "Request: %s", line);
+
+    // Until the worker takes over, errors are reported to the client
+    _log_flush();
+    const Fd err = dup(STDERR_FILENO);
+    dup2(client, STDERR_FILENO);
+
+    Strings words = zero(Strings);
+    _da_scoped(&words);
+    for (char *w = strtok(line, " \t"); w; w = strtok(NULL, " \t"))
+        da_append(&words, w);
+    const char *verb = words.len ? words.items[0] : "";
+    const bool list = 0 == strcmp(verb, "list");
+    const bool dry = 0 == strcmp(verb, "dry");
+    bool ok = list || dry || 0 == strcmp(verb, "run");
+    if (!ok)
+        msg(LL_Error, "Unknown request '%s', expected run, dry or list", verb);
 
-        // TODO: Check here if the installer needs to be rebuild not in the compile_so
-        if (!compile_so(strs(source.items), target.items, zero(Strings), zero(Strings))) {
-            failures += 1;
-            continue;
+    _daemon_discover(inotify, watches);
+    Sizes to_run = zero(Sizes);
+    _da_scoped(&to_run);
+    for (size_t i = 1; ok && i < words.len; i += 1) {
+        ssize_t idx = find_installer(words.items[i]);
+        if (-1 == idx) {
+            msg(LL_Error, "No installer found for: %s", words.items[i]);
+            ok = false;
+        } else {
+            da_append(&to_run, (size_t) idx);
         }
+    }
+    if (ok && 1 == words.len) {
+        for (size_t i = 0; i < state.available.len; i += 1)
+            da_append(&to_run, i);
+    }
+    qsort(to_run.items, to_run.len, sizeof(*to_run.items), _sizecmp);
+    // Loaded by the daemon, so they stay warm for the following requests
+    if (ok && !list) {
+        materialize_needed(to_run);
+        // Compiling may have changed the depfiles
+        for (size_t i = 0; i < to_run.len; i += 1)
+            _watch_deps(inotify, watches, to_run.items[i]);
+    }
 
-        Installer inst = zero(Installer);
-        if (!load_installer(target.items, ls_res.items[i].name, &inst)) {
-            failures += 1;
-            continue;
+    Fd report[2] = { INVALID_FILE_DES, INVALID_FILE_DES };
+    if (ok && -1 == pipe2(report, O_CLOEXEC)) {
+        msg(LL_Error, "Failed to create pipe:");
+        ok = false;
+    }
+    Pid id = -1;
+    int status = 1;
+    if (ok) {
+        fflush(stdout);
+        id = fork();
+        if (id < 0)
+            msg(LL_Error, "Failed to fork a worker:");
+    }
+    if (0 == id) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(client, STDOUT_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+        close(report[PIPE_READ]);
+        state.tree_report = report[PIPE_WRITE];
+        state.log.tty = false;
+        _trace_process("request");
+
+        if (list) {
+            printf("Available installers:\n");
+            for (size_t i = 0; i < state.available.len; i += 1)
+                printf("- %s\n", state.available.items[i].name);
+            status = 0;
+        } else {
+            state.dry = dry;
+            // Every request is a run of its own
+            clock_gettime(CLOCK_REALTIME_COARSE, &state.started);
+            if (dry) {
+                msg(LL_Info, "Running in dry mode");
+                state.plan_fd = plan_memfd();
+            }
+            size_t failures = run_installers(to_run);
+            if (0 < failures)
+                msg(LL_Error, "%zu installer%s did not finish",
+                    failures, 1 == failures ? "" : "s");
+            _Plan_Ops ops = zero(_Plan_Ops);
+            if (INVALID_FILE_DES != state.plan_fd && load_plan(state.plan_fd, &ops))
+                failures += run_plan(ops);
+            _log_flush();
+            printf(":: Finished\n");
+            status = 0 < failures;
         }
-        
-        da_append(&installers, inst);
+        _log_flush();
+        fflush(stdout);
+        _exit(status);
     }
 
-    if (0 < failures)
-        msg(LL_Warn, "Failed to load %zu installer%s",
-            failures, 1 == failures ? "" : "s");
-
-    _free(source.items);
-    _free(target.items);
-
-    return installers;
+    Buffer reported = zero(Buffer);
+    if (INVALID_FILE_DES != report[PIPE_WRITE]) {
+        close(report[PIPE_WRITE]);
+        // Ends once the worker exited
+        reported = read_all(report[PIPE_READ]);
+        close(report[PIPE_READ]);
+    }
+    int exited = 0;
+    if (0 < id && -1 == waitpid(id, &exited, 0))
+        msg(LL_Warn, "Waiting for the worker failed:");
+    _log_flush();
+    dup2(err, STDERR_FILENO);
+    close(err);
+    if (0 < id)
+        status = WIFEXITED(exited) ? WEXITSTATUS(exited) : 1;
+    const char trailer[2] = { '\0', (char) status };
+    if (!write_all(client, (Buffer) { (char*) trailer, 2, 2 }))
+        msg(LL_Warn, "Failed to send the status to the client:");
+
+    // Watched first, so no change gets lost in between
+    da_append(&reported, '\0');
+    for (char *l = strtok(reported.items, "\n"); l; l = strtok(NULL, "\n")) {
+        int ff;
+        size_t max_depth;
+        int offset = 0;
+        if (2 != sscanf(l, "%d\t%zu\t%n", &ff, &max_depth, &offset) || 0 == offset)
+            continue;
+        _watch_dir(inotify, watches, l + offset, SIZE_MAX, FF_Directory | FF_Hidden);
+        if (!_tree_cache_add(l + offset, ff, max_depth))
+            msg(LL_Warn, "Failed to cache the tree of %s", l + offset);
+    }
 }
 
-// sets name and path in ctx if inst->setup is defined
-bool run_installer(Installer *inst, Context ctx)
+// Serves requests until SIGINT or SIGTERM is received. Returns false if the
+// socket could not be set up.
+bool run_daemon()
 {
-    if (inst->setup) {
-        ctx.name = inst->name;
-        ctx.path = inst->path;
-        Setup_Result res = inst->setup(ctx);
+    struct sockaddr_un addr;
+    if (!_daemon_addr(&addr))
+        return false;
+    Fd probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool running = INVALID_FILE_DES != probe
+        && 0 == connect(probe, (struct sockaddr*) &addr, sizeof(addr));
+    if (INVALID_FILE_DES != probe)
+        close(probe);
+    if (running) {
+        msg(LL_Error, "A daemon is already listening on %s", addr.sun_path);
+        return false;
+    }
+    // Left behind by a daemon, that was killed
+    unlink(addr.sun_path);
+
+    Fd sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (INVALID_FILE_DES == sock
+            || -1 == bind(sock, (struct sockaddr*) &addr, sizeof(addr))
+            || -1 == listen(sock, 16)) {
+        msg(LL_Error, "Failed to listen on %s:", addr.sun_path);
+        if (INVALID_FILE_DES != sock)
+            close(sock);
+        return false;
+    }
+    Fd inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (INVALID_FILE_DES == inotify) {
+        msg(LL_Error, "Failed to initialize inotify:");
+        close(sock);
+        unlink(addr.sun_path);
+        return false;
+    }
+    _Watches watches = zero(_Watches);
+    for (size_t i = 0; i < state.available.len; i += 1) {
+        _watch_dir(inotify, &watches, state.available.items[i].name, i, FF_Directory);
+        _watch_deps(inotify, &watches, i);
+    }
 
-        // TODO: should res.ok take priority over res.request_reload?
-        if (res.request_reload) {
-            ctx.reloaded = true;
-            ctx.reload_data = res.reload_data;
-            if (!load_installer(inst->path, inst->name, inst)) {
-                msg(LL_Error, "Installer reload failed");
-                return false;
-            }
-            return run_installer(inst, ctx);
+    // No SA_RESTART, so poll returns once the user is done
+    struct sigaction sa = { .sa_handler = _watch_interrupt };
+    struct sigaction old_int, old_term, old_pipe;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    // Clients may go away at any time
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &old_pipe);
+
+    _log_flush();
+    printf(":: Listening on %s\n", addr.sun_path);
+    fflush(stdout);
+    while (!_watch_stop) {
+        struct pollfd pfds[] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = inotify, .events = POLLIN },
+        };
+        if (-1 == poll(pfds, 2, -1)) {
+            if (EINTR == errno)
+                continue;
+            msg(LL_Error, "Waiting for requests failed:");
+            break;
         }
 
-        if (!res.ok) {
-            msg(LL_Error, "Setup for installer %s failed", inst->name);
-            return false;
+        const size_t scope = scope_push();
+        if (pfds[1].revents & POLLIN) {
+            bool *changed = calloc(state.available.len, 2 * sizeof(bool));
+            if (!changed)
+                die("Allocation failed:");
+            bool *rebuild = changed + state.available.len;
+            while (0 < poll(&pfds[1], 1, 0) && _watch_read(inotify, &watches, changed, rebuild, false));
+            // Reloaded with the next request, that needs it
+            for (size_t i = 0; i < state.available.len; i += 1) {
+                Installer *inst = &state.available.items[i];
+                if (!rebuild[i] || !inst->run_install)
+                    continue;
+                msg(LL_Info, "Unloading %s, its sources changed", inst->name);
+                unload_installer(inst);
+                inst->run_install = NULL;
+            }
+            _free(changed);
+        }
+        if (pfds[0].revents & POLLIN) {
+            Fd client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+            if (INVALID_FILE_DES != client) {
+                _daemon_serve(client, inotify, &watches);
+                close(client);
+            } else if (EINTR != errno) {
+                msg(LL_Warn, "Failed to accept a client:");
+            }
         }
+        scope_pop(scope);
     }
 
-    bool ok = inst->run_install();
-
-    if (inst->cleanup)
-        inst->cleanup();
-    
-    return ok;
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    _watch_stop = 0;
+    if (watches.items)
+        _free(watches.items);
+    close(inotify);
+    close(sock);
+    unlink(addr.sun_path);
+    return true;
 }
 
 // Steps:
@@ -975,7 +6314,6 @@ bool run_installer(Installer *inst, Context ctx)
 // 3. cleanup
 //
 // IDEAS:
-// - dwnld(url, path) requests url and stores result in the file at path
 // - add support for package managers: Instead of having to call pacman the installer
 //   can simply request the installation of some package or query some information
 //   (version, ...)
@@ -989,38 +6327,168 @@ struct arg_options {
 
     bool list;
     bool confirm;
+    size_t jobs;
+    size_t parallel;
+    Backend backend;
+    bool no_io_uring;
+    char *pkg_db;
+    size_t sync_ttl;
+    bool refresh;
+    bool force;
+    // File the plan of a dry run is written to
+    char *plan;
+    // File of a plan, that is applied instead of running installers
+    char *apply;
+    // File the Chrome trace is written to
+    char *trace;
+    // Directory of the JSON lines logs
+    char *log_dir;
+    // Rerun the installers whenever their files change
+    bool watch;
+    // Serve requests on the daemon socket
+    bool daemon;
+    // Pass the request on to the daemon
+    bool connect;
 };
 
+// Returns `$XDG_CACHE_HOME/sys-setup` (falling back to `~/.cache/sys-setup`) and
+// creates it if necessary. `NULL` if there is no usable cache directory.
+char *cache_dir()
+{
+    char *dir = NULL;
+    if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME"))
+        dir = concat(getenv("XDG_CACHE_HOME"), "/sys-setup");
+    else if (getenv("HOME") && *getenv("HOME"))
+        dir = concat(getenv("HOME"), "/.cache/sys-setup");
+
+    if (!dir || !_mkdirs(dir, 0755)) {
+        msg(LL_Warn, "No cache directory available, caching is disabled");
+        return NULL;
+    }
+    return dir;
+}
+
+char *state_dir()
+{
+    char *dir = NULL;
+    if (getenv("XDG_STATE_HOME") && *getenv("XDG_STATE_HOME"))
+        dir = concat(getenv("XDG_STATE_HOME"), "/sys-setup");
+    else if (getenv("HOME") && *getenv("HOME"))
+        dir = concat(getenv("HOME"), "/.local/state/sys-setup");
+
+    if (!dir || !_mkdirs(dir, 0755)) {
+        msg(LL_Warn, "No state directory available, the journal is disabled");
+        return NULL;
+    }
+    return dir;
+}
+
 void init_state(const struct arg_options *opts)
 {
-    state.min_level = opts->ll;
+    log_min_level = opts->ll;
     state.log_loc = opts->log_loc;
+    if (opts->log_dir && !_mkdirs(opts->log_dir, 0755))
+        die("Failed to create log directory '%s'", opts->log_dir);
+    state.log_dir = opts->log_dir;
     state.ptrs = zero(typeof(state.ptrs));
+    // The root scope lives until cleanup_state
+    scope_push();
     state.cc = "gcc";
     state.cflags = strs("-ggdb");
-    // NOTE: dry is not set yet so the compilation commands will actually go through
-    state.available = available_installers();
+    state.jobs = opts->jobs;
+    state.parallel = opts->parallel;
+    state.cache_dir = cache_dir();
+    state.state_dir = state_dir();
+    state.force = opts->force;
+    state.io_uring = !opts->no_io_uring;
+    state.pkg_db = strdup(opts->pkg_db);
+    if (!state.pkg_db)
+        die("Allocation failed:");
+    state.sync_ttl = opts->sync_ttl;
+    // Coarse, so it is not after file timestamps taken right after it
+    clock_gettime(CLOCK_REALTIME_COARSE, &state.started);
+    state.refresh = opts->refresh;
+    state.backend = opts->backend;
+    // Opened first, so discovery is traced as well
+    state.trace_fd = INVALID_FILE_DES;
+    if (opts->trace) {
+        state.trace_fd = open(opts->trace, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (INVALID_FILE_DES == state.trace_fd || 2 != write(state.trace_fd, "[\n", 2))
+            die("Failed to open trace '%s':", opts->trace);
+        _trace_process("sys-setup");
+    }
+    if (BE_Gcc != state.backend && !load_libtcc()) {
+        if (BE_Tcc == state.backend)
+            msg(LL_Warn, "libtcc is not available, falling back to %s", state.cc);
+        state.backend = BE_Gcc;
+    } else if (BE_Auto == state.backend) {
+        state.backend = BE_Tcc;
+    }
+    // Installers are only compiled once they are needed
+    state.available = discover_installers();
     state.dry = opts->dry;
     state.dry_allow_commands = opts->dry_commands;
+
+    // Without `--plan` the plan is kept in memory, it is only printed
+    state.plan_fd = INVALID_FILE_DES;
+    if (state.dry && opts->plan) {
+        state.plan_fd = open(opts->plan, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (INVALID_FILE_DES == state.plan_fd)
+            die("Failed to open plan '%s':", opts->plan);
+    } else if (state.dry && !opts->apply) {
+        state.plan_fd = plan_memfd();
+    }
+    state.tree_report = INVALID_FILE_DES;
 }
 
 void cleanup_state()
 {
-    for (size_t i = 0; i < state.available.len; i += 1) {
-        if (state.available.items[i].handle)
-            dlclose(state.available.items[i].handle);
-    }
-    msg(LL_Debug, "Cleaning state: %zu pointers", state.ptrs.len);
-    if (state.ptrs.items) {
-        qsort(state.ptrs.items, state.ptrs.len, sizeof(void*), _ptrcmp);
-        for (size_t i = 0; i < state.ptrs.len; i += 1) {
-            if (i > 0 && state.ptrs.items[i - 1] == state.ptrs.items[i])
-                continue;
-            if (state.ptrs.items[i])
-                _free(state.ptrs.items[i]);
-        }
-        _free(state.ptrs.items);
+    for (size_t i = 0; i < state.available.len; i += 1)
+        unload_installer(&state.available.items[i]);
+    if (state.tcc.handle)
+        dlclose(state.tcc.handle);
+    _pkg_index_free(&state.pkgs);
+    if (state.pkg_db)
+        _free(state.pkg_db);
+    _exe_index_free(&state.exes);
+    _journal_free(&state.journal);
+    if (INVALID_FILE_DES != state.plan_fd)
+        close(state.plan_fd);
+    if (INVALID_FILE_DES != state.trace_fd) {
+        // Every event ends with a comma, so the array is closed by one without
+        char end[128];
+        int len = snprintf(end, sizeof(end), "{\"name\": \"process_name\", \"ph\": \"M\", "
+                           "\"pid\": %d, \"args\": {\"name\": \"sys-setup\"}}]\n", getpid());
+        if (len != write(state.trace_fd, end, len))
+            msg(LL_Warn, "Failed to finish the trace:");
+        close(state.trace_fd);
     }
+    for (size_t i = 0; i < state.traced.len; i += 1) {
+        _free(state.traced.items[i].cmd);
+        _free(state.traced.items[i].name);
+    }
+    if (state.traced.items)
+        _free(state.traced.items);
+    _tree_cache_invalidate(NULL);
+    if (state.trees.items)
+        _free(state.trees.items);
+    _track_reset();
+    if (state.cmd_periods.items)
+        _free(state.cmd_periods.items);
+    msg(LL_Debug, "Cleaning state: %zu pointers", state.ptrs.len + state.kept.len);
+    scope_pop(0);
+    if (state.arena)
+        free(state.arena);
+    if (state.spare)
+        free(state.spare);
+    for (size_t i = 0; i < state.kept.len; i += 1)
+        _free(state.kept.items[i]);
+    if (state.kept.items)
+        _free(state.kept.items);
+    if (state.ptrs.items)
+        _free(state.ptrs.items);
+    if (state.scopes.items)
+        _free(state.scopes.items);
 }
 
 struct arg_options parse_args(const int argc, char **argv)
@@ -1029,7 +6497,14 @@ struct arg_options parse_args(const int argc, char **argv)
     struct arg_options opts = {
         .ll = LL_Warn,
         .log_loc = false,
+        .jobs = 1,
+        .parallel = 1,
+        .pkg_db = "/var/lib/pacman",
+        .sync_ttl = 60 * 60,
     };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0)
+        opts.jobs = (size_t) cpus;
     const char *prog = *argv;
     bool verbosity_set = false;
 
@@ -1044,9 +6519,24 @@ struct arg_options parse_args(const int argc, char **argv)
             { "confirm",         no_argument,       0, 'c' },
             { "dry",             no_argument,       0, 'd' },
             { "dry-commands",    no_argument,       0, 'D' },
+            { "jobs",            required_argument, 0, 'j' },
+            { "parallel",        required_argument, 0, 'p' },
+            { "backend",         required_argument, 0, 'b' },
+            { "no-io-uring",     no_argument,       0, 'U' },
+            { "pkg-db",          required_argument, 0, 'P' },
+            { "sync-ttl",        required_argument, 0, 'T' },
+            { "refresh",         no_argument,       0, 'R' },
+            { "force",           no_argument,       0, 'f' },
+            { "plan",            required_argument, 0, 'n' },
+            { "apply",           required_argument, 0, 'a' },
+            { "trace",           required_argument, 0, 't' },
+            { "log-dir",         required_argument, 0, 'o' },
+            { "watch",           no_argument,       0, 'w' },
+            { "daemon",          no_argument,       0, 'S' },
+            { "connect",         no_argument,       0, 'C' },
             { 0,                 0,                 0,  0  },
         };
-        int c = getopt_long(argc, argv, "hv;LlcdD",
+        int c = getopt_long(argc, argv, "hv;LlcdDj:p:b:UP:T:Rfn:a:t:o:wSC",
                             options, &opt_idx);
 
         if (c == -1)
@@ -1071,6 +6561,43 @@ struct arg_options parse_args(const int argc, char **argv)
                     "  -D, --dry-commands       - Will allow to execute commands while in dry mode, normally\n"
                     "                             such commands would only be logged and not executed.\n"
                     "                             Note that this might lead to changes on your system.\n"
+                    "  -j, --jobs=N             - Compile up to N installers concurrently.\n"
+                    "                             By default: number of online CPUs\n"
+                    "  -p, --parallel=N         - Run up to N independent installers concurrently.\n"
+                    "                             Installers still wait for their dependencies.\n"
+                    "                             By default: 1\n"
+                    "  -b, --backend=BACKEND    - How installers are compiled: auto, gcc, tcc.\n"
+                    "                             'tcc' compiles in memory using libtcc, 'auto' uses\n"
+                    "                             it if available and gcc otherwise.\n"
+                    "                             By default: auto\n"
+                    "  -U, --no-io-uring        - Do not use io_uring to copy directories.\n"
+                    "  -P, --pkg-db=DIR         - Root of the pacman database, installed packages are\n"
+                    "                             read from DIR/local.\n"
+                    "                             By default: /var/lib/pacman\n"
+                    "  -T, --sync-ttl=SECONDS   - Do not sync packages again if the last sync is less\n"
+                    "                             than SECONDS old. Packages are synced at most once per run.\n"
+                    "                             By default: 3600\n"
+                    "  -R, --refresh            - Sync packages even if the last sync is recent.\n"
+                    "  -f, --force              - Run journaled steps even if they succeeded before with\n"
+                    "                             the same inputs.\n"
+                    "  -n, --plan=FILE          - Like '--dry', but also writes the recorded operations\n"
+                    "                             to FILE.\n"
+                    "  -a, --apply=FILE         - Apply the plan in FILE instead of running installers.\n"
+                    "                             Operations without effect are dropped. Together with\n"
+                    "                             '--dry' the plan is only compared with the system.\n"
+                    "  -t, --trace=FILE         - Write a timeline of the run to FILE as Chrome trace\n"
+                    "                             events, e.g. for https://ui.perfetto.dev.\n"
+                    "  -o, --log-dir=DIR        - Also write every logged message as JSON lines to\n"
+                    "                             DIR/<installer>.jsonl (DIR/sys-setup.jsonl outside of\n"
+                    "                             installers).\n"
+                    "  -w, --watch              - Keep running and rerun an installer whenever a file in\n"
+                    "                             its directory changes, recompiling it if its install.c\n"
+                    "                             or a header changed. Stop with Ctrl-C.\n"
+                    "  -S, --daemon             - Serve requests on $XDG_RUNTIME_DIR/sys-setup.sock, keeping\n"
+                    "                             installers and scanned directories loaded until they\n"
+                    "                             change. Stop with Ctrl-C.\n"
+                    "  -C, --connect            - Let the daemon run the installers. Only --dry and\n"
+                    "                             --list-installers are passed on.\n"
                     , prog
                 );
                 opts.exit = true;
@@ -1118,6 +6645,91 @@ struct arg_options parse_args(const int argc, char **argv)
                 opts.dry_commands = true;
                 break;
 
+            case 'j': { // :jobs
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1)
+                    die("Invalid number of jobs: %s", optarg);
+                opts.jobs = (size_t) n;
+                break;
+            }
+
+            case 'p': { // :parallel
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1)
+                    die("Invalid number of parallel installers: %s", optarg);
+                opts.parallel = (size_t) n;
+                break;
+            }
+
+            case 'b': // :backend
+                if (strcmp(optarg, "auto") == 0)
+                    opts.backend = BE_Auto;
+                else if (strcmp(optarg, "gcc") == 0)
+                    opts.backend = BE_Gcc;
+                else if (strcmp(optarg, "tcc") == 0)
+                    opts.backend = BE_Tcc;
+                else
+                    die("Unknown backend: %s", optarg);
+                break;
+
+            case 'U': // :no-io-uring
+                opts.no_io_uring = true;
+                break;
+
+            case 'P': // :pkg-db
+                opts.pkg_db = optarg;
+                break;
+
+            case 'T': { // :sync-ttl
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 0)
+                    die("Invalid sync TTL: %s", optarg);
+                opts.sync_ttl = (size_t) n;
+                break;
+            }
+
+            case 'R': // :refresh
+                opts.refresh = true;
+                break;
+
+            case 'f': // :force
+                opts.force = true;
+                break;
+
+            case 'n': // :plan
+                opts.plan = optarg;
+                opts.dry = true;
+                if (!verbosity_set)
+                    opts.ll = LL_Info;
+                break;
+
+            case 'a': // :apply
+                opts.apply = optarg;
+                break;
+
+            case 't': // :trace
+                opts.trace = optarg;
+                break;
+
+            case 'o': // :log-dir
+                opts.log_dir = optarg;
+                break;
+
+            case 'w': // :watch
+                opts.watch = true;
+                break;
+
+            case 'S': // :daemon
+                opts.daemon = true;
+                break;
+
+            case 'C': // :connect
+                opts.connect = true;
+                break;
+
             case '?':
                 die("Failed to parse arguments");
 
@@ -1131,6 +6743,7 @@ struct arg_options parse_args(const int argc, char **argv)
 Sizes installers_to_run(const int argc, char **argv)
 {
     Sizes to_run = zero(Sizes);
+    _da_scoped(&to_run);
     for (size_t i = optind; i < argc; i += 1) {
         msg(LL_Debug, "Checking if installer %s exists", argv[i]);
         ssize_t idx = -1;
@@ -1184,7 +6797,19 @@ int main(int argc, char **argv)
     if (opts.exit)
         return 0;
 
+    // Nothing is discovered or compiled, the daemon has all of it
+    if (opts.connect) {
+        log_min_level = opts.ll;
+        const int status = daemon_request(opts.list ? "list" : opts.dry ? "dry" : "run", argc, argv);
+#ifdef SHEBANG
+        unlink(prog);
+#endif
+        return status;
+    }
+
     init_state(&opts);
+    // Set to 1 once anything failed
+    int status = 0;
 
     if (opts.list) {
         printf("Available installers:\n");
@@ -1194,13 +6819,44 @@ int main(int argc, char **argv)
         goto exit;
     }
 
+    if (opts.plan && opts.apply)
+        die("'--plan' and '--apply' can not be combined");
+    if (opts.watch && opts.apply)
+        die("'--watch' and '--apply' can not be combined");
+    if (opts.daemon && (opts.watch || opts.plan || opts.apply || opts.dry))
+        die("'--daemon' can not be combined with '--watch', '--plan', '--apply' or '--dry'");
+    if (opts.daemon) {
+        if (!run_daemon()) {
+            msg(LL_Error, "The daemon could not be started");
+            status = 1;
+        }
+        _log_flush();
+        printf(":: Finished\n");
+        goto exit;
+    }
+    if (opts.apply) {
+        Fd fd = open(opts.apply, O_RDONLY | O_CLOEXEC);
+        if (INVALID_FILE_DES == fd)
+            die("Failed to open plan '%s':", opts.apply);
+        _Plan_Ops ops = zero(_Plan_Ops);
+        const bool loaded = load_plan(fd, &ops);
+        close(fd);
+        if (!loaded || 0 < run_plan(ops)) {
+            msg(LL_Error, "The plan was not fully applied");
+            status = 1;
+        }
+        _log_flush();
+        printf(":: Finished\n");
+        goto exit;
+    }
+
     Sizes to_run = installers_to_run(argc, argv);
     assert(to_run.len > 0);
 
     if (state.dry)
         msg(LL_Info, "Running in dry mode");
 
-    if (opts.confirm || state.min_level <= LL_Debug) {
+    if (opts.confirm || log_min_level <= LL_Debug) {
         printf("Running following installers:\n");
         for (size_t i = 0; i < to_run.len; i += 1)
             printf("- %s\n", state.available.items[to_run.items[i]].name);
@@ -1210,19 +6866,26 @@ int main(int argc, char **argv)
         goto exit;
     }
 
-    for (size_t i = 0; i < to_run.len; i += 1) {
-        Installer *inst = &state.available.items[to_run.items[i]];
-        printf(":: Running %s\n", inst->name);
-        run_installer(inst, zero(Context));
-    }
+    size_t failures = run_installers(to_run);
+    if (0 < failures)
+        msg(LL_Error, "%zu installer%s did not finish",
+            failures, 1 == failures ? "" : "s");
+    if (opts.watch)
+        watch_installers(to_run);
+    _Plan_Ops ops = zero(_Plan_Ops);
+    if (INVALID_FILE_DES != state.plan_fd && load_plan(state.plan_fd, &ops))
+        failures += run_plan(ops);
+    status = 0 < failures;
+    _log_flush();
     printf(":: Finished\n");
 
 exit:
 #ifdef SHEBANG // defined when compiling with the shebang
     // TODO: Give the user the capability to keep the compiled sys-setup executable
-    rm(strs(prog));
+    // Not through rm, it would end up in the plan and be skipped by --dry
+    unlink(prog);
 #endif
     cleanup_state();
     printf("\nSo long, and thanks for all the fish!\n");
-    return 0;
+    return status;
 }
@@ -1,4 +1,14 @@
 #include "../installer.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 Setup_Result setup(Context ctx)
 {
@@ -6,10 +16,581 @@ Setup_Result setup(Context ctx)
     return setup_ok();
 }
 
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void test_cp()
+{
+    char *from = "./test/test_dirs/d1/g.txt";
+    char *to = "./test/test_dirs_cp.txt";
+    struct stat a, b;
+    assert(0 == stat(from, &a));
+    assert(cp(from, to));
+    assert(0 == stat(to, &b));
+    assert(a.st_size == b.st_size);
+    assert((a.st_mode & 07777) == (b.st_mode & 07777));
+    assert(a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec);
+    assert(0 == rm(strs(to)));
+}
+
+static void test_cp_dir_sync(Tree_Node *dirs)
+{
+    char *to = "./test/test_dirs_sync";
+    Cp_Stats stats;
+    assert(cp_dir_sync(dirs, to, NULL, CP_Sync | CP_Prune, &stats));
+    assert(cp_dir_sync(dirs, to, NULL, CP_Sync | CP_Prune, &stats));
+    assert(stats.copied == 0 && stats.deleted == 0 && stats.skipped > 0);
+    const size_t files = stats.skipped;
+
+    // Changed permissions are copied as well
+    struct stat st;
+    assert(0 == chmod("./test/test_dirs_sync/d1/g.txt", 0600));
+    assert(cp_dir_sync(dirs, to, NULL, CP_Sync | CP_Prune, &stats));
+    assert(stats.copied == 1);
+    assert(0 == stat("./test/test_dirs_sync/d1/g.txt", &st) && 0600 != (st.st_mode & 07777));
+
+    int fd = open("./test/test_dirs_sync/d1/stale.txt", O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+    assert(0 == rm(strs("./test/test_dirs_sync/d1/g.txt")));
+    assert(cp_dir_sync(dirs, to, NULL, CP_Hash | CP_Prune, &stats));
+    assert(stats.copied == 1 && stats.deleted == 1 && stats.skipped == files - 1);
+
+    // The contents of directories below max_depth are unknown and must be kept
+    Tree_Node shallow;
+    assert(tree("./test/test_dirs", FF_Any, 1, &shallow));
+    assert(cp_dir_sync(&shallow, to, NULL, CP_Sync | CP_Prune, &stats));
+    assert(stats.deleted == 0);
+    assert(0 == access("./test/test_dirs_sync/d1/d1/c.txt", F_OK));
+    assert(0 == cmd_exec(strs("rm", "-r", to)));
+}
+
+static bool skip_g(const Tree_Node *node)
+{
+    return strcmp(strrchr(node->name, '/'), "/g.txt") != 0;
+}
+
+static void test_link_dir(Tree_Node *dirs)
+{
+    char *to = "./test/test_dirs_link";
+    struct stat s;
+    // A missing destination becomes a single link
+    assert(link_dir(dirs, to, NULL));
+    assert(0 == lstat(to, &s) && S_ISLNK(s.st_mode));
+    assert(link_dir(dirs, to, NULL));
+
+    // Only the directories containing excluded files are unfolded
+    assert(link_dir(dirs, to, skip_g));
+    assert(0 == lstat(to, &s) && S_ISDIR(s.st_mode));
+    assert(0 == lstat("./test/test_dirs_link/d1", &s) && S_ISDIR(s.st_mode));
+    assert(0 == lstat("./test/test_dirs_link/d1/d1", &s) && S_ISLNK(s.st_mode));
+    assert(0 == lstat("./test/test_dirs_link/d2", &s) && S_ISLNK(s.st_mode));
+    assert(-1 == lstat("./test/test_dirs_link/d1/g.txt", &s));
+
+    // A copy of the source is replaced by a link
+    int fd = open("./test/test_dirs_link/d1/g.txt", O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+    assert(link_dir(dirs, to, NULL));
+    assert(0 == lstat("./test/test_dirs_link/d1/g.txt", &s) && S_ISLNK(s.st_mode));
+
+    // A different file in the way is a conflict, nothing is changed then
+    assert(0 == rm(strs("./test/test_dirs_link/d1/g.txt")));
+    fd = open("./test/test_dirs_link/d1/g.txt", O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    assert(1 == write(fd, "x", 1));
+    close(fd);
+    assert(0 == rm(strs("./test/test_dirs_link/d2")));
+    assert(!link_dir(dirs, to, NULL));
+    assert(-1 == lstat("./test/test_dirs_link/d2", &s));
+    assert(0 == cmd_exec(strs("rm", "-r", to)));
+}
+
+static void test_scope()
+{
+    const size_t scope = scope_push();
+    char *a = concat("scoped", "-", "string");
+    Strings list = strs("a", "b");
+    for (size_t i = 0; i < 1000; i += 1)
+        da_append(&list, a);
+    assert(list.len == 1002 && strcmp(list.items[1001], "scoped-string") == 0);
+    scope_pop(scope);
+
+    // The memory of the popped scope is reused
+    assert(a == concat("scoped", "-", "string"));
+}
+
+static void test_await()
+{
+    // More output than fits into a pipe on both streams
+    Cmd cmd = strs("sh", "-c", "head -c 300000 /dev/zero; head -c 200000 /dev/zero >&2; exit 3");
+    Buffer out = zero(Buffer), err = zero(Buffer);
+    assert(3 == cmd_execw(cmd, NULL, &out, &err));
+    assert(out.len == 300000 && err.len == 200000);
+
+    out = zero(Buffer);
+    Process p = cmd_execa(strs("sh", "-c", "echo forwarded; cat; printf 'no newline' >&2"),
+                          IOR_stdin | IOR_forward);
+    assert(prcs_write(p, "from stdin\n"));
+    assert(prcs_await(&p, &out, NULL));
+    assert(WIFEXITED(p.status) && 0 == WEXITSTATUS(p.status));
+    assert(out.len == strlen("forwarded\nfrom stdin\n"));
+}
+
+static void test_exec_many()
+{
+    enum { N = 300 };
+    Cmd cmds[N];
+    Cmd_Result results[N];
+    char num[16];
+    for (size_t i = 0; i < N; i += 1) {
+        snprintf(num, sizeof(num), "%zu", i);
+        cmds[i] = strs("sh", "-c", "echo $0; exit $(($0 % 100 == 0))", num);
+    }
+
+    double start = now_s();
+    for (size_t i = 0; i < N; i += 1) {
+        Buffer out = zero(Buffer);
+        cmd_execw(cmds[i], NULL, &out, NULL);
+    }
+    const double sequential = now_s() - start;
+
+    start = now_s();
+    assert(N / 100 == cmd_exec_many(cmds, N, 0, results));
+    const double parallel = now_s() - start;
+    for (size_t i = 0; i < N; i += 1) {
+        snprintf(num, sizeof(num), "%zu\n", i);
+        assert(results[i].code == (i % 100 == 0));
+        assert(results[i].out.len == strlen(num) && 0 == memcmp(results[i].out.items, num, strlen(num)));
+    }
+    msg(LL_Info, "%d commands: %.3fs sequential, %.3fs with cmd_exec_many", N, sequential, parallel);
+}
+
+static void test_pkg_index()
+{
+    char *prev = pkg_db("./test/pkg_db");
+    assert(is_installed("bash") && is_installed("lib32-glibc"));
+    assert(!is_installed("bas") && !is_installed("glibc"));
+    assert(0 == strcmp(pkg_version("neovim"), "0.10.4-1"));
+    // Nothing to do, so no transaction is started
+    assert(install_pkgs(strs("bash", "neovim")));
+    pkg_db(prev);
+}
+
+static void test_exe_index()
+{
+    assert(exe_exists("sh") && exes_exist(strs("sh", "cat", "/bin/sh")));
+    assert(!exe_exists("sys-setup-test-tool"));
+
+    // New executables are found once their directory changed, misses only
+    // check for that again after a command ran or a file was written
+    char *dir = "./test/test_bin";
+    char *path = concat(getenv("PATH"));
+    assert(0 == mkdir(dir, 0755));
+    setenv("PATH", concat(dir, ":", path), 1);
+    assert(!exe_exists("sys-setup-test-tool"));
+    assert(0 == cmd_exec(strs("install", "-m", "755", "/dev/null", "./test/test_bin/sys-setup-test-tool")));
+    assert(exe_exists("sys-setup-test-tool"));
+    assert(!exe_exists("sys-setup-test-copy"));
+    assert(cp("./test/test_bin/sys-setup-test-tool", "./test/test_bin/sys-setup-test-copy"));
+    assert(exe_exists("sys-setup-test-copy"));
+    setenv("PATH", path, 1);
+    assert(!exe_exists("sys-setup-test-tool"));
+    assert(0 == cmd_exec(strs("rm", "-r", dir)));
+}
+
+static size_t count_lines(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+    Buffer buf = read_all(fd);
+    close(fd);
+    size_t lines = 0;
+    for (size_t i = 0; i < buf.len; i += 1)
+        lines += buf.items[i] == '\n';
+    return lines;
+}
+
+// Assumes that sys-setup is not run with --force
+static void test_journal()
+{
+    char *dir = "./test/test_journal";
+    assert(0 == mkdir(dir, 0755));
+    // Unique input, so steps of earlier test runs do not match
+    char content[64];
+    int len = snprintf(content, sizeof(content), "%d %f\n", getpid(), now_s());
+    int fd = open("./test/test_journal/input", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd != -1 && len == write(fd, content, len));
+    close(fd);
+
+    Cmd cmd = strs("sh", "-c", "echo >> runs && cp input output");
+    Strings inputs = strs("input");
+    Strings outputs = strs("output");
+    assert(0 == chdir(dir));
+    assert(0 == cmd_execj(cmd, inputs, outputs));
+    assert(0 == cmd_execj(cmd, inputs, outputs));
+    assert(1 == count_lines("runs"));
+
+    // Changed inputs and missing outputs run the step again
+    fd = open("input", O_WRONLY | O_APPEND);
+    assert(fd != -1 && 1 == write(fd, "\n", 1));
+    close(fd);
+    assert(0 == cmd_execj(cmd, inputs, outputs));
+    assert(2 == count_lines("runs"));
+    assert(0 == rm(outputs));
+    assert(0 == cmd_execj(cmd, inputs, outputs));
+    assert(0 == cmd_execj(cmd, inputs, outputs));
+    assert(3 == count_lines("runs"));
+
+    assert(0 == chdir("../.."));
+    assert(0 == cmd_exec(strs("rm", "-r", dir)));
+}
+
+// :http fixture
+// Bodies of the fixture server are generated from their offset
+#define HTTP_LARGE (3 << 20)
+#define HTTP_CHUNKED (1 << 20)
+#define HTTP_INTERRUPTED (2 << 20)
+
+static char body_at(size_t i)
+{
+    return 'a' + (i * 7 + i / 1021) % 26;
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+        if (w <= 0)
+            _exit(0);
+        data += w;
+        len -= w;
+    }
+}
+
+static void send_body(int fd, size_t from, size_t to)
+{
+    char buf[1 << 16];
+    while (from < to) {
+        size_t n = to - from < sizeof(buf) ? to - from : sizeof(buf);
+        for (size_t i = 0; i < n; i += 1)
+            buf[i] = body_at(from + i);
+        send_all(fd, buf, n);
+        from += n;
+    }
+}
+
+// Serves: /large (supports Range with the ETag "v1" as If-Range), /chunked, /interrupted (the first request
+// ends after half of the body), /redirect, /echo (POST), /version (its number as body and ETag, supports
+// If-None-Match), /bump (increments the version) and 404 otherwise.
+static void serve(int fd, bool *interrupted, int *version)
+{
+    char req[8192];
+    size_t len = 0;
+    char *end = NULL;
+    while (!end && len < sizeof(req) - 1) {
+        ssize_t r = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (r <= 0)
+            return;
+        len += r;
+        req[len] = '\0';
+        end = strstr(req, "\r\n\r\n");
+    }
+    char method[8], path[256];
+    if (!end || 2 != sscanf(req, "%7s %255s", method, path))
+        return;
+    size_t from = 0;
+    char *range = strstr(req, "\r\nRange: bytes=");
+    char *if_range = strstr(req, "\r\nIf-Range: ");
+    if (if_range && 0 != strncmp(if_range + strlen("\r\nIf-Range: "), "\"v1\"\r\n", 6))
+        range = NULL;
+    if (range)
+        from = strtoull(range + strlen("\r\nRange: bytes="), NULL, 10);
+
+    char head[512];
+    if (0 == strcmp(path, "/large") || 0 == strcmp(path, "/interrupted")) {
+        const size_t size = 0 == strcmp(path, "/large") ? HTTP_LARGE : HTTP_INTERRUPTED;
+        if (range)
+            snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\n"
+                     "ETag: \"v1\"\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                     size - from, from, size - 1, size);
+        else
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+                     "ETag: \"v1\"\r\n\r\n", size);
+        send_all(fd, head, strlen(head));
+        const bool cut = size == HTTP_INTERRUPTED && !*interrupted;
+        *interrupted |= cut;
+        send_body(fd, from, cut ? size / 2 : size);
+    } else if (0 == strcmp(path, "/chunked")) {
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+        send_all(fd, head, strlen(head));
+        for (size_t at = 0, n = 1; at < HTTP_CHUNKED; at += n, n = n * 3 + 1) {
+            if (n > HTTP_CHUNKED - at)
+                n = HTTP_CHUNKED - at;
+            snprintf(head, sizeof(head), "%zx\r\n", n);
+            send_all(fd, head, strlen(head));
+            send_body(fd, at, at + n);
+            send_all(fd, "\r\n", 2);
+        }
+        send_all(fd, "0\r\nX-Trailer: yes\r\n\r\n", 24);
+    } else if (0 == strcmp(path, "/version")) {
+        char etag[32];
+        snprintf(etag, sizeof(etag), "\"%d\"", *version);
+        char *known = strstr(req, "\r\nIf-None-Match: ");
+        if (known && 0 == strncmp(known + strlen("\r\nIf-None-Match: "), etag, strlen(etag)))
+            snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
+        else
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nETag: %s\r\n\r\n%d",
+                     strlen(etag) - 2, etag, *version);
+        send_all(fd, head, strlen(head));
+    } else if (0 == strcmp(path, "/bump")) {
+        *version += 1;
+        snprintf(head, sizeof(head), "HTTP/1.1 204 No Content\r\n\r\n");
+        send_all(fd, head, strlen(head));
+    } else if (0 == strcmp(path, "/redirect")) {
+        snprintf(head, sizeof(head), "HTTP/1.1 302 Found\r\nLocation: /large\r\nContent-Length: 0\r\n\r\n");
+        send_all(fd, head, strlen(head));
+    } else if (0 == strcmp(path, "/echo") && 0 == strcmp(method, "POST")) {
+        char *cl = strstr(req, "\r\nContent-Length: ");
+        size_t size = cl ? strtoull(cl + strlen("\r\nContent-Length: "), NULL, 10) : 0;
+        snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", size);
+        send_all(fd, head, strlen(head));
+        size_t have = len - (end + 4 - req);
+        send_all(fd, end + 4, have);
+        for (char buf[4096]; have < size;) {
+            ssize_t r = recv(fd, buf, sizeof(buf), 0);
+            if (r <= 0)
+                return;
+            send_all(fd, buf, r);
+            have += r;
+        }
+    } else {
+        snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        send_all(fd, head, strlen(head));
+    }
+}
+
+// Returns the pid of the server, which accepts connections on `port`.
+static pid_t start_server(int *port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    assert(sock != -1);
+    assert(0 == bind(sock, (struct sockaddr*) &addr, sizeof(addr)));
+    assert(0 == listen(sock, 64));
+    assert(0 == getsockname(sock, (struct sockaddr*) &addr, &len));
+    *port = ntohs(addr.sin_port);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) {
+        // Requests are served one after another, so the cut happens only once
+        bool interrupted = false;
+        int version = 1;
+        while (true) {
+            int fd = accept(sock, NULL, NULL);
+            if (fd == -1)
+                continue;
+            serve(fd, &interrupted, &version);
+            close(fd);
+        }
+    }
+    close(sock);
+    return pid;
+}
+
+static bool check_body(char *path, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    char buf[1 << 16];
+    size_t at = 0;
+    for (ssize_t r; (r = read(fd, buf, sizeof(buf))) > 0; at += r) {
+        for (ssize_t i = 0; i < r; i += 1) {
+            if (buf[i] != body_at(at + i)) {
+                close(fd);
+                return false;
+            }
+        }
+    }
+    close(fd);
+    return at == size;
+}
+
+static bool check_file(char *path, char *content)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    Buffer buf = read_all(fd);
+    close(fd);
+    return buf.len == strlen(content) && 0 == memcmp(buf.items, content, buf.len);
+}
+
+static void test_http()
+{
+    int port;
+    pid_t server = start_server(&port);
+    char base[64];
+    snprintf(base, sizeof(base), "http://127.0.0.1:%d", port);
+    char *dir = "./test/test_http";
+    assert(0 == mkdir(dir, 0755));
+
+    char *urls[] = {
+        concat(base, "/large"), concat(base, "/chunked"),
+        concat(base, "/interrupted"), concat(base, "/redirect"),
+    };
+    char *paths[] = {
+        concat(dir, "/large"), concat(dir, "/chunked"),
+        concat(dir, "/interrupted"), concat(dir, "/redirect"),
+    };
+    // Parts of another version of the body are replaced
+    char *stale = concat(dir, "/stale");
+    int fd = open(concat(stale, ".part"), O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1 && 5 == write(fd, "stale", 5));
+    close(fd);
+    fd = open(concat(stale, ".part.validator"), O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1 && 4 == write(fd, "\"v0\"", 4));
+    close(fd);
+    assert(dwnld(urls[0], stale));
+    assert(check_body(stale, HTTP_LARGE) && !exists(concat(stale, ".part.validator"), FF_Any));
+
+    assert(0 == dwnld_many(urls, paths, 4));
+    assert(check_body(paths[0], HTTP_LARGE));
+    assert(check_body(paths[1], HTTP_CHUNKED));
+    assert(check_body(paths[2], HTTP_INTERRUPTED));
+    assert(check_body(paths[3], HTTP_LARGE));
+
+    assert(NULL == http_get(concat(base, "/missing")).items);
+    Buffer chunked = http_get(urls[1]);
+    assert(chunked.len == HTTP_CHUNKED && chunked.items[HTTP_CHUNKED - 1] == body_at(HTTP_CHUNKED - 1));
+    char data[] = "post\0data";
+    Buffer echo = http_post(concat(base, "/echo"), (Buffer) { data, sizeof(data), sizeof(data) });
+    assert(echo.len == sizeof(data) && 0 == memcmp(echo.items, data, sizeof(data)));
+
+    // Cached downloads are used until the server has a new version
+    char *version = concat(base, "/version");
+    assert(dwnld(version, concat(dir, "/v1")) && check_file(concat(dir, "/v1"), "1"));
+    assert(dwnld(version, concat(dir, "/v1-again")) && check_file(concat(dir, "/v1-again"), "1"));
+    http_get(concat(base, "/bump"));
+    assert(dwnld(version, concat(dir, "/v2")) && check_file(concat(dir, "/v2"), "2"));
+
+    // Served from the download cache once the server is gone
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    assert(dwnld(urls[0], concat(dir, "/cached")));
+    assert(check_body(concat(dir, "/cached"), HTTP_LARGE));
+    assert(0 == cmd_exec(strs("rm", "-r", dir)));
+}
+
+// Runs in a dry sys-setup started by test_plan, paths contain tabs and
+// newlines to check their escaping in the plan.
+static void record_plan()
+{
+    Tree_Node src;
+    assert(tree("./test/test_plan/src", FF_Any, 10, &src));
+    // The second copy only repeats mkdirs and copies of the first batch
+    assert(cp_dir(&src, "./test/test_plan/dst", NULL));
+    assert(cp_dir(&src, "./test/test_plan/dst", NULL));
+    assert(cp("./test/test_plan/src/a\tb/c\nd.txt", "./test/test_plan/dst/e\tf.txt"));
+    assert(0 == rm(strs("./test/test_plan/old\nfile")));
+    assert(link_dir(&src, "./test/test_plan/link", NULL));
+    assert(0 == cmd_exec(strs("touch", "./test/test_plan/x\ty")));
+}
+
+static void test_plan()
+{
+    assert(0 == cmd_exec(strs("mkdir", "-p", "./test/test_plan/src/a\tb")));
+    int fd = open("./test/test_plan/src/a\tb/c\nd.txt", O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1 && 4 == write(fd, "plan", 4));
+    close(fd);
+    fd = open("./test/test_plan/old\nfile", O_CREAT | O_WRONLY, 0644);
+    assert(fd != -1);
+    close(fd);
+
+    Buffer out = zero(Buffer), err = zero(Buffer);
+    setenv("SYS_SETUP_RECORD_PLAN", "1", 1);
+    int code = cmd_execw(strs("/proc/self/exe", "--dry", "--plan", "./test/test_plan.plan", "test"),
+                         NULL, &out, &err);
+    unsetenv("SYS_SETUP_RECORD_PLAN");
+    assert(0 == code && !exists("./test/test_plan/dst", FF_Any));
+
+    out.len = 0;
+    assert(0 == cmd_execw(strs("/proc/self/exe", "--apply", "./test/test_plan.plan"), NULL, &out, &err));
+    da_append(&out, '\0');
+    assert(strstr(out.items, ":: Plan: 10 operations, 3 without effect"));
+    struct stat s;
+    assert(check_file("./test/test_plan/dst/a\tb/c\nd.txt", "plan"));
+    assert(check_file("./test/test_plan/dst/e\tf.txt", "plan"));
+    assert(-1 == lstat("./test/test_plan/old\nfile", &s));
+    assert(0 == lstat("./test/test_plan/link", &s) && S_ISLNK(s.st_mode));
+    assert(check_file("./test/test_plan/link/a\tb/c\nd.txt", "plan"));
+    assert(exists("./test/test_plan/x\ty", FF_File));
+    assert(0 == cmd_exec(strs("rm", "-r", "./test/test_plan", "./test/test_plan.plan")));
+}
+
+// Only run if SYS_SETUP_BENCH is set, copies files from 1 KiB up to 1 GiB.
+static void bench_cp()
+{
+    static const size_t sizes[] = { 1 << 10, 32 << 10, 1 << 20, 32 << 20, 1 << 30 };
+    char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char *from = concat(dir, "/sys-setup-bench-cp.src");
+    char *to = concat(dir, "/sys-setup-bench-cp.dst");
+
+    printf("%12s %12s %12s %14s\n", "size [B]", "time [s]", "MiB/s", "max rss [KiB]");
+    char chunk[1 << 16];
+    for (size_t i = 0; i < sizeof(chunk); i += 1)
+        chunk[i] = (char) (i * 31 + 7);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i += 1) {
+        int fd = open(from, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        assert(fd != -1);
+        for (size_t written = 0; written < sizes[i];) {
+            size_t n = sizes[i] - written < sizeof(chunk) ? sizes[i] - written : sizeof(chunk);
+            ssize_t w = write(fd, chunk, n);
+            assert(w > 0);
+            written += w;
+        }
+        close(fd);
+
+        const double start = now_s();
+        assert(cp(from, to));
+        const double took = now_s() - start;
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("%12zu %12.6f %12.1f %14ld\n", sizes[i], took,
+               sizes[i] / (1024.0 * 1024.0) / took, ru.ru_maxrss);
+    }
+    rm(strs(from, to));
+}
+
 bool run_install() {
+    if (getenv("SYS_SETUP_RECORD_PLAN")) {
+        record_plan();
+        return true;
+    }
     Tree_Node dirs;
     tree("./test/test_dirs", FF_Any, 10, &dirs);
     cp_dir(&dirs, "./test/test_dirs_copy", NULL);
+
+    test_cp();
+    test_scope();
+    test_await();
+    test_exec_many();
+    test_pkg_index();
+    test_exe_index();
+    test_http();
+    test_journal();
+    test_cp_dir_sync(&dirs);
+    test_link_dir(&dirs);
+    test_plan();
+    if (getenv("SYS_SETUP_BENCH"))
+        bench_cp();
     return true;
 }
 